@@ -1,6 +1,11 @@
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
 #include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <filesystem>
 
 #include "filesystem_utils.h"
@@ -63,24 +68,79 @@ bool FSLocal::exists(string file) {
 	return fs::exists(getFullPath(file));
 }
 
+// Reads the file from offset as it is, with one allocation
 int FSLocal::read(string file, string &data, int offset) {
+	return readRange(file, data, offset, string::npos);
+}
+
+int FSLocal::readRange(string file, string &data, uint64_t offset, size_t length) {
 	file = getFullPath(file);
 
-	ifstream infile(file);
-	if(infile.fail()) {
+	int fd = open(file.c_str(), O_RDONLY);
+	if(fd < 0) {
 		return -1;
 	}
 
-	string line;
-	data = "";
-	while (getline(infile, line)) {
-		data += line + "\n";
+	struct stat st;
+	if(fstat(fd, &st) == -1 || offset > (uint64_t)st.st_size) {
+		close(fd);
+		return -1;
 	}
 
-	// Return if there was an error while reading file
-	// Dont check fail as getline sets fail bit when eof is reached
-	int success = infile.bad() ? -1 : 0;
-	return success;
+	data.resize(min<uint64_t>(length, st.st_size - offset));
+	size_t done = 0;
+	while(done < data.size()) {
+		ssize_t n = pread(fd, &data[done], data.size() - done, offset + done);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	close(fd);
+
+	// The file shrank while it was read
+	data.resize(done);
+	return 0;
+}
+
+/*
+	Maps the range into memory. Mappings start on a page, so the one
+	made may begin before offset; the view only shows the range.
+*/
+int FSLocal::readView(string file, shared_ptr<FileView> &view, uint64_t offset, size_t length) {
+	file = getFullPath(file);
+
+	int fd = open(file.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || offset > (uint64_t)st.st_size) {
+		close(fd);
+		return -1;
+	}
+
+	size_t size = min<uint64_t>(length, st.st_size - offset);
+	if(size == 0) {
+		close(fd);
+		view = make_shared<FileView>(string());
+		return 0;
+	}
+
+	uint64_t pageOffset = offset - offset % sysconf(_SC_PAGESIZE);
+	size_t mapLength = size + (offset - pageOffset);
+	void *map = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, pageOffset);
+	close(fd);
+	if(map == MAP_FAILED) {
+		return -1;
+	}
+
+	view = make_shared<FileView>(map, mapLength, string_view((char*)map + (offset - pageOffset), size));
+	return 0;
 }
 
 int FSLocal::write(std::string file, std::string data, bool createDirectories, bool overwrite) {
@@ -115,9 +175,12 @@ int FSLocal::remove(string file) {
 	return (numDeleted > 0) ? 0 : -1;
 }
 
-/* TODO: implement */
+// Renames file to dest, replacing dest if it exists
 int FSLocal::move(string file, string dest) {
-	return -1;
+
+	error_code ec;
+	fs::rename(getFullPath(file), getFullPath(dest), ec);
+	return ec ? -1 : 0;
 }
 
 /* TODO: implement */
@@ -9,6 +9,9 @@ public:
     virtual int create(std::string file, bool folder, bool createDirectories);
 	virtual bool exists(std::string file);
 	virtual int read(std::string file, std::string &data, int offset = 0);
+	virtual int readRange(std::string file, std::string &data, uint64_t offset, size_t length);
+	virtual int readView(std::string file, std::shared_ptr<FileView> &view,
+						uint64_t offset = 0, size_t length = std::string::npos);
 	virtual int write(std::string file, std::string data, bool createDirectories, bool overwrite);
 	virtual int move(std::string file, std::string dest);
 	virtual int copy(std::string src, std::string dest);
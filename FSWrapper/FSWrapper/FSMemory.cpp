@@ -101,6 +101,30 @@ int FSMemory::read(string file, string &data, int offset) {
 	return success;
 }
 
+int FSMemory::readRange(string file, string &data, uint64_t offset, size_t length) {
+
+	shared_ptr<FSTreeNode> node = getTreeNode(filetree, file, false, false);
+
+	if(!node || node->folder || offset > node->data.length()) {
+		return -1;
+	}
+
+	data = node->data.substr(offset, length);
+	return 0;
+}
+
+// Files live in memory already, so the view holds a copy of the range
+int FSMemory::readView(string file, shared_ptr<FileView> &view, uint64_t offset, size_t length) {
+
+	string data;
+	if(readRange(file, data, offset, length) == -1) {
+		return -1;
+	}
+
+	view = make_shared<FileView>(std::move(data));
+	return 0;
+}
+
 // append to file or create if it doesn't exist
 // if overwrite, replaces the current data
 // if createDirectories, create intermediate directories.
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
 
+#include "FileView.h"
+
 class FSWrapper {
 
 // TODO: change string args to references
@@ -13,6 +17,15 @@ public:
 	virtual int create(std::string file, bool folder, bool createDirectories) = 0;
 	virtual bool exists(std::string file) = 0;
 	virtual int read(std::string file, std::string &data, int offset = 0) = 0;
+
+	// Copies up to length bytes of file from offset into data, fewer at
+	// the end of the file. Fails if offset is past the end.
+	virtual int readRange(std::string file, std::string &data, uint64_t offset, size_t length) = 0;
+
+	// Like readRange, but returns a read-only view of the bytes that
+	// copies nothing where the filesystem can map the file instead
+	virtual int readView(std::string file, std::shared_ptr<FileView> &view,
+						uint64_t offset = 0, size_t length = std::string::npos) = 0;
 	virtual int write(std::string file, std::string data, bool createDirectories, bool overwrite) = 0;
 	virtual int move(std::string file, std::string dest) = 0;
 	virtual int copy(std::string src, std::string dest) = 0;
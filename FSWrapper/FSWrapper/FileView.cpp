@@ -0,0 +1,19 @@
+#include <sys/mman.h>
+
+#include "FileView.h"
+
+using namespace std;
+
+FileView::FileView(void *map, size_t mapLength, string_view data) : map(map), mapLength(mapLength), bytes(data) {
+
+}
+
+FileView::FileView(string data) : owned(std::move(data)) {
+	bytes = owned;
+}
+
+FileView::~FileView() {
+	if(map != NULL) {
+		munmap(map, mapLength);
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/*
+	Read-only contents of a file, or of a range of one, as returned by
+	FSWrapper::readView. A view of a local file is a memory mapping, so
+	nothing is copied and pages are only read as they are touched. The
+	view stays valid as long as the last shared_ptr to it, even if the
+	file is replaced meanwhile; a file that shrinks under a mapping
+	must not be read past its new end.
+*/
+class FileView {
+
+public:
+	// Takes over a mapping of mapLength bytes at map. data is the part of it shown.
+	FileView(void *map, size_t mapLength, std::string_view data);
+
+	// Holds data itself
+	FileView(std::string data);
+
+	virtual ~FileView();
+
+	FileView(const FileView&) = delete;
+	FileView& operator=(const FileView&) = delete;
+
+	std::string_view data() const { return bytes; }
+	size_t size() const { return bytes.size(); }
+
+private:
+	void *map = NULL;
+	size_t mapLength = 0;
+	std::string owned;
+	std::string_view bytes;
+};
@@ -54,6 +54,23 @@ void printWithSeparator(const vector<string> &tokens, string sep)
 	cout << "\n";
 }
 
+// Parses none, quorum, all or default into policy
+bool parseAckPolicy(const string &name, Request::AckPolicy &policy)
+{
+	if(name == "none") {
+		policy = Request::ACK_NONE;
+	} else if(name == "quorum") {
+		policy = Request::ACK_QUORUM;
+	} else if(name == "all") {
+		policy = Request::ACK_ALL;
+	} else if(name == "default") {
+		policy = Request::ACK_DEFAULT;
+	} else {
+		return false;
+	}
+	return true;
+}
+
 // Return a pointer to a timestamp containing the current time
 Timestamp* Client::getCurrentTimestamp() {
 	google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
@@ -126,7 +143,10 @@ string Client::getCommand() const
 	string input;
 	while (true) {
 		cout << CMD_INPUT;
-		getline(cin, input);
+		// Input closed, as when commands are piped in from a script
+		if(!getline(cin, input)) {
+			exit(0);
+		}
 		size_t index = input.find_first_of(" ");
 		if (index != string::npos) {
 			string cmd = input.substr(0, index);
@@ -296,6 +316,7 @@ IReply Client::Login()
 	Request request;
 	Reply reply;
 	request.set_username(username);
+	request.set_ack_policy(ackPolicy);
 
 	timestampRequest(&request);
 	Status status = stub_->Login(&context, request, &reply);
@@ -355,6 +376,7 @@ IReply Client::Follow(const string &username2)
 	Request request;
 	Reply reply;
 	request.set_username(username);
+	request.set_ack_policy(ackPolicy);
 	request.add_arguments(username2);
 
 	timestampRequest(&request);
@@ -380,6 +402,7 @@ IReply Client::UnFollow(const string &username2)
 	Request request;
 	Reply reply;
 	request.set_username(username);
+	request.set_ack_policy(ackPolicy);
 	request.add_arguments(username2);
 
 	timestampRequest(&request);
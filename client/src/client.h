@@ -26,6 +26,7 @@ using namespace SNS;
 // Utilities
 void toUpperCase(std::string &str);
 void printWithSeparator(const std::vector<std::string> &tokens, std::string sep = ", ");
+bool parseAckPolicy(const std::string &name, Request::AckPolicy &policy);
 
 struct IReply
 {
@@ -47,6 +48,9 @@ public:
         : hostname(host), port(portNumber), username(user) {};
     virtual ~Client() {};
 	void run();
+
+	// Ack policy sent with every write, ACK_DEFAULT for the server's
+	void setAckPolicy(Request::AckPolicy policy) { ackPolicy = policy; }
 	
 private:
     
@@ -56,6 +60,7 @@ private:
 	ID id;
 	ServerInfo server;
 	bool inChat = false;
+	Request::AckPolicy ackPolicy = Request::ACK_DEFAULT;
 
 	std::unique_ptr<SNSService::Stub> stub_;
 	std::unique_ptr<CoordService::Stub> coordStub_;
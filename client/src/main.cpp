@@ -1,18 +1,191 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <random>
 #include <string>
+#include <thread>
 
 #include "client.h"
 
 using namespace std;
 
+/*
+	Calls GetServer on the coordinator from threads threads, each with
+	its own connection and client ID, for seconds seconds, and prints the
+	calls per second. Clients call it every 5 seconds, so this is the
+	coordinator's busiest read.
+*/
+void runCoordinatorLoad(string hostname, string port, int threads, int seconds) {
+
+	atomic<long> calls{0};
+	atomic<long> failed{0};
+	chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::seconds(seconds);
+
+	vector<thread> workers;
+	for(int i = 0; i < threads; i++) {
+		workers.emplace_back([&]() {
+			grpc::ChannelArguments args;
+			args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+			unique_ptr<CoordService::Stub> stub = CoordService::NewStub(
+				grpc::CreateCustomChannel(hostname + ":" + port, grpc::InsecureChannelCredentials(), args));
+
+			ID id;
+			{
+				grpc::ClientContext context;
+				ClientRequest request;
+				if(!stub->GetUniqueClientID(&context, request, &id).ok()) {
+					failed++;
+					return;
+				}
+			}
+
+			while(chrono::steady_clock::now() < end) {
+				grpc::ClientContext context;
+				ServerInfo server;
+				if(stub->GetServer(&context, id, &server).ok()) {
+					calls++;
+				} else {
+					failed++;
+				}
+			}
+		});
+	}
+	for(thread &worker : workers) {
+		worker.join();
+	}
+
+	cout << threads << " threads: " << calls / seconds << " GetServer calls/s, " << failed << " failed\n";
+}
+
+/*
+	Stress test for a server. Each of threads threads logs in its own user
+	stress<i> on the server the coordinator assigns it, then for seconds
+	seconds cycles through Follow, List, UnFollow and, every 8th round, a
+	Timeline stream that joins, posts once and leaves. The other user of
+	each Follow and UnFollow is picked at random, so threads contend on
+	the same users. Prints calls per second and failures for each RPC.
+*/
+void runServerLoad(string hostname, string port, int threads, int seconds, Request::AckPolicy ackPolicy) {
+
+	enum { LOGIN, FOLLOW, UNFOLLOW, LIST, TIMELINE, NUM_RPCS };
+	const char *names[NUM_RPCS] = {"Login", "Follow", "UnFollow", "List", "Timeline"};
+	atomic<long> calls[NUM_RPCS] = {};
+	atomic<long> failed[NUM_RPCS] = {};
+	chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::seconds(seconds);
+
+	auto count = [&](int rpc, const grpc::Status &status) {
+		if(status.ok()) {
+			calls[rpc]++;
+		} else {
+			failed[rpc]++;
+		}
+	};
+
+	vector<thread> workers;
+	for(int i = 0; i < threads; i++) {
+		workers.emplace_back([&, i]() {
+			grpc::ChannelArguments args;
+			args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+			unique_ptr<CoordService::Stub> coordStub = CoordService::NewStub(
+				grpc::CreateCustomChannel(hostname + ":" + port, grpc::InsecureChannelCredentials(), args));
+
+			ID id;
+			ServerInfo server;
+			{
+				grpc::ClientContext context;
+				ClientRequest request;
+				if(!coordStub->GetUniqueClientID(&context, request, &id).ok()) {
+					failed[LOGIN]++;
+					return;
+				}
+			}
+			{
+				grpc::ClientContext context;
+				if(!coordStub->GetServer(&context, id, &server).ok()) {
+					failed[LOGIN]++;
+					return;
+				}
+			}
+			unique_ptr<SNSService::Stub> stub = SNSService::NewStub(
+				grpc::CreateCustomChannel(server.hostname() + ":" + server.port(), grpc::InsecureChannelCredentials(), args));
+
+			string username = "stress" + to_string(i);
+			mt19937 rng(i);
+
+			auto makeRequest = [&](const string &other) {
+				Request request;
+				request.set_username(username);
+				request.set_ack_policy(ackPolicy);
+				if(!other.empty()) {
+					request.add_arguments(other);
+				}
+				request.mutable_timestamp()->set_seconds(time(NULL));
+				return request;
+			};
+
+			{
+				grpc::ClientContext context;
+				Reply reply;
+				count(LOGIN, stub->Login(&context, makeRequest(""), &reply));
+			}
+
+			for(int round = 0; chrono::steady_clock::now() < end; round++) {
+				string other = "stress" + to_string(rng() % threads);
+				{
+					grpc::ClientContext context;
+					Reply reply;
+					count(FOLLOW, stub->Follow(&context, makeRequest(other), &reply));
+				}
+				{
+					grpc::ClientContext context;
+					ListReply reply;
+					count(LIST, stub->List(&context, makeRequest(""), &reply));
+				}
+				{
+					grpc::ClientContext context;
+					Reply reply;
+					count(UNFOLLOW, stub->UnFollow(&context, makeRequest(other), &reply));
+				}
+
+				if(round % 8 == 0) {
+					grpc::ClientContext context;
+					unique_ptr<grpc::ClientReaderWriter<Message, Message>> stream(stub->Timeline(&context));
+					Message message;
+					message.set_username(username);
+					message.mutable_timestamp()->set_seconds(time(NULL));
+					stream->Write(message);
+					message.set_msg("stress post " + to_string(round));
+					stream->Write(message);
+					stream->WritesDone();
+					while(stream->Read(&message)) {}
+					count(TIMELINE, stream->Finish());
+				}
+			}
+		});
+	}
+	for(thread &worker : workers) {
+		worker.join();
+	}
+
+	cout << threads << " threads, " << seconds << "s:\n";
+	for(int rpc = 0; rpc < NUM_RPCS; rpc++) {
+		cout << "  " << names[rpc] << ": " << calls[rpc] / seconds << " calls/s, " << failed[rpc] << " failed\n";
+	}
+}
+
 int main(int argc, char** argv) {
 
 	string hostname = "localhost";
 	string username = "default";
 	string port = "9000";
+	int loadThreads = 0;
+	int stressThreads = 0;
+	int loadSeconds = 10;
+	Request::AckPolicy ackPolicy = Request::ACK_DEFAULT;
 		
 	int opt = 0;
-	while ((opt = getopt(argc, argv, "h:k:u:")) != -1){
+	while ((opt = getopt(argc, argv, "h:k:u:l:s:d:a:")) != -1){
 		switch(opt) {
 		case 'h':
 			hostname = optarg;break;
@@ -20,14 +193,38 @@ int main(int argc, char** argv) {
 			username = optarg;break;
 		case 'k':
 			port = optarg;break;
+		case 'l':
+			loadThreads = stoi(optarg);break;
+		case 's':
+			stressThreads = stoi(optarg);break;
+		case 'd':
+			loadSeconds = max(1, stoi(optarg));break;
+		case 'a':
+			if(!parseAckPolicy(optarg, ackPolicy)) {
+				cout << "Invalid ack policy. Use none, quorum, all or default\n";
+			}
+			break;
 		default:
 			cout << "Invalid Command Line Argument\n";
 		}
 	}
 			
+	// Load the coordinator instead of running the client
+	if(loadThreads > 0) {
+		runCoordinatorLoad(hostname, port, loadThreads, loadSeconds);
+		return 0;
+	}
+
+	// Stress the assigned servers instead of running the client
+	if(stressThreads > 0) {
+		runServerLoad(hostname, port, stressThreads, loadSeconds, ackPolicy);
+		return 0;
+	}
+
 	cout << "Logging Initialized. Client starting...\n";
 	
 	Client myc(hostname, port, username);
+	myc.setAckPolicy(ackPolicy);
 	myc.run();
 	
 	return 0;
@@ -15,6 +15,7 @@
 #include <unistd.h>
 
 #include <grpc++/grpc++.h>
+#include <grpcpp/alarm.h>
 #include <google/protobuf/timestamp.pb.h>
 #include <google/protobuf/duration.pb.h>
 #include <google/protobuf/util/time_util.h>
@@ -40,14 +41,6 @@ std::string SNSCoordinator::CLUSTER = "/cluster";
 std::string SNSCoordinator::MASTER = "/master";
 std::string SNSCoordinator::SLAVE = "/slave";
 
-// ---- UTILITIY FUNCTIONS ----
-
-time_t getCurrentTime() {
-	const auto now = std::chrono::system_clock::now();
-	const std::time_t t_c = std::chrono::system_clock::to_time_t(now);
-	return t_c;
-}
-
 // ---- COORDINATOR ----
 
 SNSCoordinator::SNSCoordinator(int numClusters) {
@@ -56,6 +49,16 @@ SNSCoordinator::SNSCoordinator(int numClusters) {
 		map<int, shared_ptr<zNode>> cluster;
 		clusters.push_back(cluster);
 	}
+	clusterMasters.resize(numClusters);
+	clusterLocks = make_unique<mutex[]>(numClusters);
+
+	uint64_t started = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	clusterTerms.resize(numClusters, started);
+
+	shared_ptr<Topology> view = make_shared<Topology>();
+	view->version = topologyVersion;
+	view->clusters.resize(numClusters, make_shared<const ClusterView>());
+	topology = view;
 
 	thread(&SNSCoordinator::checkHeartbeats, this).detach();
 }
@@ -70,16 +73,50 @@ string SNSCoordinator::getSlaveFilepath(int clusterId, int serverId) {
 	return CLUSTER + str(clusterId) + SLAVE + str(serverId);
 }
 
+// Called with clusterLocks[clusterIdx] held
 int SNSCoordinator::getClusterMasterKey(int clusterIdx) {
-	std::map<int, shared_ptr<zNode>> &cluster = clusters[clusterIdx];
+	shared_ptr<zNode> master = clusterMasters[clusterIdx];
+	return master != NULL ? master->serverId : -1;
+}
 
-	for(auto& serverPair : cluster) {
-		if(serverPair.second->master) {
-			return serverPair.first;
+/*
+	Copies the cluster into a new Topology, with a new version, and
+	publishes it. Only this cluster is copied; the others are shared with
+	the previous Topology. Called with clusterLocks[clusterIdx] held.
+*/
+void SNSCoordinator::topologyChanged(int clusterIdx) {
+
+	shared_ptr<ClusterView> cluster = make_shared<ClusterView>();
+	for(auto &serverPair : clusters[clusterIdx]) {
+		shared_ptr<zNode> server = serverPair.second;
+		if(server->isActive()) {
+			if(server == clusterMasters[clusterIdx]) {
+				cluster->master = cluster->active.size();
+			}
+			cluster->active.emplace_back();
+			server->setServerInfo(cluster->active.back());
 		}
 	}
 
-	return -1;
+	lock_guard<mutex> lock(publishMtx);
+	shared_ptr<Topology> view = make_shared<Topology>(*getTopology());
+	view->clusters[clusterIdx] = cluster;
+
+	view->masters.clear();
+	for(shared_ptr<const ClusterView> &c : view->clusters) {
+		if(c->master != -1) {
+			view->masters.push_back(c->active[c->master]);
+		}
+	}
+
+	view->version = topologyVersion + 1;
+	atomic_store(&topology, shared_ptr<const Topology>(view));
+	topologyVersion = view->version;
+
+	lock_guard<mutex> sessionsLock(sessionsMtx);
+	for(const shared_ptr<ServerSession> &session : sessions) {
+		session->notify();
+	}
 }
 
 // ---- COORDINATOR API ----
@@ -103,12 +140,14 @@ Status SNSCoordinator::Heartbeat(ServerContext* context, const ServerInfo* serve
 		return Status(StatusCode::INVALID_ARGUMENT, message);
 	}
 	
+	lock_guard<mutex> lock(clusterLocks[clusterIdx]);
 	map<int, shared_ptr<zNode>> &cluster = clusters[clusterIdx];
 	map<int, shared_ptr<zNode>>::iterator it = cluster.find(serverId);
 
 	// Gets specified server, or creates new one if doesn't exist
 
 	shared_ptr<zNode> server;
+	bool changed = !serverInfo->registered();
 	if(it != cluster.end()) {
 
 		server = it->second;
@@ -125,6 +164,9 @@ Status SNSCoordinator::Heartbeat(ServerContext* context, const ServerInfo* serve
 			return Status(StatusCode::ALREADY_EXISTS, message);
 		}
 		// TODO: authentication?
+
+		// A server that was considered inactive is back
+		changed = changed || !server->isActive();
 	} else {
 		server = make_shared<zNode>();
 		cluster[serverId] = server;
@@ -134,12 +176,23 @@ Status SNSCoordinator::Heartbeat(ServerContext* context, const ServerInfo* serve
 	// This updates the heartbeat.
 	server->setFromServerInfo(serverInfo);
 
+	// New, or back after it was last checked
+	if(!server->scheduled) {
+		server->scheduled = true;
+		schedule({server->last_heartbeat + chrono::milliseconds(heartbeatTimeoutMs), clusterIdx, serverId});
+	}
+
 	if(server->master) {
 		// Only log missed heartbeats?
 		// log(INFO, "Heartbeat received from " + server->to_string());
-		
+
+		if(changed) {
+			topologyChanged(clusterIdx);
+		}
 		path->set_path(server->path);
 		path->set_master(true);
+		path->set_topology_version(topologyVersion);
+		path->set_term(server->term);
 		return Status::OK;
 	}
 
@@ -185,9 +238,9 @@ Status SNSCoordinator::Heartbeat(ServerContext* context, const ServerInfo* serve
 			// If you are a cluster master and you are unregistered,
 			// your sync address is the address of any other active cluster master
 			if(!serverInfo->registered()) {
-				shared_ptr<zNode> otherClusterMaster = getFirstAvailableClusterMaster(clusterIdx);
+				const ServerInfo *otherClusterMaster = getFirstAvailableClusterMaster(*getTopology(), clusterIdx);
 				if(otherClusterMaster != NULL) {
-					syncAddress = otherClusterMaster->getAddress();
+					syncAddress = otherClusterMaster->hostname() + ":" + otherClusterMaster->port();
 				}
 			}
 		}
@@ -197,11 +250,16 @@ Status SNSCoordinator::Heartbeat(ServerContext* context, const ServerInfo* serve
 	// non-empty masterAddress indicates that the server is a slave
 	server->path = rawPath;
 	if(master) {
-		server->master = true;
+		makeMaster(clusterIdx, server);
+	}
+	if(changed || master) {
+		topologyChanged(clusterIdx);
 	}
 	path->set_path(rawPath);
 	path->set_master(master);
 	path->set_sync_address(syncAddress);
+	path->set_topology_version(topologyVersion);
+	path->set_term(masterTerm(clusterIdx));
 
 	// In current scenario, sync address only matters to server on initialization
 	// It may be important for a server to know its sync address after init. as well.
@@ -232,17 +290,17 @@ Status SNSCoordinator::Heartbeat(ServerContext* context, const ServerInfo* serve
 
 Status SNSCoordinator::GetCounterparts(ServerContext *context, const ServerInfo *masterInfo, ServerList *slaveList)
 {
+	int clusterIdx = idToIndex(masterInfo->clusterid());
+	shared_ptr<const Topology> view = getTopology();
+	if(clusterIdx < 0 || clusterIdx >= (int)view->clusters.size()) {
+		return Status(StatusCode::INVALID_ARGUMENT, "Invalid cluster ID specified.");
+	}
 
-	map<int, shared_ptr<zNode>> &cluster = clusters[idToIndex(masterInfo->clusterid())];
-
-	for(auto &serverPair : cluster) {
-		int key = serverPair.first;
-		shared_ptr<zNode> server = serverPair.second;
+	for(const ServerInfo &server : view->clusters[clusterIdx]->active) {
 
-		// Don't include self or inactive servers
-		if((int)masterInfo->serverid() != key && server->isActive()) {
-			ServerInfo* s = slaveList->add_servers();
-			server->setServerInfo(*s);
+		// Don't include self. Only active servers are listed.
+		if(masterInfo->serverid() != server.serverid()) {
+			*slaveList->add_servers() = server;
 		}
 	}
 
@@ -254,65 +312,34 @@ Status SNSCoordinator::GetCounterparts(ServerContext *context, const ServerInfo
 
 /* Methods for getting other cluster masters */
 
-// Returns pointer to first available cluster master (skips cluster
-// with specified index). If no others are available, returns NULL.
-shared_ptr<zNode> SNSCoordinator::getFirstAvailableClusterMaster(int clusterIdx) {
-	
-	shared_ptr<zNode> clusterMaster = NULL;
-	bool found = false;
-
-	for(int i = 0; i < (int)clusters.size(); i++) {
-
-		// skip cluster that requesting master belongs to
-		if(i != clusterIdx) {
-
-			map<int, shared_ptr<zNode>> &cluster = clusters[i];
-
-			for(auto &serverPair : cluster) {
-				shared_ptr<zNode> server = serverPair.second;
-
-				// Can only be master if active
-				if(server->master) {
-					clusterMaster = server;
-					found = true;
-					break; // don't need to continue searching for master
-				}
-			}
+// Returns first available cluster master (skips cluster with
+// specified index). If no others are available, returns NULL.
+const ServerInfo* SNSCoordinator::getFirstAvailableClusterMaster(const Topology &view, int clusterIdx) {
 
-			if(found) {
-				break;
-			}
+	// Only the first two masters need checking, as one of them is in another cluster
+	for(const ServerInfo &master : view.masters) {
+		if(master.clusterid() != clusterIdx + 1) {
+			return &master;
 		}
 	}
 
-	return clusterMaster;
+	return NULL;
 }
 
 Status SNSCoordinator::GetOtherClusterMasters(ServerContext *context, const ServerInfo *masterInfo, ServerList *list)
 {
-
-	int clusterIdx = idToIndex(masterInfo->clusterid());
-	for(int i = 0; i < (int)clusters.size(); i++) {
+	shared_ptr<const Topology> view = getTopology();
+	for(const ServerInfo &master : view->masters) {
 
 		// skip cluster that requesting master belongs to
-		if(i != clusterIdx) {
-
-			map<int, shared_ptr<zNode>> &cluster = clusters[i];
-
-			for(auto &serverPair : cluster) {
-				shared_ptr<zNode> server = serverPair.second;
-
-				// Only include masters. Can only be master if active
-				if(server->master) {
-					ServerInfo* s = list->add_servers();
-					server->setServerInfo(*s);
-
-					break; // don't need to continue searching for master
-				}
-			}
+		if(master.clusterid() != masterInfo->clusterid()) {
+			*list->add_servers() = master;
 		}
 	}
 
+	// Listed in cluster order, which every master builds its tree from
+	list->set_tree_degree(treeDegree);
+
 	// TODO: log who they were requested by
 	log(INFO, "Other cluster masters requested by " + serverInfoToString(masterInfo));
 
@@ -324,79 +351,66 @@ Status SNSCoordinator::GetOtherClusterMasters(ServerContext *context, const Serv
 
 Status SNSCoordinator::GetUniqueClientID(ServerContext* context, const ClientRequest* clientRequest, ID* id)
 {
-	int rawId = clientAssignments.size();
+	// Assigned a server on its first GetServer
+	int rawId = nextClientId++;
 	id->set_id(rawId);
 
-	// Insert key
-	clientAssignments[rawId] = NULL;
-
 	log(INFO, "New unique client ID requested. Provided ID: " + str(rawId));
 
 	return Status::OK;
 }
 
 // Get Server Helper
-shared_ptr<zNode> SNSCoordinator::getActiveMaster(int clientId) {
+const ServerInfo* SNSCoordinator::getActiveMaster(const Topology &view, int clientId) {
 
 	/*
-		First looks for an active master in clusters[clientId % numClusters]
-		If no active masters found, search in remaining clusters
-	*/ 
-	
-	int numClusters = clusters.size();
-	int clusterIdx = (clientId % numClusters);
-	int remainingClusters = numClusters;
-
-	map<int, shared_ptr<zNode>>* cluster = &clusters[clusterIdx];
-
-	shared_ptr<zNode> server = NULL;
-	bool found = false;
-	while(remainingClusters > 0) {
-		
-	  	// Get master
-
-		if(cluster->size() > 0) {
-			for(auto& serverPair : *cluster) {
-				server = serverPair.second;
-				// If server is master, it has to be active
-				if(server != NULL && server->master) {
-					found = true;
-					break;
-				}
-			}
-
-			if(found) {
-				break;
-			}
-		}
+		Returns the master of clusters[clientId % numClusters]. If that
+		cluster has none, clients are spread over the masters there are.
+	*/
 
-		clusterIdx = (clusterIdx + 1) % numClusters;
-		cluster = &clusters[clusterIdx];
-		remainingClusters--;
+	int numClusters = view.clusters.size();
+	const ClusterView &cluster = *view.clusters[clientId % numClusters];
+	if(cluster.master != -1) {
+		return &cluster.active[cluster.master];
 	}
 
-	if(found) {
-		return server;
+	if(view.masters.empty()) {
+		return NULL;
 	}
-
-	return NULL;
+	return &view.masters[clientId % view.masters.size()];
 } 
 
 Status SNSCoordinator::GetServer(ServerContext* context, const ID* id, ServerInfo* serverInfo)
 {
-	// Check if the client has already been assigned a server
-	// Every assignment starts as NULL
-
 	int rawId = id->id();
+	if(rawId < 0) {
+		return Status(StatusCode::INVALID_ARGUMENT, "Invalid client ID.");
+	}
 
-	shared_ptr<zNode> server = clientAssignments[rawId];
-	bool changed = false;
+	// Held until we return, so the ServerInfos stay valid
+	shared_ptr<const Topology> view = getTopology();
+
+	ClientShard &shard = clientShards[rawId % NUM_CLIENT_SHARDS];
+	lock_guard<mutex> lock(shard.mtx);
 
-	if(server == NULL || !server->master) {
+	// Check if the client has already been assigned a server
+	// Every assignment starts out with no cluster
+	Assignment &assignment = shard.assignments[rawId];
+
+	const ServerInfo *server = NULL;
+	if(assignment.clusterIdx != -1) {
+		const ClusterView &cluster = *view->clusters[assignment.clusterIdx];
+		if(cluster.master != -1 && cluster.active[cluster.master].serverid() == assignment.serverId) {
+			server = &cluster.active[cluster.master];
+		}
+	}
+
+	bool changed = false;
+	if(server == NULL) {
 
 		// Server not assigned yet
 		// or assigned server is no longer master
-		server = getActiveMaster(rawId);
+		server = getActiveMaster(*view, rawId);
 		if(server == NULL) {
 			string message = 
 			"Server requested by client with ID " + str(rawId) + ", "
@@ -406,49 +420,386 @@ Status SNSCoordinator::GetServer(ServerContext* context, const ID* id, ServerInf
 			return Status(StatusCode::UNAVAILABLE, "No servers available to serve the request.");
 		}
 
-		clientAssignments[rawId] = server;
+		assignment.clusterIdx = idToIndex(server->clusterid());
+		assignment.serverId = server->serverid();
 		changed = true;
 
 		// Only log if server changes
-		log(INFO, "Client with id " + str(rawId) + " assigned to " + server->to_string());
+		log(INFO, "Client with id " + str(rawId) + " assigned to " + serverInfoToString(server));
 	}
 
-	server->setServerInfo(*serverInfo);
+	*serverInfo = *server;
 	serverInfo->set_changed(changed);
 
 	return Status::OK;
 }
 
+void SNSCoordinator::schedule(const Deadline &deadline) {
+
+	lock_guard<mutex> lock(deadlinesMtx);
+	bool earliest = deadlines.empty() || deadline.due < deadlines.top().due;
+	deadlines.push(deadline);
+
+	// checkHeartbeats sleeps until what was the earliest
+	if(earliest) {
+		deadlinesCv.notify_one();
+	}
+}
+
 // Run in a separate thread
 void SNSCoordinator::checkHeartbeats() {
 	while(true) {
 
-		for(auto& cluster : clusters) {
+		Deadline deadline;
+		{
+			unique_lock<mutex> lock(deadlinesMtx);
+			while(deadlines.empty() || deadlines.top().due > chrono::steady_clock::now()) {
+				if(deadlines.empty()) {
+					deadlinesCv.wait(lock);
+				} else {
+					// A copy: a push while we wait may move the heap
+					chrono::steady_clock::time_point due = deadlines.top().due;
+					deadlinesCv.wait_until(lock, due);
+				}
+			}
+			deadline = deadlines.top();
+			deadlines.pop();
+		}
+
+		lock_guard<mutex> lock(clusterLocks[deadline.clusterIdx]);
+		checkDeadline(deadline);
+	}
+}
+
+void SNSCoordinator::checkDeadline(const Deadline &deadline) {
 
-			for(auto& serverPair : cluster) {
-				shared_ptr<zNode> server = serverPair.second;
+	int clusterIdx = deadline.clusterIdx;
+	shared_ptr<zNode> server = clusters[clusterIdx][deadline.serverId];
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
 
-				if(difftime(getCurrentTime(), server->last_heartbeat) > maxHeartbeatDelay) {
-					server->missed_heartbeats += 1;
+	// A heartbeat came in since the entry was scheduled
+	chrono::steady_clock::time_point expires = server->last_heartbeat + chrono::milliseconds(heartbeatTimeoutMs);
+	if(server->missed_heartbeats == 0 && expires > now) {
+		schedule({expires, clusterIdx, deadline.serverId});
+		return;
+	}
 
-					if(server->missed_heartbeats == 1) {
-						log(WARNING, "Heartbeat missed by " + server->to_string());
-					}
-					
-					if(server->missed_heartbeats == 2) {
-						server->master = false;
-						filesys.remove(server->path);
+	server->missed_heartbeats += 1;
+	bool changed = false;
 
-						string message = "2 Heartbeats missed by " + server->to_string() + ". Releasing file lock."
+	if(server->missed_heartbeats == 1) {
+		log(WARNING, "Heartbeat missed by " + server->to_string());
+	}
 
-						log(WARNING, message);
-					}
-					
-					// Do not log >= 2 missed heartbeats
-				}
+	if(server->missed_heartbeats == 2) {
+		log(WARNING, "2 Heartbeats missed by " + server->to_string() + ". Releasing file lock.");
+		releaseServer(clusterIdx, server);
+		changed = true;
+	}
+
+	// No longer listed as a counterpart. Nothing more happens to it
+	// until it sends another heartbeat.
+	if(server->missed_heartbeats == 3) {
+		changed = true;
+		server->scheduled = false;
+	} else {
+		schedule({now + chrono::milliseconds(missIntervalMs), clusterIdx, deadline.serverId});
+	}
+
+	if(changed) {
+		topologyChanged(clusterIdx);
+	}
+}
+
+/*
+	Releases the file lock of a server that is considered gone. If it
+	was its cluster's master, a server with a session takes over at once.
+*/
+void SNSCoordinator::releaseServer(int clusterIdx, shared_ptr<zNode> server) {
+
+	server->master = false;
+	if(clusterMasters[clusterIdx] == server) {
+		clusterMasters[clusterIdx] = NULL;
+	}
+	filesys.remove(server->path);
+
+	electMaster(clusterIdx);
+}
+
+/*
+	Gives a cluster with no master the first of its servers that has an
+	open session and missed no heartbeats. It learns of it through the
+	session once the caller publishes the change. Servers that only send
+	heartbeats still take the lock on their next one, as before.
+*/
+void SNSCoordinator::electMaster(int clusterIdx) {
+
+	string masterFilepath = getMasterFilepath(clusterIdx + 1);
+	if(filesys.exists(masterFilepath)) {
+		return;
+	}
+
+	for(auto &serverPair : clusters[clusterIdx]) {
+		shared_ptr<zNode> server = serverPair.second;
+		if(server->session == NULL || server->master || server->missed_heartbeats > 0) {
+			continue;
+		}
+
+		if(filesys.create(masterFilepath, false, true) < 0) {
+			return;
+		}
+		filesys.write(masterFilepath, server->getAddress(), false, true);
+		server->path = masterFilepath;
+		makeMaster(clusterIdx, server);
+
+		log(INFO, "New master elected: " + server->to_string());
+		return;
+	}
+}
+
+// Called with clusterLocks[clusterIdx] held
+void SNSCoordinator::makeMaster(int clusterIdx, shared_ptr<zNode> server) {
+
+	server->master = true;
+	server->term = ++clusterTerms[clusterIdx];
+	clusterMasters[clusterIdx] = server;
+}
+
+// Called with clusterLocks[clusterIdx] held
+uint64_t SNSCoordinator::masterTerm(int clusterIdx) {
+
+	return clusterMasters[clusterIdx] != NULL ? clusterMasters[clusterIdx]->term : 0;
+}
+
+// ---- SESSIONS ----
+
+// Called with clusterLocks[clusterIdx] held
+void SNSCoordinator::keepalive(int clusterIdx, shared_ptr<zNode> server, const Keepalive &keepalive) {
+
+	// A server that was considered inactive is back
+	bool changed = !server->isActive();
+
+	server->updateHeartbeat();
+	server->load = keepalive;
+	server->load.clear_server();
+
+	if(!server->scheduled) {
+		server->scheduled = true;
+		schedule({server->last_heartbeat + chrono::milliseconds(heartbeatTimeoutMs), clusterIdx, server->serverId});
+	}
+
+	// The cluster lost its master while no other server could take over
+	if(clusterMasters[clusterIdx] == NULL) {
+		electMaster(clusterIdx);
+		changed = changed || clusterMasters[clusterIdx] != NULL;
+	}
+
+	if(changed) {
+		topologyChanged(clusterIdx);
+	}
+}
+
+/*
+	Takes the keepalives of a registered server in place of heartbeats.
+	They only mark the server alive and record its load: elections
+	happen when a master is released, not on every keepalive. The first
+	one attaches the stream to its server. The server is sent its Path
+	whenever the session is notified. Whoever notifies it may hold a
+	cluster lock, so the Path is built on an alarm that runs with none
+	held. A server exits when its session breaks, so its file lock is
+	released at once.
+*/
+class SessionReactor : public ServerBidiReactor<Keepalive, Path> {
+
+public:
+	SessionReactor(SNSCoordinator *coord)
+		: coord(coord), session(make_shared<ServerSession>())
+	{
+		session->send = [this] { sendPending(); };
+		StartRead(&incoming);
+	}
+
+	void OnReadDone(bool ok) override {
+		if(!ok) {
+			session->close();
+			return;
+		}
+
+		if(server == NULL) {
+			Status opened = coord->openSession(incoming, session, clusterIdx, server);
+			if(!opened.ok()) {
+				lock_guard<mutex> lock(session->mtx);
+				status = opened;
+				session->closed = true;
+				sendPending();
+				return;
 			}
+		} else if(!coord->sessionKeepalive(clusterIdx, server, session, incoming)) {
+			session->close();
+			return;
 		}
+		StartRead(&incoming);
+	}
 
-		sleep(heartbeatCheckDelay);
+	void OnWriteDone(bool ok) override {
+		lock_guard<mutex> lock(session->mtx);
+		writing = false;
+		if(!ok) {
+			session->closed = true;
+		}
+		sendPending();
+	}
+
+	void OnDone() override {
+		if(server != NULL) {
+			coord->closeSession(clusterIdx, server, session);
+		}
+		{
+			lock_guard<mutex> lock(session->mtx);
+			session->send = nullptr;
+		}
+		delete this;
+	}
+
+private:
+	SNSCoordinator *coord;
+	shared_ptr<ServerSession> session;
+
+	// Set by the first keepalive
+	int clusterIdx = -1;
+	shared_ptr<zNode> server;
+
+	Keepalive incoming;
+	Path outgoing;
+
+	// Guarded by session->mtx
+	unique_ptr<grpc::Alarm> alarm;
+	bool building = false;	// the alarm is set or building a Path
+	bool writing = false;
+	bool finished = false;
+	Status status;
+
+	// Called with session->mtx held
+	void sendPending() {
+		if(building || writing || finished) {
+			return;
+		}
+		if(session->closed) {
+			finished = true;
+			Finish(status);
+			return;
+		}
+		if(!session->pending) {
+			return;
+		}
+
+		building = true;
+		alarm = make_unique<grpc::Alarm>();
+		alarm->Set(chrono::system_clock::now(), [this](bool ok) {
+			{
+				lock_guard<mutex> lock(session->mtx);
+				session->pending = false;
+			}
+			Path path = coord->sessionPath(clusterIdx, server);
+
+			lock_guard<mutex> lock(session->mtx);
+			building = false;
+			if(!session->closed) {
+				outgoing = path;
+				writing = true;
+				StartWrite(&outgoing);
+				return;
+			}
+			sendPending();
+		});
+	}
+};
+
+ServerBidiReactor<Keepalive, Path>* SNSCoordinator::Session(CallbackServerContext *context)
+{
+	return new SessionReactor(this);
+}
+
+Status SNSCoordinator::openSession(const Keepalive &first, shared_ptr<ServerSession> session,
+	int &clusterIdx, shared_ptr<zNode> &server)
+{
+	if(!first.has_server()) {
+		return Status(StatusCode::INVALID_ARGUMENT, "A session starts with the server's info.");
+	}
+
+	clusterIdx = idToIndex(first.server().clusterid());
+	if(clusterIdx < 0 || clusterIdx >= (int)clusters.size()) {
+		return Status(StatusCode::INVALID_ARGUMENT, "Invalid cluster ID specified.");
+	}
+
+	{
+		lock_guard<mutex> lock(clusterLocks[clusterIdx]);
+		auto it = clusters[clusterIdx].find(first.server().serverid());
+		if(it == clusters[clusterIdx].end()) {
+			return Status(StatusCode::FAILED_PRECONDITION, "Register with a heartbeat before opening a session.");
+		}
+
+		server = it->second;
+		if(server->session != NULL) {
+			server->session->close();
+		}
+		server->session = session;
+		keepalive(clusterIdx, server, first);
+	}
+	{
+		lock_guard<mutex> lock(sessionsMtx);
+		sessions.insert(session);
+	}
+
+	log(INFO, "Session opened by " + server->to_string());
+
+	// Its Path goes first
+	session->notify();
+	return Status::OK;
+}
+
+bool SNSCoordinator::sessionKeepalive(int clusterIdx, shared_ptr<zNode> server,
+	shared_ptr<ServerSession> session, const Keepalive &next)
+{
+	lock_guard<mutex> lock(clusterLocks[clusterIdx]);
+	if(server->session != session) {
+		return false;
+	}
+	keepalive(clusterIdx, server, next);
+	return true;
+}
+
+Path SNSCoordinator::sessionPath(int clusterIdx, shared_ptr<zNode> server) {
+
+	Path path;
+	lock_guard<mutex> lock(clusterLocks[clusterIdx]);
+	path.set_path(server->path);
+	path.set_master(server->master);
+	path.set_topology_version(topologyVersion);
+	path.set_term(masterTerm(clusterIdx));
+	return path;
+}
+
+void SNSCoordinator::closeSession(int clusterIdx, shared_ptr<zNode> server, shared_ptr<ServerSession> session) {
+
+	{
+		lock_guard<mutex> lock(sessionsMtx);
+		sessions.erase(session);
+	}
+
+	lock_guard<mutex> lock(clusterLocks[clusterIdx]);
+	if(server->session == session) {
+		server->session = NULL;
+
+		// Handled as its second missed heartbeat. Its deadline lists it
+		// as inactive once it comes due, unless it registers again.
+		if(server->missed_heartbeats < 2) {
+			log(WARNING, "Session closed by " + server->to_string() + ". Releasing file lock.");
+			server->missed_heartbeats = 2;
+			releaseServer(clusterIdx, server);
+			topologyChanged(clusterIdx);
+		}
+	} else {
+		log(INFO, "Session replaced for " + server->to_string());
 	}
 }
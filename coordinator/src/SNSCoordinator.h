@@ -2,9 +2,17 @@
 #ifndef COORD_HEADER
 #define COORD_HEADER
 
-#include <ctime>
-#include <string>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #define log(severity, msg); LOG(severity) << msg << "\n---"; google::FlushLogFiles(google::severity);
@@ -13,7 +21,10 @@
 #include "FSWrapper/FSMemory.h"
 #include <snsproto/coordinator.grpc.pb.h>
 
+using grpc::CallbackServerContext;
+using grpc::ServerBidiReactor;
 using grpc::ServerContext;
+using grpc::ServerReaderWriter;
 using grpc::StatusCode;
 using grpc::Status;
 
@@ -26,9 +37,36 @@ using SNS::Path;
 using SNS::FileData;
 using SNS::FileInfo;
 using SNS::ServerList;
+using SNS::Keepalive;
+
+// ---- SESSION ----
+// A server's open Session stream. Whatever changes what the server should
+// be told marks it pending, and the stream's reactor sends it.
+
+struct ServerSession {
+	std::mutex mtx;
+	bool pending = false;
+	bool closed = false;
+
+	// Set by the stream's reactor until it is done, called with mtx held
+	std::function<void()> send;
+
+	void notify() {
+		std::lock_guard<std::mutex> lock(mtx);
+		pending = true;
+		if(send) {
+			send();
+		}
+	}
 
-// ---- UTILITY FUNCTION HEADERS ----
-time_t getCurrentTime();
+	void close() {
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		if(send) {
+			send();
+		}
+	}
+};
 
 // ---- zNODE ----
 // struct for storing sever/process information
@@ -41,8 +79,12 @@ struct zNode {
 	std::string type;
 	std::string path;
 	bool master = false;
-	time_t last_heartbeat = 0;
+	uint64_t term = 0;	// its cluster's term when it was last elected master
+	std::chrono::steady_clock::time_point last_heartbeat;
 	int missed_heartbeats = 0;
+	bool scheduled = false;	// has an entry in the coordinator's deadlines
+	std::shared_ptr<ServerSession> session;	// NULL if it sends unary heartbeats
+	Keepalive load;		// from the last keepalive
 
 	bool isActive() {
 		// Leeway of 2 missed heartbeats
@@ -50,7 +92,7 @@ struct zNode {
 	}
 
 	void updateHeartbeat() {
-		last_heartbeat = getCurrentTime();
+		last_heartbeat = std::chrono::steady_clock::now();
 		missed_heartbeats = 0;
 	}
 
@@ -86,39 +128,159 @@ struct zNode {
 	} 
 };
 
-class SNSCoordinator final : public CoordService::Service {
+/*
+	Session runs on the gRPC callback API, so an open session holds no
+	thread. The other RPCs are short and stay synchronous.
+*/
+class SNSCoordinator final : public CoordService::WithCallbackMethod_Session<CoordService::Service> {
 
 public:
 	SNSCoordinator(int numClusters);
 	virtual ~SNSCoordinator() {};
 
+	// Masters forward a client write to at most degree other masters,
+	// in a tree rooted at the one that took it. 0 is a full mesh.
+	void setTreeDegree(int degree) { treeDegree = degree; }
+
+	// A server misses its first heartbeat timeoutMs after its last one,
+	// and another every missIntervalMs after that
+	void setHeartbeatTimeout(int timeoutMs, int missIntervalMs) {
+		heartbeatTimeoutMs = timeoutMs;
+		this->missIntervalMs = missIntervalMs;
+	}
+
 	// Server Methods
 	Status Heartbeat(ServerContext* context, const ServerInfo* serverInfo, Path* path);
 	Status GetCounterparts(ServerContext* context, const ServerInfo* masterInfo, ServerList* slaveList);
 	Status GetOtherClusterMasters(ServerContext *context, const ServerInfo *masterInfo, ServerList *list);
+	ServerBidiReactor<Keepalive, Path>* Session(CallbackServerContext *context) override;
 	
 	// Client Methods
 	Status GetUniqueClientID(ServerContext* context, const ClientRequest* clientRequest, ID* id);
 	Status GetServer(ServerContext* context, const ID* id, ServerInfo* serverInfo);
 
 private:
+	friend class SessionReactor;
 
-	//potentially thread safe
-	std::mutex v_mutex;
 	FSMemory filesys{true};
+
+	/*
+		clusters[i] and clusterMasters[i] are only read or changed under
+		clusterLocks[i], so heartbeats to different clusters don't contend.
+		Hold one cluster lock at a time. clusterMasters holds the current
+		master of each cluster, NULL if it has none.
+	*/
 	std::vector<std::map<int, std::shared_ptr<zNode>>> clusters;
-	std::map<int, std::shared_ptr<zNode>> clientAssignments;
+	std::vector<std::shared_ptr<zNode>> clusterMasters;
+	std::unique_ptr<std::mutex[]> clusterLocks;
+
+	/*
+		Raised under clusterLocks[i] every time cluster i elects a master,
+		which keeps it for as long as it stays master. Masters stamp their
+		replication batches with it, so a slave can tell a new master's
+		LSNs from an old one's. Terms start at the time the coordinator
+		started, in microseconds, so they keep growing across restarts.
+	*/
+	std::vector<uint64_t> clusterTerms;
 
-	int maxHeartbeatDelay = 10;
-	int heartbeatCheckDelay = 3;
+	/*
+		What the read RPCs return, copied out of a cluster under its lock
+		whenever its servers, their activity or its master change. A
+		published Topology is never modified, and is swapped in with
+		std::atomic_store, so readers take none of the cluster locks.
+	*/
+	struct ClusterView {
+		std::vector<ServerInfo> active;	// servers that are active
+		int master = -1;				// index in active, or -1
+	};
+	struct Topology {
+		uint64_t version = 0;
+		std::vector<std::shared_ptr<const ClusterView>> clusters;
+		std::vector<ServerInfo> masters;	// in cluster order
+	};
+	std::shared_ptr<const Topology> topology;
+	std::mutex publishMtx;
+
+	// Every open session, told of each new topology version
+	std::mutex sessionsMtx;
+	std::set<std::shared_ptr<ServerSession>> sessions;
+
+	// Servers cache their replication targets until it changes. It is
+	// raised once the Topology with that version is published.
+	std::atomic<uint64_t> topologyVersion{1};
+
+	// The server each client was last given, by cluster index and server id
+	struct Assignment {
+		int clusterIdx = -1;
+		int serverId = -1;
+	};
+
+	// Client assignments, sharded by client id
+	static const int NUM_CLIENT_SHARDS = 64;
+	struct alignas(64) ClientShard {
+		std::mutex mtx;
+		std::map<int, Assignment> assignments;
+	};
+	ClientShard clientShards[NUM_CLIENT_SHARDS];
+	std::atomic<int> nextClientId{0};
+
+	int treeDegree = 0;
+
+	std::atomic<int> heartbeatTimeoutMs{10000};
+	std::atomic<int> missIntervalMs{3000};
+
+	/*
+		When each server is next checked for a missed heartbeat, earliest
+		first. A server has at most one entry. A heartbeat only moves
+		last_heartbeat; an entry that comes due after one is pushed back to
+		when that heartbeat expires. checkHeartbeats sleeps until the first
+		entry is due and only looks at the servers whose entries are.
+	*/
+	struct Deadline {
+		std::chrono::steady_clock::time_point due;
+		int clusterIdx;
+		int serverId;
+
+		bool operator>(const Deadline &other) const { return due > other.due; }
+	};
+	std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+	std::mutex deadlinesMtx;
+	std::condition_variable deadlinesCv;
 
 	void checkHeartbeats();
+	void schedule(const Deadline &deadline);
+
+	// Called with clusterLocks[deadline.clusterIdx] held
+	void checkDeadline(const Deadline &deadline);
+
+	// Called with clusterLocks[clusterIdx] held
+	void keepalive(int clusterIdx, std::shared_ptr<zNode> server, const Keepalive &keepalive);
+
+	// A SessionReactor's steps, each taking the cluster lock itself.
+	// sessionKeepalive is false once the server has opened another session.
+	Status openSession(const Keepalive &first, std::shared_ptr<ServerSession> session,
+		int &clusterIdx, std::shared_ptr<zNode> &server);
+	bool sessionKeepalive(int clusterIdx, std::shared_ptr<zNode> server,
+		std::shared_ptr<ServerSession> session, const Keepalive &keepalive);
+	Path sessionPath(int clusterIdx, std::shared_ptr<zNode> server);
+	void closeSession(int clusterIdx, std::shared_ptr<zNode> server, std::shared_ptr<ServerSession> session);
+	void releaseServer(int clusterIdx, std::shared_ptr<zNode> server);
+	void electMaster(int clusterIdx);
+	void makeMaster(int clusterIdx, std::shared_ptr<zNode> server);
+
+	// Term of the cluster's master, 0 if it has none
+	uint64_t masterTerm(int clusterIdx);
 
 	// IDs are 1-based, indicies are 0-based
 	int idToIndex(int id) { return id - 1; }
 	int getClusterMasterKey(int clusterIdx);
-	std::shared_ptr<zNode> getActiveMaster(int clientId);
-	std::shared_ptr<zNode> getFirstAvailableClusterMaster(int clusterIdx);
+
+	// Called with clusterLocks[clusterIdx] held
+	void topologyChanged(int clusterIdx);
+
+	std::shared_ptr<const Topology> getTopology() { return std::atomic_load(&topology); }
+	static const ServerInfo* getActiveMaster(const Topology &view, int clientId);
+	static const ServerInfo* getFirstAvailableClusterMaster(const Topology &view, int clusterIdx);
 
 	// STATIC VARS AND FUNCTIONS
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -11,11 +12,13 @@ using grpc::ServerBuilder;
 
 using namespace std;
 
-void RunServer(string host, string port, int numClusters) {
+void RunServer(string host, string port, int numClusters, int treeDegree, int timeoutMs, int missIntervalMs) {
 
 	string server_address(host + ":" + port);
 
 	SNSCoordinator service(numClusters);
+	service.setTreeDegree(treeDegree);
+	service.setHeartbeatTimeout(timeoutMs, missIntervalMs);
 
 	//grpc::EnableDefaultHealthCheckService(true);
 	//grpc::reflection::InitProtoReflectionServerBuilderPlugin();
@@ -26,7 +29,7 @@ void RunServer(string host, string port, int numClusters) {
 	builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
 
 	// Register "service" as the instance through which we'll communicate with
-	// clients. In this case it corresponds to an *synchronous* service.
+	// clients. Its Session streams use the callback API, the rest is synchronous.
 	builder.RegisterService(&service);
 
 	// Finally assemble the server.
@@ -44,9 +47,13 @@ int main(int argc, char** argv) {
 	string host = "localhost";
 	string port = "9000";
 	int numClusters = 3;
+	string replication = "mesh";
+	int degree = 2;
+	int timeoutMs = 10000;
+	int missIntervalMs = 3000;
 
 	int opt = 0;
-	while ((opt = getopt(argc, argv, "n:h:p:")) != -1) {
+	while ((opt = getopt(argc, argv, "n:h:p:r:g:t:i:")) != -1) {
 		switch(opt) {
 			case 'n':
 				numClusters = stoi(optarg);
@@ -57,6 +64,22 @@ int main(int argc, char** argv) {
 			case 'p':
 				port = optarg;
 				break;
+			case 'r':
+				replication = optarg;
+				if(replication != "mesh" && replication != "tree" && replication != "chain") {
+					cerr << "Invalid replication topology. Use mesh, tree or chain\n";
+					replication = "mesh";
+				}
+				break;
+			case 'g':
+				degree = max(1, stoi(optarg));
+				break;
+			case 't':
+				timeoutMs = max(1, stoi(optarg));
+				break;
+			case 'i':
+				missIntervalMs = max(1, stoi(optarg));
+				break;
 			default:
 				cerr << "Invalid Command Line Argument\n";
 		}
@@ -66,6 +89,16 @@ int main(int argc, char** argv) {
   	google::InitGoogleLogging(log_file_name.c_str());
   	log(INFO, "Logging Initialized. Coordinator starting...");
 
-	RunServer(host, port, numClusters);
+	// A chain is a tree of degree 1
+	int treeDegree = 0;
+	if(replication == "tree") {
+		treeDegree = degree;
+	} else if(replication == "chain") {
+		treeDegree = 1;
+	}
+	log(INFO, "Replicating between cluster masters as a " + replication +
+		(treeDegree > 1 ? " of degree " + to_string(treeDegree) : ""));
+
+	RunServer(host, port, numClusters, treeDegree, timeoutMs, missIntervalMs);
 	return 0;
 }
@@ -0,0 +1,73 @@
+#!/bin/bash
+# Compares replication between cluster masters as a full mesh and as a tree.
+# For each topology it starts a coordinator and one master per cluster on
+# this machine, then times clients that each send ops follows/unfollows.
+#
+# ./replication_bench.sh -n <clusters> -g <tree degree> -c <clients> -o <ops per client> -a <ack policy>
+
+clusters=3
+degree=2
+clients=8
+ops=500
+ack=all
+
+while getopts "n:g:c:o:a:" opt; do
+	case $opt in
+		n) clusters=$OPTARG ;;
+		g) degree=$OPTARG ;;
+		c) clients=$OPTARG ;;
+		o) ops=$OPTARG ;;
+		a) ack=$OPTARG ;;
+		*) exit 1 ;;
+	esac
+done
+
+bin=$(cd "$(dirname "$0")" && pwd)/build/bin
+coordPort=9100
+basePort=10100
+
+run() {
+	local topology=$1
+	local dir
+	dir=$(mktemp -d)
+	cd "$dir" || exit 1
+
+	local pids=()
+	"$bin/coordinator" -p $coordPort -n "$clusters" -r "$topology" -g "$degree" 2> coordinator.log &
+	pids+=($!)
+	sleep 1
+
+	for ((c = 1; c <= clusters; c++)); do
+		"$bin/server" -c $c -s 1 -k $coordPort -p $((basePort + c)) -a "$ack" 2> server$c.log &
+		pids+=($!)
+	done
+	# Every master has registered after its first heartbeat
+	sleep 4
+
+	local start end clientPids=()
+	start=$(date +%s.%N)
+	for ((i = 0; i < clients; i++)); do
+		(
+			other=bench$(((i + 1) % clients))
+			for ((j = 0; j < ops / 2; j++)); do
+				echo "FOLLOW $other"
+				echo "UNFOLLOW $other"
+			done
+		) | "$bin/client" -k $coordPort -u bench$i > /dev/null &
+		clientPids+=($!)
+	done
+	wait "${clientPids[@]}"
+	end=$(date +%s.%N)
+
+	kill "${pids[@]}" 2> /dev/null
+	wait 2> /dev/null
+
+	awk -v t="$topology" -v n="$clusters" -v ops=$((clients * ops)) -v s="$start" -v e="$end" \
+		'BEGIN { printf "%-6s %2d clusters  %6d ops  %6.2fs  %8.0f ops/s\n", t, n, ops, e - s, ops / (e - s) }'
+
+	cd - > /dev/null || exit 1
+	rm -rf "$dir"
+}
+
+run mesh
+run tree
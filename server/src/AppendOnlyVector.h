@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <mutex>
+#include <stdexcept>
+
+/*
+	Growable array that supports lock-free reads alongside appends.
+
+	Elements live in fixed-size segments that are never moved or freed
+	while the vector exists, so a reference returned by operator[] stays
+	valid. Segments are found through tables of segment pointers, and
+	tables are allocated as they fill, so the vector grows to every
+	non-negative int index without reserving the whole table up front.
+	Appends are serialized by a mutex and publish the new size with
+	release ordering; any index below size() is safe to read from any
+	thread without locking. Elements cannot be removed.
+*/
+template <typename T>
+class AppendOnlyVector {
+
+public:
+	AppendOnlyVector() {
+		for(int i = 0; i < MAX_TABLES; i++) {
+			tables[i] = NULL;
+		}
+	}
+
+	virtual ~AppendOnlyVector() {
+		for(int i = 0; i < MAX_TABLES && tables[i] != NULL; i++) {
+			for(int j = 0; j < TABLE_SIZE; j++) {
+				delete[] tables[i][j];
+			}
+			delete[] tables[i];
+		}
+	}
+
+	AppendOnlyVector(const AppendOnlyVector&) = delete;
+	AppendOnlyVector& operator=(const AppendOnlyVector&) = delete;
+
+	// Returns the index of the new element. Throws length_error only
+	// once every int index is taken.
+	int push_back(const T &item) {
+		std::lock_guard<std::mutex> lock(mtx);
+
+		int idx = count.load(std::memory_order_relaxed);
+		if(idx == INT_MAX) {
+			throw std::length_error("AppendOnlyVector is full");
+		}
+		int seg = idx >> SEGMENT_BITS;
+		T** &table = tables[seg >> TABLE_BITS];
+		if(table == NULL) {
+			table = new T*[TABLE_SIZE]();
+		}
+		T* &segment = table[seg & TABLE_MASK];
+		if(segment == NULL) {
+			segment = new T[SEGMENT_SIZE];
+		}
+		segment[idx & SEGMENT_MASK] = item;
+
+		count.store(idx + 1, std::memory_order_release);
+		return idx;
+	}
+
+	// idx must be below a value previously returned by size()
+	const T& operator[](int idx) const {
+		int seg = idx >> SEGMENT_BITS;
+		return tables[seg >> TABLE_BITS][seg & TABLE_MASK][idx & SEGMENT_MASK];
+	}
+
+	int size() const { return count.load(std::memory_order_acquire); }
+
+private:
+	static const int SEGMENT_BITS = 12;
+	static const int SEGMENT_SIZE = 1 << SEGMENT_BITS;
+	static const int SEGMENT_MASK = SEGMENT_SIZE - 1;
+
+	// Segment pointers per table, and enough tables to reach INT_MAX
+	static const int TABLE_BITS = 10;
+	static const int TABLE_SIZE = 1 << TABLE_BITS;
+	static const int TABLE_MASK = TABLE_SIZE - 1;
+	static const int MAX_TABLES = 1 << (31 - SEGMENT_BITS - TABLE_BITS);
+
+	T** tables[MAX_TABLES];
+	std::atomic<int> count{0};
+	std::mutex mtx;
+};
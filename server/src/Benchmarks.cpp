@@ -0,0 +1,185 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <malloc.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <google/protobuf/timestamp.pb.h>
+
+#include "Benchmarks.h"
+#include "PostStore.h"
+#include "WriteAheadLog.h"
+
+using google::protobuf::Timestamp;
+
+using namespace std;
+
+// Bytes currently allocated from the heap
+static size_t heapInUse()
+{
+	return mallinfo2().uordblks + mallinfo2().hblkhd;
+}
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// How posts were stored before PostStore
+struct LegacyPost {
+	UserId author;
+	string data;
+	Timestamp timestamp;
+	bool pushed = true;
+};
+
+int benchPostStore(int posts)
+{
+	const int AUTHORS = 10000;
+	const int BODY = 60;
+	const int SCANS = 5;
+
+	// Posts spread over a day in arrival order, bodies of BODY bytes
+	mt19937 rng(1);
+	vector<UserId> authors(posts);
+	vector<int64_t> times(posts);
+	int64_t start = 1700000000LL * 1000000000LL;
+	for(int i = 0; i < posts; i++) {
+		authors[i] = rng() % AUTHORS;
+		times[i] = start + (int64_t)i * (86400LL * 1000000000LL / posts);
+	}
+	string body(BODY, 'x');
+
+	// A follower of 1% of authors, reading posts from the last half day
+	vector<char> followed(AUTHORS);
+	for(int i = 0; i < AUTHORS / 100; i++) {
+		followed[rng() % AUTHORS] = true;
+	}
+	int64_t since = start + 43200LL * 1000000000LL;
+
+	cout << posts << " posts, " << BODY << "-byte bodies, scans keep 1% of authors from the last half day\n";
+
+	{
+		size_t before = heapInUse();
+		chrono::steady_clock::time_point t = chrono::steady_clock::now();
+		vector<shared_ptr<LegacyPost>> legacy;
+		for(int i = 0; i < posts; i++) {
+			shared_ptr<LegacyPost> post = make_shared<LegacyPost>();
+			post->author = authors[i];
+			post->data = body;
+			post->timestamp = PostStore::fromNanos(times[i]);
+			legacy.push_back(post);
+		}
+		double loadSeconds = secondsSince(t);
+		size_t bytes = heapInUse() - before;
+
+		long matched = 0;
+		t = chrono::steady_clock::now();
+		for(int s = 0; s < SCANS; s++) {
+			for(const shared_ptr<LegacyPost> &post : legacy) {
+				if(followed[post->author] && PostStore::toNanos(post->timestamp) > since) {
+					matched++;
+				}
+			}
+		}
+		double scanSeconds = secondsSince(t);
+
+		cout << "  shared_ptr<Post>: " << bytes / posts << " B/post, load " << (long)(posts / loadSeconds)
+			 << " posts/s, scan " << (long)(SCANS * (double)posts / scanSeconds) << " posts/s ("
+			 << matched / SCANS << " matched)\n";
+	}
+
+	{
+		size_t before = heapInUse();
+		chrono::steady_clock::time_point t = chrono::steady_clock::now();
+		unique_ptr<PostStore> store = make_unique<PostStore>();
+		for(int i = 0; i < posts; i++) {
+			store->append(authors[i], times[i], body, true);
+		}
+		double loadSeconds = secondsSince(t);
+		size_t bytes = heapInUse() - before;
+
+		long matched = 0;
+		t = chrono::steady_clock::now();
+		for(int s = 0; s < SCANS; s++) {
+			int size = store->size();
+			for(PostId i = 0; i < size; i++) {
+				const PostRecord &post = (*store)[i];
+				if(followed[post.author] && post.timeNanos > since) {
+					matched++;
+				}
+			}
+		}
+		double scanSeconds = secondsSince(t);
+
+		cout << "  PostStore:        " << bytes / posts << " B/post, load " << (long)(posts / loadSeconds)
+			 << " posts/s, scan " << (long)(SCANS * (double)posts / scanSeconds) << " posts/s ("
+			 << matched / SCANS << " matched)\n";
+	}
+
+	return 0;
+}
+
+int benchWriteAheadLog(int records)
+{
+	const int THREADS = 32;
+	const int RECORD = 100;
+	const string path = "wal-bench.log";
+
+	cout << records << " records of " << RECORD << " bytes, each appended and waited for by one of "
+		 << THREADS << " threads\n";
+
+	const char *modes[] = {"none", "interval", "batch"};
+	for(const char *name : modes) {
+		WriteAheadLog::Durability durability;
+		WriteAheadLog::parseDurability(name, durability);
+
+		unlink(path.c_str());
+		unique_ptr<WriteAheadLog> log = make_unique<WriteAheadLog>(path, durability, 100);
+		if(log->open() == -1) {
+			cerr << "Could not open " << path << "\n";
+			return -1;
+		}
+
+		string record(RECORD, 'x');
+		atomic<int> failed{0};
+		chrono::steady_clock::time_point t = chrono::steady_clock::now();
+		vector<thread> threads;
+		for(int i = 0; i < THREADS; i++) {
+			threads.emplace_back([&, i]() {
+				for(int j = i; j < records; j += THREADS) {
+					if(log->wait(log->append(record)) == -1) {
+						failed++;
+					}
+				}
+			});
+		}
+		for(thread &th : threads) {
+			th.join();
+		}
+		double seconds = secondsSince(t);
+
+		cout << "  " << name << ": " << (long)(records / seconds) << " records/s, " << log->stats()
+			 << (failed > 0 ? ", FAILED" : "") << "\n";
+	}
+	unlink(path.c_str());
+
+	return 0;
+}
+
+int runBenchmark(const string &name, int size)
+{
+	if(name == "posts") {
+		return benchPostStore(size > 0 ? size : 1000000);
+	}
+	if(name == "wal") {
+		return benchWriteAheadLog(size > 0 ? size : 16000);
+	}
+	cerr << "Unknown benchmark " << name << ". Use posts or wal\n";
+	return -1;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+/*
+	Offline benchmarks of server data structures, run with
+	server -B <name> -n <size> instead of serving. Each prints its
+	results to stdout and returns 0, or -1 if it could not run.
+*/
+
+// Memory per post and author/time scan throughput of PostStore against
+// the shared_ptr<Post> layout it replaced, over posts posts
+int benchPostStore(int posts);
+
+// Group commit of WriteAheadLog in each durability mode: 32 threads
+// append and wait for records records in total to a file in the
+// current directory, which is removed afterwards
+int benchWriteAheadLog(int records);
+
+// Runs the named benchmark with the given size, 0 for its default
+int runBenchmark(const std::string &name, int size);
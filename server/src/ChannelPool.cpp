@@ -0,0 +1,78 @@
+#include "ChannelPool.h"
+
+using grpc::Channel;
+
+using SNS::SNSService;
+
+using namespace std;
+
+shared_ptr<SNSService::Stub> ChannelPool::get(const string &addr, const string &group, bool &created)
+{
+	lock_guard<mutex> lock(mtx);
+
+	created = false;
+	auto it = entries.find(addr);
+	if(it != entries.end() && isDead(it->second.channel->GetState(false))) {
+		it->second.channel = NULL;
+	}
+
+	Entry &entry = entries[addr];
+	if(entry.channel == NULL) {
+		entry.channel = grpc::CreateChannel(addr, grpc::InsecureChannelCredentials());
+		entry.stub = make_shared<SNSService::Stub>(entry.channel);
+		created = true;
+	}
+	entry.groups.insert(group);
+
+	return entry.stub;
+}
+
+void ChannelPool::retain(const string &group, const vector<string> &addrs)
+{
+	set<string> live(addrs.begin(), addrs.end());
+
+	lock_guard<mutex> lock(mtx);
+	for(auto it = entries.begin(); it != entries.end(); ) {
+		if(live.count(it->first) == 0) {
+			it->second.groups.erase(group);
+		}
+
+		if(it->second.groups.empty()) {
+			it = entries.erase(it);
+		} else {
+			it++;
+		}
+	}
+}
+
+void ChannelPool::evict(const string &addr)
+{
+	lock_guard<mutex> lock(mtx);
+	entries.erase(addr);
+}
+
+int ChannelPool::checkHealth()
+{
+	lock_guard<mutex> lock(mtx);
+
+	int unhealthy = 0;
+	for(auto it = entries.begin(); it != entries.end(); ) {
+		grpc_connectivity_state state = it->second.channel->GetState(true);
+		if(state != GRPC_CHANNEL_READY) {
+			unhealthy++;
+		}
+
+		if(state == GRPC_CHANNEL_SHUTDOWN) {
+			it = entries.erase(it);
+		} else {
+			it++;
+		}
+	}
+	return unhealthy;
+}
+
+int ChannelPool::size()
+{
+	lock_guard<mutex> lock(mtx);
+	return (int)entries.size();
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+#include <snsproto/sns.grpc.pb.h>
+
+/*
+	Long-lived channels and stubs to other servers, keyed by address.
+
+	A channel is created the first time an address is used and shared by
+	every later request, so replication pays for connection setup once per
+	peer instead of once per write. Stubs are thread-safe and may be used
+	concurrently.
+
+	Each address is tagged with the destination groups it was last reported
+	in (e.g. counterparts, other masters). retain() drops an address from a
+	group when the coordinator stops listing it there, and evicts it once it
+	belongs to no group. Channels in TRANSIENT_FAILURE or SHUTDOWN are
+	replaced on the next get() so a restarted peer is reconnected to
+	without waiting out the channel's reconnect backoff.
+*/
+class ChannelPool {
+
+public:
+	ChannelPool() {};
+	virtual ~ChannelPool() {};
+
+	// Returns the stub for addr. Sets created if a new channel was made.
+	std::shared_ptr<SNS::SNSService::Stub> get(const std::string &addr, const std::string &group, bool &created);
+
+	// addrs is the complete current membership of group
+	void retain(const std::string &group, const std::vector<std::string> &addrs);
+
+	// Drops addr after a failed call, the next get() reconnects
+	void evict(const std::string &addr);
+
+	// Starts connecting idle channels and evicts dead ones.
+	// Returns the number of pooled channels that are not READY.
+	int checkHealth();
+
+	int size();
+
+private:
+	struct Entry {
+		std::shared_ptr<grpc::Channel> channel;
+		std::shared_ptr<SNS::SNSService::Stub> stub;
+		std::set<std::string> groups;
+	};
+
+	std::mutex mtx;
+	std::map<std::string, Entry> entries;
+
+	static bool isDead(grpc_connectivity_state state) {
+		return state == GRPC_CHANNEL_TRANSIENT_FAILURE || state == GRPC_CHANNEL_SHUTDOWN;
+	}
+};
@@ -0,0 +1,74 @@
+#include "FollowSet.h"
+
+using namespace std;
+
+// Returns the position of user in edges, or -1
+int FollowSet::indexOf(UserId user) const
+{
+	if(indexed) {
+		auto it = index.find(user);
+		return (it == index.end()) ? -1 : it->second;
+	}
+
+	for(int i = 0; i < (int)edges.size(); i++) {
+		if(edges[i].user == user) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const FollowEdge* FollowSet::find(UserId user) const
+{
+	int idx = indexOf(user);
+	if(idx < 0) {
+		return NULL;
+	}
+	return &edges[idx];
+}
+
+bool FollowSet::insert(UserId user, int64_t timeNanos)
+{
+	if(contains(user)) {
+		return false;
+	}
+
+	edges.push_back(FollowEdge{user, timeNanos});
+
+	if(indexed) {
+		index[user] = (int)edges.size() - 1;
+	} else if((int)edges.size() > SMALL_SET_MAX) {
+		// Set outgrew linear search, build the index once
+		index.reserve(edges.size() * 2);
+		for(int i = 0; i < (int)edges.size(); i++) {
+			index[edges[i].user] = i;
+		}
+		indexed = true;
+	}
+
+	return true;
+}
+
+bool FollowSet::erase(UserId user)
+{
+	int idx = indexOf(user);
+	if(idx < 0) {
+		return false;
+	}
+
+	// Move the last edge into the hole so the vector stays dense
+	int last = (int)edges.size() - 1;
+	if(idx != last) {
+		edges[idx] = std::move(edges[last]);
+		if(indexed) {
+			index[edges[idx].user] = idx;
+		}
+	}
+	edges.pop_back();
+
+	if(indexed) {
+		index.erase(user);
+	}
+
+	return true;
+}
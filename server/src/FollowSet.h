@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "UserRegistry.h"
+
+// One side of a follow relationship and the time it was made, in
+// nanoseconds like PostStore's records. Converted to a Timestamp only
+// at the RPC and log boundary, so an edge stays 16 bytes.
+struct FollowEdge {
+	UserId user;
+	int64_t timeNanos;
+};
+
+/*
+	Adjacency set of follow edges with O(1) expected insert, erase and lookup.
+
+	Edges are stored contiguously so fan-out loops walk a flat vector.
+	Small sets are searched linearly; once a set grows past SMALL_SET_MAX
+	a hash index from UserId to position is built and maintained.
+	Erase swaps the removed edge with the last one, so iteration order
+	is not insertion order after an erase.
+*/
+class FollowSet {
+
+public:
+	FollowSet() {};
+	virtual ~FollowSet() {};
+
+	bool contains(UserId user) const { return indexOf(user) >= 0; }
+
+	// Returns the edge to user, or NULL if there is none
+	const FollowEdge* find(UserId user) const;
+
+	// Returns false if the edge already exists
+	bool insert(UserId user, int64_t timeNanos);
+
+	// Returns false if there was no edge to remove
+	bool erase(UserId user);
+
+	int size() const { return (int)edges.size(); }
+	std::vector<FollowEdge>::const_iterator begin() const { return edges.begin(); }
+	std::vector<FollowEdge>::const_iterator end() const { return edges.end(); }
+
+private:
+	std::vector<FollowEdge> edges;
+	std::unordered_map<UserId, int> index;
+	bool indexed = false;
+
+	int indexOf(UserId user) const;
+
+	static const int SMALL_SET_MAX = 16;
+};
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "LogCompactor.h"
+
+using namespace std;
+
+// Bytes read from a log at a time
+static const size_t BLOCK_SIZE = 1024 * 1024;
+
+LogCompactor::LogCompactor(const string &userinfoPath, uint64_t userinfoLength,
+						const string &postsPath, uint64_t postsLength, size_t maxMissing)
+	: userinfoPath(userinfoPath), postsPath(postsPath), userinfoLength(userinfoLength),
+	postsLength(postsLength), maxMissing(maxMissing), start(chrono::steady_clock::now())
+{
+
+}
+
+int LogCompactor::run()
+{
+	// State the folded records built, by the user ids in the log
+	vector<string> names;
+	vector<uint64_t> userLsns;
+	vector<bool> known;
+	struct Edge {
+		int64_t timeNanos;
+		uint64_t lsn;
+	};
+	unordered_map<uint64_t, Edge> edges;	// by follower << 32 | followee
+
+	// Last seq applied by queue, and the record it was read at
+	struct Applied {
+		uint64_t seq;
+		long order;
+	};
+	unordered_map<uint64_t, Applied> applied;
+
+	vector<bool> present;	// by LSN
+	uint64_t covered = 0;	// LSN of an earlier checkpoint
+	unordered_set<uint64_t> coveredMissing;
+	uint32_t lastFingerprint = 0;
+
+	auto nameOf = [&](UserId id) {
+		return (id >= 0 && id < (int)names.size()) ? string_view(names[id]) : string_view();
+	};
+	auto isKnown = [&](UserId id) {
+		return id >= 0 && id < (int)known.size() && known[id];
+	};
+
+	string paths[2] = {userinfoPath, postsPath};
+	uint64_t lengths[2] = {userinfoLength, postsLength};
+	for(int i = 0; i < 2; i++) {
+		LogFileReader reader(paths[i], lengths[i], BLOCK_SIZE);
+		if(reader.open() == -1) {
+			return -1;
+		}
+
+		string_view frame;
+		LogRecord record;
+		int ret;
+		while((ret = reader.next(frame)) == 1) {
+			LogReader decoder(frame.data(), frame.size(), LogFormat::VERSION);
+			if(decoder.next(record) != 1) {
+				return -1;
+			}
+			numRecords++;
+
+			// Posts are only read for their LSNs
+			if(i == 0) {
+				uint64_t key = (uint64_t)(uint32_t)record.user << 32 | (uint32_t)record.target;
+				if(record.type == RECORD_USER && record.user >= 0 && !isKnown(record.user)) {
+					if(record.user >= (int)known.size()) {
+						names.resize(record.user + 1);
+						userLsns.resize(record.user + 1);
+						known.resize(record.user + 1);
+					}
+					names[record.user] = string(record.text);
+					userLsns[record.user] = record.lsn;
+					known[record.user] = true;
+				} else if(record.type == RECORD_FOLLOW && isKnown(record.user) && isKnown(record.target)) {
+					// As in replay, following again keeps the first follow time
+					edges.emplace(key, Edge{record.timeNanos, record.lsn});
+				} else if(record.type == RECORD_UNFOLLOW) {
+					edges.erase(key);
+				} else if(record.type == RECORD_APPLIED) {
+					Applied &last = applied[record.queue];
+					last.seq = max(last.seq, record.seq);
+					last.order = numRecords;
+				} else if(record.type == RECORD_CHECKPOINT) {
+					covered = record.lsn;
+					vector<uint64_t> lsns = LogFormat::missingLsns(record);
+					coveredMissing = unordered_set<uint64_t>(lsns.begin(), lsns.end());
+				}
+			}
+
+			if(record.lsn == 0) {
+				continue;
+			}
+			if(record.lsn >= present.size()) {
+				present.resize(max((size_t)record.lsn + 1, present.size() * 2));
+			}
+			present[record.lsn] = true;
+
+			// Every user a record refers to was introduced before it
+			if(record.lsn > lastLsn) {
+				lastLsn = record.lsn;
+				lastFingerprint = LogFormat::fingerprint(record, nameOf(record.user), nameOf(record.target));
+			}
+		}
+		if(ret == -1) {
+			return -1;
+		}
+	}
+
+	vector<uint64_t> missing;
+	for(uint64_t lsn = 1; lsn < lastLsn; lsn++) {
+		if(present[lsn] || (lsn <= covered && coveredMissing.count(lsn) == 0)) {
+			continue;
+		}
+		if(missing.size() == maxMissing) {
+			return -1;
+		}
+		missing.push_back(lsn);
+	}
+
+	out = LogFormat::header();
+	for(UserId id = 0; id < (int)known.size(); id++) {
+		if(known[id]) {
+			LogFormat::encodeUser(out, userLsns[id], id, names[id]);
+			numUsers++;
+		}
+	}
+
+	vector<pair<uint64_t, Edge>> sorted(edges.begin(), edges.end());
+	sort(sorted.begin(), sorted.end(), [](const pair<uint64_t, Edge> &a, const pair<uint64_t, Edge> &b) {
+		return a.first < b.first;
+	});
+	for(const pair<uint64_t, Edge> &edge : sorted) {
+		LogFormat::encodeFollow(out, edge.second.lsn, (UserId)(edge.first >> 32), (UserId)(uint32_t)edge.first,
+								edge.second.timeNanos);
+	}
+	numFollows = sorted.size();
+
+	// In the order they were last written, so a replay sees the same
+	// queue last active
+	vector<pair<uint64_t, Applied>> queues(applied.begin(), applied.end());
+	sort(queues.begin(), queues.end(), [](const pair<uint64_t, Applied> &a, const pair<uint64_t, Applied> &b) {
+		return a.second.order < b.second.order;
+	});
+	for(const pair<uint64_t, Applied> &queue : queues) {
+		LogFormat::encodeApplied(out, queue.first, queue.second.seq);
+	}
+
+	LogFormat::encodeCheckpoint(out, lastLsn, lastFingerprint, missing);
+	return 0;
+}
+
+string LogCompactor::stats()
+{
+	long elapsedMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+	return to_string(userinfoLength) + " bytes of userinfo into " + to_string(out.size()) + " "
+		"(" + to_string(numUsers) + " users, " + to_string(numFollows) + " follows) through LSN " + to_string(lastLsn) + ". "
+		"Read " + to_string(numRecords) + " records in " + to_string(elapsedMs) + "ms";
+}
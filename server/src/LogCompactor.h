@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "LogFormat.h"
+
+/*
+	Folds the start of a userinfo log into a checkpoint, so a server
+	replays the state the log built instead of every operation in it.
+
+	The checkpoint holds the USER record of every user and one FOLLOW
+	record, with its original time and LSN, for every follow still
+	standing. Follows that were undone are dropped along with their
+	unfollows, and of the APPLIED records only the last of each queue is
+	kept. A CHECKPOINT record ends it, carrying the highest LSN in
+	either log, the fingerprint of the record under it, and the LSNs
+	below it that neither log held. The posts log is only read for its
+	LSNs; every post stays in it.
+
+	User ids are kept as they are, so the posts log still refers to the
+	right users. A log that already starts with a checkpoint is folded
+	again with it.
+*/
+class LogCompactor {
+
+public:
+	LogCompactor(const std::string &userinfoPath, uint64_t userinfoLength,
+				const std::string &postsPath, uint64_t postsLength, size_t maxMissing);
+
+	/*
+		Reads the first userinfoLength bytes of userinfo and postsLength
+		bytes of posts. Returns -1 if either can't be read or holds a
+		corrupt record, or if the logs lack more than maxMissing LSNs
+		below the checkpoint.
+	*/
+	int run();
+
+	// A log header followed by the checkpoint, to replace the bytes read
+	const std::string& checkpoint() const { return out; }
+
+	uint64_t lsn() const { return lastLsn; }
+	std::string stats();
+
+private:
+	std::string userinfoPath;
+	std::string postsPath;
+	uint64_t userinfoLength;
+	uint64_t postsLength;
+	size_t maxMissing;
+	std::chrono::steady_clock::time_point start;
+
+	std::string out;
+	uint64_t lastLsn = 0;
+	long numRecords = 0;
+	int numUsers = 0;
+	long numFollows = 0;
+};
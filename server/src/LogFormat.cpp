@@ -0,0 +1,410 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "LogFormat.h"
+
+using namespace std;
+
+static const char MAGIC[4] = {'S', 'N', 'S', 'L'};
+
+// ---- ENCODING ----
+
+static void putU8(string &out, uint8_t v)
+{
+	out.push_back((char)v);
+}
+
+static void putU32(string &out, uint32_t v)
+{
+	for(int i = 0; i < 4; i++) {
+		out.push_back((char)(v >> (8 * i)));
+	}
+}
+
+static void putI64(string &out, int64_t v)
+{
+	for(int i = 0; i < 8; i++) {
+		out.push_back((char)((uint64_t)v >> (8 * i)));
+	}
+}
+
+// Reserves the length and checksum, returns where the payload starts
+static size_t beginRecord(string &out, RecordType type, uint64_t lsn)
+{
+	putU32(out, 0);
+	putU32(out, 0);
+	size_t start = out.size();
+	putU8(out, type);
+	putI64(out, (int64_t)lsn);
+	return start;
+}
+
+// Fills in the length and checksum of the record begun at start
+static void endRecord(string &out, size_t start)
+{
+	uint32_t length = (uint32_t)(out.size() - start);
+	uint32_t crc = LogFormat::crc32(out.data() + start, length);
+	for(int i = 0; i < 4; i++) {
+		out[start - 8 + i] = (char)(length >> (8 * i));
+		out[start - 4 + i] = (char)(crc >> (8 * i));
+	}
+}
+
+string LogFormat::header()
+{
+	string out(MAGIC, sizeof(MAGIC));
+	putU8(out, VERSION & 0xff);
+	putU8(out, VERSION >> 8);
+	putU8(out, 0);
+	putU8(out, 0);
+	return out;
+}
+
+void LogFormat::encodeUser(string &out, uint64_t lsn, UserId id, string_view name)
+{
+	size_t start = beginRecord(out, RECORD_USER, lsn);
+	putU32(out, (uint32_t)id);
+	putU32(out, (uint32_t)name.size());
+	out.append(name);
+	endRecord(out, start);
+}
+
+void LogFormat::encodeFollow(string &out, uint64_t lsn, UserId follower, UserId followee, int64_t timeNanos)
+{
+	size_t start = beginRecord(out, RECORD_FOLLOW, lsn);
+	putU32(out, (uint32_t)follower);
+	putU32(out, (uint32_t)followee);
+	putI64(out, timeNanos);
+	endRecord(out, start);
+}
+
+void LogFormat::encodeUnfollow(string &out, uint64_t lsn, UserId follower, UserId followee)
+{
+	size_t start = beginRecord(out, RECORD_UNFOLLOW, lsn);
+	putU32(out, (uint32_t)follower);
+	putU32(out, (uint32_t)followee);
+	endRecord(out, start);
+}
+
+void LogFormat::encodePost(string &out, uint64_t lsn, UserId author, int64_t timeNanos, string_view content)
+{
+	size_t start = beginRecord(out, RECORD_POST, lsn);
+	putU32(out, (uint32_t)author);
+	putI64(out, timeNanos);
+	putU32(out, (uint32_t)content.size());
+	out.append(content);
+	endRecord(out, start);
+}
+
+void LogFormat::encodeCheckpoint(string &out, uint64_t lsn, uint32_t fingerprint, const vector<uint64_t> &missing)
+{
+	size_t start = beginRecord(out, RECORD_CHECKPOINT, lsn);
+	putU32(out, fingerprint);
+	putU32(out, (uint32_t)missing.size());
+	for(uint64_t m : missing) {
+		putI64(out, (int64_t)m);
+	}
+	endRecord(out, start);
+}
+
+void LogFormat::encodeApplied(string &out, uint64_t queue, uint64_t seq)
+{
+	size_t start = beginRecord(out, RECORD_APPLIED, 0);
+	putI64(out, (int64_t)queue);
+	putI64(out, (int64_t)seq);
+	endRecord(out, start);
+}
+
+void LogFormat::encode(string &out, const LogRecord &record)
+{
+	switch(record.type) {
+		case RECORD_USER:
+			encodeUser(out, record.lsn, record.user, record.text);
+			break;
+		case RECORD_FOLLOW:
+			encodeFollow(out, record.lsn, record.user, record.target, record.timeNanos);
+			break;
+		case RECORD_UNFOLLOW:
+			encodeUnfollow(out, record.lsn, record.user, record.target);
+			break;
+		case RECORD_POST:
+			encodePost(out, record.lsn, record.user, record.timeNanos, record.text);
+			break;
+		case RECORD_CHECKPOINT:
+			encodeCheckpoint(out, record.lsn, record.fingerprint, missingLsns(record));
+			break;
+		case RECORD_APPLIED:
+			encodeApplied(out, record.queue, record.seq);
+			break;
+	}
+}
+
+
+uint32_t LogFormat::fingerprint(const LogRecord &record, string_view user, string_view target)
+{
+	if(record.type == RECORD_CHECKPOINT) {
+		return record.fingerprint;
+	}
+
+	string data;
+	putU8(data, record.type);
+	putI64(data, (int64_t)record.lsn);
+	putI64(data, record.timeNanos);
+	for(string_view field : {user, target, record.text}) {
+		putU32(data, (uint32_t)field.size());
+		data.append(field);
+	}
+	return crc32(data.data(), data.size());
+}
+
+// CRC-32 (IEEE 802.3), table driven
+uint32_t LogFormat::crc32(const char *data, size_t size)
+{
+	static uint32_t table[256];
+	static bool init = [] {
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for(int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void)init;
+
+	uint32_t crc = 0xFFFFFFFF;
+	for(size_t i = 0; i < size; i++) {
+		crc = table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+// ---- DECODING ----
+
+static uint32_t getU32(const char *p)
+{
+	const uint8_t *b = (const uint8_t*)p;
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static int64_t getI64(const char *p)
+{
+	return (int64_t)((uint64_t)getU32(p) | ((uint64_t)getU32(p + 4) << 32));
+}
+
+vector<uint64_t> LogFormat::missingLsns(const LogRecord &checkpoint)
+{
+	vector<uint64_t> lsns(checkpoint.text.size() / 8);
+	for(size_t i = 0; i < lsns.size(); i++) {
+		lsns[i] = (uint64_t)getI64(checkpoint.text.data() + 8 * i);
+	}
+	return lsns;
+}
+
+// Oldest format version still read
+static const uint16_t MIN_VERSION = 1;
+
+LogReader::LogReader(const char *data, size_t size) : data(data), size(size)
+{
+	if(size == 0) {
+		headerOk = true;
+		return;
+	}
+
+	if(size >= LogFormat::HEADER_SIZE && memcmp(data, MAGIC, sizeof(MAGIC)) == 0) {
+		formatVersion = (uint8_t)data[4] | ((uint8_t)data[5] << 8);
+		headerOk = formatVersion >= MIN_VERSION && formatVersion <= LogFormat::VERSION;
+	}
+	pos = LogFormat::HEADER_SIZE;
+}
+
+LogReader::LogReader(const char *data, size_t size, uint16_t version)
+	: data(data), size(size), headerOk(version >= MIN_VERSION && version <= LogFormat::VERSION), formatVersion(version)
+{
+
+}
+
+int LogReader::next(LogRecord &record)
+{
+	if(!headerOk) {
+		return -1;
+	}
+	if(pos >= size) {
+		return 0;
+	}
+	if(size - pos < 8) {
+		return -1;
+	}
+
+	uint32_t length = getU32(data + pos);
+	uint32_t crc = getU32(data + pos + 4);
+	const char *p = data + pos + 8;
+	if(length < 1 || size - pos - 8 < length || LogFormat::crc32(p, length) != crc) {
+		return -1;
+	}
+
+	record.type = (RecordType)(uint8_t)p[0];
+	record.lsn = 0;
+	record.user = INVALID_USER;
+	record.target = INVALID_USER;
+	record.timeNanos = 0;
+	record.text = string_view();
+	record.fingerprint = 0;
+	record.queue = 0;
+	record.seq = 0;
+	const char *f = p + 1;
+	uint32_t fields = length - 1;
+
+	// Version 1 records have no LSN
+	if(formatVersion >= 2) {
+		if(fields < 8) {
+			return -1;
+		}
+		record.lsn = (uint64_t)getI64(f);
+		f += 8;
+		fields -= 8;
+	}
+
+	// Check each payload's size against its type before reading fields
+	switch(record.type) {
+		case RECORD_USER:
+			if(fields < 8 || fields - 8 != getU32(f + 4)) {
+				return -1;
+			}
+			record.user = (UserId)getU32(f);
+			record.text = string_view(f + 8, fields - 8);
+			break;
+		case RECORD_FOLLOW:
+			if(fields != 16) {
+				return -1;
+			}
+			record.user = (UserId)getU32(f);
+			record.target = (UserId)getU32(f + 4);
+			record.timeNanos = getI64(f + 8);
+			break;
+		case RECORD_UNFOLLOW:
+			if(fields != 8) {
+				return -1;
+			}
+			record.user = (UserId)getU32(f);
+			record.target = (UserId)getU32(f + 4);
+			break;
+		case RECORD_POST:
+			if(fields < 16 || fields - 16 != getU32(f + 12)) {
+				return -1;
+			}
+			record.user = (UserId)getU32(f);
+			record.timeNanos = getI64(f + 4);
+			record.text = string_view(f + 16, fields - 16);
+			break;
+		case RECORD_CHECKPOINT:
+			if(fields < 8 || fields - 8 != 8 * (uint64_t)getU32(f + 4)) {
+				return -1;
+			}
+			record.fingerprint = getU32(f);
+			record.text = string_view(f + 8, fields - 8);
+			break;
+		case RECORD_APPLIED:
+			if(fields != 16) {
+				return -1;
+			}
+			record.queue = (uint64_t)getI64(f);
+			record.seq = (uint64_t)getI64(f + 8);
+			break;
+		default:
+			return -1;
+	}
+
+	pos += 8 + length;
+	return 1;
+}
+
+// ---- FILE READER ----
+
+LogFileReader::LogFileReader(const string &path, uint64_t length, size_t blockSize)
+	: path(path), length(length), blockSize(blockSize)
+{
+
+}
+
+LogFileReader::~LogFileReader()
+{
+	if(fd >= 0) {
+		::close(fd);
+	}
+}
+
+int LogFileReader::open()
+{
+	fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+
+	buffer.resize(blockSize);
+	if(!fill(LogFormat::HEADER_SIZE)) {
+		// An empty log has no header yet
+		return length == 0 ? 0 : -1;
+	}
+
+	LogReader header(buffer.data() + begin, LogFormat::HEADER_SIZE);
+	if(!header.valid() || header.version() != LogFormat::VERSION) {
+		return -1;
+	}
+	begin += LogFormat::HEADER_SIZE;
+	return 0;
+}
+
+int LogFileReader::next(string_view &frame)
+{
+	if(!fill(8)) {
+		return begin == end ? 0 : -1;
+	}
+
+	size_t size = 8 + (size_t)getU32(buffer.data() + begin);
+	if(!fill(size)) {
+		return -1;
+	}
+
+	frame = string_view(buffer.data() + begin, size);
+	begin += size;
+	return 1;
+}
+
+bool LogFileReader::fill(size_t need)
+{
+	if(end - begin >= need) {
+		return true;
+	}
+
+	// A torn or corrupt length can't be read, so don't allocate for it
+	if(need > (end - begin) + (length - fileOffset)) {
+		return false;
+	}
+
+	// Move what is left to the front, and grow for a record larger than a block
+	memmove(&buffer[0], buffer.data() + begin, end - begin);
+	end -= begin;
+	begin = 0;
+	if(buffer.size() < need) {
+		buffer.resize(need);
+	}
+
+	while(end < need && fileOffset < length) {
+		size_t want = (size_t)min<uint64_t>(buffer.size() - end, length - fileOffset);
+		ssize_t n = pread(fd, &buffer[end], want, fileOffset);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			return false;
+		}
+		end += n;
+		fileOffset += n;
+	}
+	return end >= need;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "UserRegistry.h"
+
+/*
+	Binary format of the userinfo and posts logs.
+
+	A log starts with an 8 byte header: the magic "SNSL", a uint16 format
+	version and a uint16 reserved for flags. Records follow back to back:
+
+		uint32 payload length
+		uint32 CRC-32 of the payload
+		payload: uint8 record type, uint64 LSN, then the fields of that type
+
+		USER      int32 id, uint32 name length, name
+		FOLLOW    int32 follower, int32 followee, int64 time
+		UNFOLLOW  int32 follower, int32 followee
+		POST      int32 author, int64 time, uint32 content length, content
+		CHECKPOINT uint32 fingerprint, uint32 count, count uint64 LSNs
+		APPLIED   uint64 queue, uint64 seq
+
+	Integers are little-endian and times are nanoseconds since the epoch.
+	User ids are those of the server that wrote the log. The USER record
+	that introduces an id always precedes its use, so a reader can map
+	them onto its own ids.
+
+	The LSN (log sequence number) numbers operations across both logs of
+	a cluster. The cluster master gives each record it writes the next
+	LSN and its slaves write the same operation under the same LSN, so a
+	slave can ask its master for just the records after the ones it has.
+	Records within a log are in the order they were applied, which is not
+	necessarily LSN order. LSN 0 means the record was never numbered.
+	Version 1 logs had no LSNs; they are read with LSN 0.
+
+	A userinfo log may start with a checkpoint (see LogCompactor): the
+	USER records of every user and a FOLLOW record for every follow that
+	stood, each under its original LSN, followed by a CHECKPOINT record.
+	The checkpoint replaced every record the log held up to the LSN of
+	its CHECKPOINT record. The CHECKPOINT record carries the fingerprint
+	of the record at that LSN, and the LSNs below it the logs lacked.
+
+	An APPLIED record follows the records of each replicated batch a
+	server applied, with the replication queue the batch came from and
+	the seq of its last operation (see Replicator). It is the server's
+	own bookkeeping, never numbered (LSN 0) and ignored in other
+	servers' logs. A checkpoint keeps the last one of each queue.
+*/
+
+enum RecordType {
+	RECORD_USER = 1,
+	RECORD_FOLLOW = 2,
+	RECORD_UNFOLLOW = 3,
+	RECORD_POST = 4,
+	RECORD_CHECKPOINT = 5,
+	RECORD_APPLIED = 6
+};
+
+// One decoded record. text points into the buffer being read.
+struct LogRecord {
+	RecordType type;
+	uint64_t lsn;
+	UserId user;		// USER: the user, FOLLOW/UNFOLLOW: follower, POST: author
+	UserId target;		// FOLLOW/UNFOLLOW: followee
+	int64_t timeNanos;	// FOLLOW, POST
+	std::string_view text;	// USER: username, POST: content, CHECKPOINT: packed LSNs
+	uint32_t fingerprint;	// CHECKPOINT
+	uint64_t queue;		// APPLIED
+	uint64_t seq;		// APPLIED
+};
+
+class LogFormat {
+
+public:
+	static const uint16_t VERSION = 2;
+	static constexpr size_t HEADER_SIZE = 8;
+
+	static std::string header();
+
+	// Each appends one framed record to out
+	static void encodeUser(std::string &out, uint64_t lsn, UserId id, std::string_view name);
+	static void encodeFollow(std::string &out, uint64_t lsn, UserId follower, UserId followee, int64_t timeNanos);
+	static void encodeUnfollow(std::string &out, uint64_t lsn, UserId follower, UserId followee);
+	static void encodePost(std::string &out, uint64_t lsn, UserId author, int64_t timeNanos, std::string_view content);
+	static void encodeCheckpoint(std::string &out, uint64_t lsn, uint32_t fingerprint, const std::vector<uint64_t> &missing);
+	static void encodeApplied(std::string &out, uint64_t queue, uint64_t seq);
+	static void encode(std::string &out, const LogRecord &record);
+
+	// The LSNs a CHECKPOINT record lists as missing
+	static std::vector<uint64_t> missingLsns(const LogRecord &checkpoint);
+
+	/*
+		Checksum of what a record means rather than of its bytes. Servers
+		give users different ids, so the names of record.user and
+		record.target are passed in to stand for them. A CHECKPOINT record
+		has the fingerprint of the record at its LSN.
+	*/
+	static uint32_t fingerprint(const LogRecord &record, std::string_view user, std::string_view target);
+
+	static uint32_t crc32(const char *data, size_t size);
+};
+
+// Records of one log, in the order they were written
+class RecordSource {
+
+public:
+	virtual ~RecordSource() {};
+
+	// Returns 1 if a record was read, 0 at the end of the log, and -1
+	// if the record at offset() is truncated or fails its checksum
+	virtual int next(LogRecord &record) = 0;
+
+	virtual size_t offset() const = 0;
+};
+
+/*
+	Decodes records in place from a byte buffer. Nothing is copied;
+	the buffer must outlive the records read from it.
+*/
+class LogReader : public RecordSource {
+
+public:
+	LogReader(const char *data, size_t size);
+	LogReader(std::string_view buffer) : LogReader(buffer.data(), buffer.size()) {};
+
+	// Reads records with no header before them, as written by version
+	LogReader(const char *data, size_t size, uint16_t version);
+
+	// False if the buffer is not empty and doesn't start with a supported header
+	bool valid() const { return headerOk; }
+
+	// Format version of the buffer, LogFormat::VERSION if it is empty
+	uint16_t version() const { return formatVersion; }
+
+	int next(LogRecord &record) override;
+	size_t offset() const override { return pos; }
+
+private:
+	const char *data;
+	size_t size;
+	size_t pos = 0;
+	bool headerOk = false;
+	uint16_t formatVersion = LogFormat::VERSION;
+};
+
+/*
+	Reads the records of a log file a block at a time, so memory stays at
+	about one block however long the log is. Only the first length bytes
+	are read, which lets a log be read while it is being appended to.
+	Records are returned as they are framed in the file, unchecked;
+	decode them with a LogReader.
+*/
+class LogFileReader {
+
+public:
+	LogFileReader(const std::string &path, uint64_t length, size_t blockSize);
+	virtual ~LogFileReader();
+
+	// Opens the file and reads its header. Returns -1 if the file can't
+	// be read or isn't in the current format version.
+	int open();
+
+	// Returns 1 and points frame at the next record, 0 at the end, and -1
+	// on a read error or a truncated record. frame is valid until the next call.
+	int next(std::string_view &frame);
+
+private:
+	std::string path;
+	uint64_t length;
+	size_t blockSize;
+	int fd = -1;
+
+	std::string buffer;
+	size_t begin = 0;		// unread bytes of buffer are [begin, end)
+	size_t end = 0;
+	uint64_t fileOffset = 0;	// of the byte after the last one read into buffer
+
+	// Reads until buffer holds need unread bytes. False at the end of the
+	// file, or at once if the rest of the file is shorter than need.
+	bool fill(size_t need);
+};
@@ -0,0 +1,178 @@
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "LogLoader.h"
+
+using namespace std;
+
+// Length field at the start of a framed record
+static uint32_t frameLength(const char *p)
+{
+	const uint8_t *b = (const uint8_t*)p;
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+LogLoader::LogLoader(const string &path, int numThreads, size_t chunkSize)
+	: path(path), numThreads(max(1, numThreads)), chunkSize(chunkSize), start(chrono::steady_clock::now())
+{
+
+}
+
+// Chunks being decoded point into the mapping, so the pool finishes first
+LogLoader::~LogLoader()
+{
+	pool.reset();
+	if(mapped != NULL) {
+		munmap((void*)mapped, size);
+	}
+}
+
+int LogLoader::open()
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) == -1) {
+		::close(fd);
+		return -1;
+	}
+	size = st.st_size;
+
+	// An empty log has no header yet
+	if(size > 0) {
+		void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p == MAP_FAILED) {
+			::close(fd);
+			return -1;
+		}
+		mapped = (const char*)p;
+		madvise(p, size, MADV_SEQUENTIAL);
+	}
+	::close(fd);
+
+	if(size > 0) {
+		LogReader header(mapped, min(size, LogFormat::HEADER_SIZE));
+		if(!header.valid() || header.version() != LogFormat::VERSION) {
+			return -1;
+		}
+		pos = scanned = LogFormat::HEADER_SIZE;
+	}
+
+	pool = make_unique<WorkerPool>(numThreads);
+	lock_guard<mutex> lock(mtx);
+	for(int i = 0; i < 2 * numThreads; i++) {
+		schedule();
+	}
+	return 0;
+}
+
+int LogLoader::next(LogRecord &record)
+{
+	// Rates are over the time records were being taken
+	if(!started) {
+		started = true;
+		start = finish = chrono::steady_clock::now();
+	}
+
+	unique_lock<mutex> lock(mtx);
+	while(!chunks.empty()) {
+		Chunk &chunk = *chunks.front();
+		cv.wait(lock, [&chunk] { return chunk.done; });
+
+		if(taken < chunk.records.size()) {
+			record = chunk.records[taken];
+			pos = chunk.ends[taken];
+			taken++;
+			numRecords++;
+			return 1;
+		}
+		if(chunk.status == -1) {
+			pos = chunk.errorOffset;
+			finish = chrono::steady_clock::now();
+			return -1;
+		}
+
+		// Records of the chunk were copied out by now, so its pages can go
+		release(chunk.end);
+		chunks.pop_front();
+		taken = 0;
+		schedule();
+	}
+	finish = chrono::steady_clock::now();
+	return 0;
+}
+
+// Drops the whole pages of the mapping before offset from memory
+void LogLoader::release(size_t offset)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t end = offset / page * page;
+	if(end > released) {
+		madvise((void*)(mapped + released), end - released, MADV_DONTNEED);
+		released = end;
+	}
+}
+
+/*
+	Hands the pool the next chunk: whole records from where the last
+	chunk ended, up to about chunkSize bytes. Only the length of each
+	record is read here. A record that runs past the end of the file
+	ends the last chunk, where decoding reports it. Called with mtx held.
+*/
+void LogLoader::schedule()
+{
+	if(scanned >= size) {
+		return;
+	}
+
+	size_t end = scanned;
+	while(end < size && end - scanned < chunkSize) {
+		if(size - end < 8 || frameLength(mapped + end) > size - end - 8) {
+			end = size;
+			break;
+		}
+		end += 8 + frameLength(mapped + end);
+	}
+
+	unique_ptr<Chunk> chunk = make_unique<Chunk>();
+	chunk->begin = scanned;
+	chunk->end = end;
+	scanned = end;
+
+	Chunk *c = chunk.get();
+	chunks.push_back(std::move(chunk));
+	pool->submit([this, c] { decode(c); });
+}
+
+void LogLoader::decode(Chunk *chunk)
+{
+	LogReader reader(mapped + chunk->begin, chunk->end - chunk->begin, LogFormat::VERSION);
+	LogRecord record;
+	int ret;
+	while((ret = reader.next(record)) == 1) {
+		chunk->records.push_back(record);
+		chunk->ends.push_back(chunk->begin + reader.offset());
+	}
+	chunk->status = ret;
+	chunk->errorOffset = chunk->begin + reader.offset();
+
+	{
+		lock_guard<mutex> lock(mtx);
+		chunk->done = true;
+	}
+	cv.notify_all();
+}
+
+string LogLoader::stats()
+{
+	double secs = chrono::duration<double>(finish - start).count();
+	char summary[96];
+	snprintf(summary, sizeof(summary), "(%.1f MB) in %ldms, %.0f records/s", pos / (1024.0 * 1024.0),
+			(long)(secs * 1000), secs > 0 ? numRecords / secs : 0.0);
+	return to_string(numRecords) + " records " + summary + " on " + to_string(numThreads) + " threads";
+}
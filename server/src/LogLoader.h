@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "LogFormat.h"
+#include "WorkerPool.h"
+
+/*
+	Reads a log file for replay at startup. The file is memory-mapped
+	instead of copied, and split into chunks of whole records that a
+	pool of threads decodes and checksums while the caller takes the
+	records in file order. Only a few chunks are decoded ahead of the
+	caller, so memory beyond the mapping stays small.
+
+	Records point into the mapping. Once next() has returned every
+	record of a chunk, the chunk's pages are dropped from memory, so a
+	record must be copied before the records after it are taken. The
+	file must not shrink while it is open.
+*/
+class LogLoader : public RecordSource {
+
+public:
+	LogLoader(const std::string &path, int numThreads, size_t chunkSize);
+	virtual ~LogLoader();
+
+	// Maps the file and reads its header. Returns -1 if the file can't be
+	// read or isn't in the current format version.
+	int open();
+
+	// The whole file, header included
+	std::string_view data() const { return std::string_view(mapped, size); }
+
+	int next(LogRecord &record) override;
+	size_t offset() const override { return pos; }
+
+	// Records and bytes taken, and how fast, from the first next() until
+	// it returned 0 or -1
+	std::string stats();
+
+private:
+	struct Chunk {
+		size_t begin;
+		size_t end;
+		std::vector<LogRecord> records;
+		std::vector<size_t> ends;	// offset after each record
+		int status = 0;				// what LogReader::next returned last
+		size_t errorOffset = 0;
+		bool done = false;
+	};
+
+	std::string path;
+	int numThreads;
+	size_t chunkSize;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point finish;
+	bool started = false;
+
+	const char *mapped = NULL;
+	size_t size = 0;
+	size_t pos = 0;			// offset after the last record taken
+	size_t scanned = 0;		// offset the next chunk starts at
+	size_t released = 0;	// pages before it were dropped
+	long numRecords = 0;
+
+	// Chunks handed to the pool, in file order. Done flags are guarded by mtx.
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<std::unique_ptr<Chunk>> chunks;
+	size_t taken = 0;		// records of the front chunk already returned
+	std::unique_ptr<WorkerPool> pool;
+
+	void schedule();
+	void decode(Chunk *chunk);
+	void release(size_t offset);
+};
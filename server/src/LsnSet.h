@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/*
+	The LSNs a server's logs hold, one bit each. Grows to the highest
+	LSN added, so a million operations take 125KB.
+*/
+class LsnSet {
+
+public:
+	void add(uint64_t lsn) {
+		std::lock_guard<std::mutex> lock(mtx);
+		reserve(lsn);
+		words[lsn / 64] |= 1ULL << (lsn % 64);
+	}
+
+	// Adds every LSN from 1 through last
+	void addThrough(uint64_t last) {
+		std::lock_guard<std::mutex> lock(mtx);
+		reserve(last);
+		for(uint64_t word = 0; word < last / 64; word++) {
+			words[word] = ~0ULL;
+		}
+		for(uint64_t lsn = last / 64 * 64; lsn <= last; lsn++) {
+			words[lsn / 64] |= 1ULL << (lsn % 64);
+		}
+	}
+
+	void erase(uint64_t lsn) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if(lsn / 64 < words.size()) {
+			words[lsn / 64] &= ~(1ULL << (lsn % 64));
+		}
+	}
+
+	bool contains(uint64_t lsn) {
+		std::lock_guard<std::mutex> lock(mtx);
+		return lsn / 64 < words.size() && (words[lsn / 64] >> (lsn % 64)) & 1;
+	}
+
+private:
+	std::mutex mtx;
+	std::vector<uint64_t> words;
+
+	void reserve(uint64_t lsn) {
+		if(lsn / 64 >= words.size()) {
+			words.resize(std::max<size_t>(lsn / 64 + 1, words.size() * 2));
+		}
+	}
+};
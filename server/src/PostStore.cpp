@@ -0,0 +1,61 @@
+#include <cstring>
+
+#include "PostStore.h"
+
+using google::protobuf::Timestamp;
+
+using namespace std;
+
+PostStore::~PostStore()
+{
+	for(int i = 0; i < chunks.size(); i++) {
+		delete[] chunks[i];
+	}
+}
+
+PostId PostStore::append(UserId author, int64_t timeNanos, string_view content, bool pushed)
+{
+	lock_guard<mutex> lock(mtx);
+
+	uint32_t length = (uint32_t)content.size();
+
+	// Start a new chunk when the content doesn't fit in the current one.
+	// Content larger than a chunk gets a chunk of its own.
+	if(chunks.size() == 0 || chunkUsed + length > CHUNK_SIZE) {
+		uint32_t size = max(CHUNK_SIZE, length);
+		chunks.push_back(new char[size]);
+		chunkBytes += size;
+		chunkUsed = 0;
+	}
+
+	PostRecord record;
+	record.timeNanos = timeNanos;
+	record.author = author;
+	record.chunk = (uint32_t)chunks.size() - 1;
+	record.offset = chunkUsed;
+	record.length = length;
+	record.pushed = pushed;
+
+	memcpy(chunks[record.chunk] + chunkUsed, content.data(), length);
+	chunkUsed += length;
+
+	// Publishing the record makes the copied content visible to readers
+	return records.push_back(record);
+}
+
+string_view PostStore::content(PostId id) const
+{
+	const PostRecord &record = records[id];
+	return string_view(chunks[record.chunk] + record.offset, record.length);
+}
+
+Timestamp PostStore::timestamp(PostId id) const
+{
+	return fromNanos(records[id].timeNanos);
+}
+
+size_t PostStore::memoryUsed()
+{
+	lock_guard<mutex> lock(mtx);
+	return (size_t)records.size() * sizeof(PostRecord) + chunkBytes;
+}
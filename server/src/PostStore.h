@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include <google/protobuf/timestamp.pb.h>
+
+#include "AppendOnlyVector.h"
+#include "UserRegistry.h"
+
+// Index of a post in the PostStore, assigned in arrival order
+typedef int PostId;
+
+// Fixed-size metadata of one post. Content lives in the store's arena.
+struct PostRecord {
+	int64_t timeNanos;
+	UserId author;
+	uint32_t chunk;
+	uint32_t offset;
+	uint32_t length : 31;
+
+	// False if the post went to the author's pulled_posts instead of inboxes
+	uint32_t pushed : 1;
+};
+static_assert(sizeof(PostRecord) == 24, "PostRecord should stay compact");
+
+/*
+	Append-only store of all posts.
+
+	Records are 24 bytes and sit contiguously in segments, so scans
+	walk flat memory instead of chasing one heap object per post.
+	Content is copied into large arena chunks and referenced by
+	(chunk, offset, length), so a post costs no allocation of its own.
+
+	Like AppendOnlyVector, appends are serialized and any post below
+	size() can be read from any thread without locking. Records and
+	content are never moved or modified once appended.
+*/
+class PostStore {
+
+public:
+	PostStore() {};
+	virtual ~PostStore();
+
+	PostId append(UserId author, int64_t timeNanos, std::string_view content, bool pushed);
+
+	const PostRecord& operator[](PostId id) const { return records[id]; }
+	std::string_view content(PostId id) const;
+	google::protobuf::Timestamp timestamp(PostId id) const;
+
+	int size() const { return records.size(); }
+
+	// Bytes held by records and content chunks
+	size_t memoryUsed();
+
+	static int64_t toNanos(const google::protobuf::Timestamp &t) {
+		return t.seconds() * 1000000000LL + t.nanos();
+	}
+
+	static google::protobuf::Timestamp fromNanos(int64_t timeNanos) {
+		google::protobuf::Timestamp t;
+		t.set_seconds(timeNanos / 1000000000LL);
+		t.set_nanos(timeNanos % 1000000000LL);
+		return t;
+	}
+
+private:
+	static constexpr uint32_t CHUNK_SIZE = 1 << 20;
+
+	AppendOnlyVector<PostRecord> records;
+	AppendOnlyVector<char*> chunks;
+
+	// Guarded by mtx
+	std::mutex mtx;
+	uint32_t chunkUsed = 0;
+	size_t chunkBytes = 0;
+};
@@ -0,0 +1,260 @@
+#include <cstring>
+#include <random>
+#include <unistd.h>
+
+#include "FSWrapper/FSLocal.h"
+#include "LogFormat.h"
+#include "ReplicaJournal.h"
+
+using SNS::Operation;
+using SNS::Request;
+
+using namespace std;
+
+static const char MAGIC[4] = {'S', 'N', 'S', 'Q'};
+static const uint16_t VERSION = 1;
+static const size_t HEADER_SIZE = 8;
+
+enum EntryKind {
+	ENTRY_QUEUE = 1,
+	ENTRY_OP = 2,
+	ENTRY_ACK = 3
+};
+
+// ---- ENCODING ----
+
+static void putU8(string &out, uint8_t v)
+{
+	out.push_back((char)v);
+}
+
+static void putU32(string &out, uint32_t v)
+{
+	for(int i = 0; i < 4; i++) {
+		out.push_back((char)(v >> (8 * i)));
+	}
+}
+
+static void putU64(string &out, uint64_t v)
+{
+	for(int i = 0; i < 8; i++) {
+		out.push_back((char)(v >> (8 * i)));
+	}
+}
+
+static uint32_t getU32(const char *p)
+{
+	const uint8_t *b = (const uint8_t*)p;
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static uint64_t getU64(const char *p)
+{
+	return (uint64_t)getU32(p) | ((uint64_t)getU32(p + 4) << 32);
+}
+
+// Appends payload to out with its length and checksum in front
+static void frame(string &out, const string &payload)
+{
+	putU32(out, (uint32_t)payload.size());
+	putU32(out, LogFormat::crc32(payload.data(), payload.size()));
+	out += payload;
+}
+
+static string encodeAck(uint64_t seq)
+{
+	string payload;
+	putU8(payload, ENTRY_ACK);
+	putU64(payload, seq);
+
+	string out;
+	frame(out, payload);
+	return out;
+}
+
+static string encodeOp(const ReplicaJournal::Entry &entry, const string &request)
+{
+	string payload;
+	putU8(payload, ENTRY_OP);
+	putU64(payload, entry.seq);
+	putU64(payload, (uint64_t)entry.queuedNanos);
+	putU8(payload, (uint8_t)entry.type);
+	payload += request;
+
+	string out;
+	frame(out, payload);
+	return out;
+}
+
+// ---- JOURNAL ----
+
+ReplicaJournal::ReplicaJournal(const string &path, WriteAheadLog::Durability durability, int syncIntervalMs)
+	: path(path), durability(durability), syncIntervalMs(syncIntervalMs)
+{
+
+}
+
+ReplicaJournal::~ReplicaJournal()
+{
+	if(wal != NULL && ackWritten < acked) {
+		wal->append(encodeAck(acked));
+	}
+}
+
+string ReplicaJournal::prefix()
+{
+	string out(MAGIC, sizeof(MAGIC));
+	putU8(out, VERSION & 0xff);
+	putU8(out, VERSION >> 8);
+	putU8(out, 0);
+	putU8(out, 0);
+
+	string queue;
+	putU8(queue, ENTRY_QUEUE);
+	putU64(queue, queueId);
+	queue += queueGroup;
+	frame(out, queue);
+
+	// Keeps the last seq once the OPs it acked are dropped
+	out += encodeAck(acked);
+	return out;
+}
+
+int ReplicaJournal::open(const string &group, vector<Entry> &pending)
+{
+	FSLocal local("");
+	shared_ptr<FileView> view;
+	string_view data;
+	if(local.readView(path, view) == 0) {
+		data = view->data();
+	}
+
+	size_t size = 0;
+	if(!data.empty()) {
+		if(data.size() < HEADER_SIZE || memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0 ||
+			((uint8_t)data[4] | ((uint8_t)data[5] << 8)) != VERSION) {
+			return -1;
+		}
+
+		vector<Entry> ops;
+		size_t pos = HEADER_SIZE;
+		while(data.size() - pos >= 8) {
+			uint32_t length = getU32(data.data() + pos);
+			const char *p = data.data() + pos + 8;
+			if(length < 9 || data.size() - pos - 8 < length || LogFormat::crc32(p, length) != getU32(data.data() + pos + 4)) {
+				break;
+			}
+			pos += 8 + length;
+
+			uint64_t seq = getU64(p + 1);
+			if(p[0] == ENTRY_QUEUE) {
+				queueId = seq;
+				queueGroup = string(p + 9, length - 9);
+			} else if(p[0] == ENTRY_OP && length >= 18) {
+				shared_ptr<Request> request = make_shared<Request>();
+				if(!request->ParseFromArray(p + 18, length - 18)) {
+					break;
+				}
+				ops.push_back({seq, (int64_t)getU64(p + 9), (Operation::Type)(uint8_t)p[17], request});
+				last = max(last, seq);
+			} else if(p[0] == ENTRY_ACK) {
+				acked = max(acked, seq);
+			}
+		}
+		if(queueId == 0) {
+			return -1;
+		}
+		ackWritten = acked;
+		size = data.size();
+
+		for(Entry &op : ops) {
+			if(op.seq > acked) {
+				pending.push_back(op);
+			}
+		}
+	} else {
+		queueId = newQueueId();
+		queueGroup = group;
+	}
+	last = max(last, acked);
+
+	// What is pending is written again behind a fresh prefix
+	string fresh = prefix();
+	ackedEnd = fresh.size();
+	for(const Entry &entry : pending) {
+		fresh += encodeOp(entry, entry.request->SerializeAsString());
+		unacked.push_back({entry.seq, fresh.size()});
+	}
+	end = fresh.size();
+	view.reset();
+
+	wal = make_unique<WriteAheadLog>(path, durability, syncIntervalMs);
+	if(size == 0) {
+		return wal->open(fresh);
+	}
+	if(wal->open() == -1) {
+		return -1;
+	}
+	return wal->replacePrefix(size, fresh);
+}
+
+void ReplicaJournal::append(const Entry &entry, const string &request)
+{
+	string record = encodeOp(entry, request);
+	wal->append(record);
+	end += record.size();
+	unacked.push_back({entry.seq, end});
+	last = max(last, entry.seq);
+}
+
+void ReplicaJournal::ack(uint64_t seq)
+{
+	if(seq <= acked) {
+		return;
+	}
+	acked = seq;
+	while(!unacked.empty() && unacked.front().first <= seq) {
+		ackedEnd = unacked.front().second;
+		unacked.pop_front();
+	}
+}
+
+int ReplicaJournal::compact(uint64_t minBytes)
+{
+	uint64_t ackedBytes = ackedEnd - dropped;
+	if(ackedBytes >= minBytes && ackedBytes >= end - ackedEnd) {
+		// The prefix acks everything acked so far
+		string fresh = prefix();
+		if(wal->replacePrefix(ackedBytes, fresh) == -1) {
+			return -1;
+		}
+		dropped += ackedBytes - fresh.size();
+		ackWritten = acked;
+		return 0;
+	}
+
+	if(ackWritten < acked) {
+		string record = encodeAck(acked);
+		wal->append(record);
+		end += record.size();
+		ackWritten = acked;
+	}
+	return 0;
+}
+
+uint64_t ReplicaJournal::newQueueId()
+{
+	random_device device;
+	mt19937_64 random(((uint64_t)device() << 32) ^ device());
+	uint64_t id = 0;
+	while(id == 0) {
+		id = random();
+	}
+	return id;
+}
+
+void ReplicaJournal::remove()
+{
+	wal.reset();
+	unlink(path.c_str());
+}
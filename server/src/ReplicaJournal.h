@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <snsproto/sns.grpc.pb.h>
+
+#include "WriteAheadLog.h"
+
+/*
+	File behind the queue of operations a master has sent one replica
+	without an ack yet, so the queue outlives the master.
+
+	The file starts with an 8 byte header: the magic "SNSQ", a uint16
+	version and a uint16 reserved for flags. Records follow, framed as
+	in LogFormat (uint32 length, uint32 CRC-32, payload), each payload
+	starting with a uint8 kind:
+
+		QUEUE  uint64 queue id, group name
+		OP     uint64 seq, int64 time queued, uint8 operation type, Request
+		ACK    uint64 seq
+
+	The QUEUE record comes first. Its id is drawn at random when the
+	file is created, so a replica can tell the queue apart from one that
+	came before it and reused its sequence numbers. An ACK acknowledges
+	every OP up to its seq. Times are nanoseconds since the epoch.
+
+	Records go through a WriteAheadLog and are never waited for. Acks
+	are only written by compact() and on close, so a restart may resend
+	operations that were acked last; replicas skip those. It is not
+	thread-safe; the Replicator calls it under the replica's lock.
+*/
+class ReplicaJournal {
+
+public:
+	struct Entry {
+		uint64_t seq;
+		int64_t queuedNanos;
+		SNS::Operation::Type type;
+		std::shared_ptr<const SNS::Request> request;
+	};
+
+	ReplicaJournal(const std::string &path, WriteAheadLog::Durability durability, int syncIntervalMs);
+	virtual ~ReplicaJournal();
+
+	/*
+		Opens the file, creating it for group if it doesn't exist, and
+		fills pending with the operations in it that were never acked, in
+		order. A torn record ends the file. The file is then rewritten
+		with only those. Returns -1 if it can't be read or written.
+	*/
+	int open(const std::string &group, std::vector<Entry> &pending);
+
+	uint64_t id() const { return queueId; }
+
+	// The group the file was created for
+	const std::string& group() const { return queueGroup; }
+
+	// Highest seq the file has held, acked or not
+	uint64_t lastSeq() const { return last; }
+
+	// request is entry.request serialized
+	void append(const Entry &entry, const std::string &request);
+	void ack(uint64_t seq);
+
+	// Writes the last ack. Once the acked records are at least minBytes
+	// and more than the rest, they are dropped from the file instead.
+	// Returns -1 if the file could not be replaced.
+	int compact(uint64_t minBytes);
+
+	// Closes the file and deletes it
+	void remove();
+
+	// A random queue id, never 0
+	static uint64_t newQueueId();
+
+private:
+	std::string path;
+	WriteAheadLog::Durability durability;
+	int syncIntervalMs;
+	std::unique_ptr<WriteAheadLog> wal;
+
+	uint64_t queueId = 0;
+	std::string queueGroup;
+	uint64_t last = 0;
+	uint64_t acked = 0;
+	uint64_t ackWritten = 0;
+
+	// Offsets count every byte the file has held, so compaction doesn't
+	// move them. The file holds those from dropped on.
+	uint64_t dropped = 0;
+	uint64_t end = 0;
+	uint64_t ackedEnd = 0;	// after the last OP acked
+	std::deque<std::pair<uint64_t, uint64_t>> unacked;	// seq and offset after each OP
+
+	// Header, QUEUE and an ACK of everything acked so far
+	std::string prefix();
+};
@@ -0,0 +1,699 @@
+#include <algorithm>
+#include <filesystem>
+#include <set>
+
+#include "Replicator.h"
+
+#include <glog/logging.h>
+#define log(severity, msg); LOG(severity) << msg << "\n---"; google::FlushLogFiles(google::severity);
+
+using grpc::ClientBidiReactor;
+using grpc::ClientContext;
+using grpc::Status;
+using grpc::StatusCode;
+
+using SNS::Operation;
+using SNS::ReplicationAck;
+using SNS::ReplicationBatch;
+using SNS::Request;
+using SNS::SNSService;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+static int64_t nanosNow()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// ---- ACK ----
+
+bool Replicator::Ack::wait()
+{
+	unique_lock<mutex> lock(mtx);
+	cv.wait(lock, [this] { return numAcked >= needed || numAcked + numFailed == total; });
+	return numAcked >= needed;
+}
+
+int Replicator::Ack::acked()
+{
+	lock_guard<mutex> lock(mtx);
+	return numAcked;
+}
+
+int Replicator::Ack::failed()
+{
+	lock_guard<mutex> lock(mtx);
+	return numFailed;
+}
+
+void Replicator::Ack::whenDone(function<void(bool)> callback)
+{
+	unique_lock<mutex> lock(mtx);
+	if(numAcked >= needed || numAcked + numFailed == total) {
+		bool ok = numAcked >= needed;
+		lock.unlock();
+		callback(ok);
+		return;
+	}
+	this->callback = std::move(callback);
+}
+
+void Replicator::Ack::done(bool ok)
+{
+	function<void(bool)> settled;
+	bool enough;
+	{
+		lock_guard<mutex> lock(mtx);
+		if(ok) {
+			numAcked++;
+		} else {
+			numFailed++;
+		}
+		enough = numAcked >= needed;
+		if(callback && (enough || numAcked + numFailed == total)) {
+			settled.swap(callback);
+		}
+	}
+	cv.notify_all();
+	if(settled) {
+		settled(enough);
+	}
+}
+
+// ---- STREAM ----
+
+/*
+	One Replicate call to a replica. A read is always outstanding and at
+	most one batch is being written. The Replica's state decides what to
+	write; the stream only forwards completions. It deletes itself in OnDone.
+
+	gRPC calls OnDone once every operation started on the stream has
+	completed, so no write may start after the read that ends the stream
+	failed. Since a read is always outstanding, that read fails before
+	OnDone on every stream.
+*/
+class Replicator::Stream : public ClientBidiReactor<ReplicationBatch, ReplicationAck> {
+
+public:
+	ClientContext context;
+	ReplicationBatch batch;
+	bool readsDone = false;		// guarded by the Replica's mtx
+
+	Stream(Replicator *replicator, Replica *replica, shared_ptr<SNSService::Stub> stub)
+		: replicator(replicator), replica(replica), stub(stub)
+	{
+		stub->async()->Replicate(&context, this);
+		StartRead(&ack);
+		StartCall();
+	}
+
+	void OnWriteDone(bool ok) override {
+		replicator->onWriteDone(replica, this, ok);
+	}
+
+	void OnReadDone(bool ok) override {
+		if(!ok) {
+			// OnDone follows with the status
+			replicator->onReadsDone(replica, this);
+			return;
+		}
+		replicator->onAck(replica, this, ack);
+		StartRead(&ack);
+	}
+
+	void OnDone(const Status &status) override {
+		Replicator *r = replicator;
+		r->onStreamDone(replica, this, status);
+		delete this;
+		r->callbackDone();
+	}
+
+private:
+	Replicator *replicator;
+	Replica *replica;
+	shared_ptr<SNSService::Stub> stub;
+	ReplicationAck ack;
+};
+
+// ---- REPLICATOR ----
+
+bool Replicator::parseAckPolicy(const string &name, AckPolicy &policy)
+{
+	if(name == "none") {
+		policy = ACK_NONE;
+	} else if(name == "quorum") {
+		policy = ACK_QUORUM;
+	} else if(name == "all") {
+		policy = ACK_ALL;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Closes every stream, fails queued operations and waits for all callbacks
+Replicator::~Replicator()
+{
+	stopping = true;
+	{
+		lock_guard<mutex> lock(replicasMtx);
+		for(auto &entry : replicas) {
+			Replica *r = entry.second.get();
+			lock_guard<mutex> replicaLock(r->mtx);
+			if(r->stream != NULL) {
+				r->stream->context.TryCancel();
+			}
+			if(r->flushArmed) {
+				r->flushAlarm->Cancel();
+			}
+			if(r->reconnectArmed) {
+				r->reconnectAlarm->Cancel();
+			}
+			if(r->stallArmed) {
+				r->stallAlarm->Cancel();
+			}
+		}
+	}
+
+	unique_lock<mutex> lock(callbacksMtx);
+	callbacksCv.wait(lock, [this] { return pendingCallbacks == 0; });
+}
+
+void Replicator::addCallback()
+{
+	lock_guard<mutex> lock(callbacksMtx);
+	pendingCallbacks++;
+}
+
+void Replicator::callbackDone()
+{
+	lock_guard<mutex> lock(callbacksMtx);
+	pendingCallbacks--;
+	callbacksCv.notify_all();
+}
+
+Replicator::Replica* Replicator::getReplica(const string &addr)
+{
+	lock_guard<mutex> lock(replicasMtx);
+	unique_ptr<Replica> &replica = replicas[addr];
+	if(replica == NULL) {
+		replica = make_unique<Replica>();
+		replica->addr = addr;
+	}
+	return replica.get();
+}
+
+/*
+	Gives a replica that has no queue its own: the one in its journal if
+	it has one, with the operations left in it, or else a new one.
+*/
+void Replicator::openQueue(Replica *r)
+{
+	r->nextSeq = 1;
+	if(journalDir != "") {
+		r->journal = make_unique<ReplicaJournal>(journalDir + r->addr, journalDurability, JOURNAL_SYNC_INTERVAL_MS);
+
+		vector<ReplicaJournal::Entry> pending;
+		if(r->journal->open(r->group, pending) == 0) {
+			r->queueId = r->journal->id();
+			r->nextSeq = r->journal->lastSeq() + 1;
+			if(r->group == "") {
+				r->group = r->journal->group();
+			}
+
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			for(ReplicaJournal::Entry &entry : pending) {
+				PendingOp op;
+				op.type = entry.type;
+				op.seq = entry.seq;
+				op.request = entry.request;
+				op.bytes = entry.request->ByteSizeLong();
+				op.queuedNanos = entry.queuedNanos;
+				op.queued = now;
+				r->ops.push_back(op);
+			}
+			return;
+		}
+
+		log(ERROR, "Could not open the replication journal for " + r->addr + ", its queue is only kept in memory");
+		r->journal.reset();
+	}
+	r->queueId = ReplicaJournal::newQueueId();
+}
+
+size_t Replicator::recover()
+{
+	size_t recovered = 0;
+	error_code ec;
+	for(const fs::directory_entry &entry : fs::directory_iterator(journalDir, ec)) {
+		string addr = entry.path().filename().string();
+
+		// Left by a compaction that was cut short
+		if(addr.size() > 8 && addr.substr(addr.size() - 8) == ".compact") {
+			fs::remove(entry.path(), ec);
+			continue;
+		}
+
+		Replica *r = getReplica(addr);
+		lock_guard<mutex> lock(r->mtx);
+		if(r->queueId == 0) {
+			openQueue(r);
+		}
+		recovered += r->ops.size();
+		if(!r->ops.empty() && r->stream == NULL && !r->reconnectArmed) {
+			connect(r);
+		}
+	}
+	return recovered;
+}
+
+void Replicator::clearJournals()
+{
+	error_code ec;
+	for(const fs::directory_entry &entry : fs::directory_iterator(journalDir, ec)) {
+		fs::remove(entry.path(), ec);
+	}
+}
+
+shared_ptr<Replicator::Ack> Replicator::send(Operation::Type type, const Request &request,
+											const string &group, const vector<string> &addrs, int needed)
+{
+	needed = min(needed, (int)addrs.size());
+	shared_ptr<Ack> ack = make_shared<Ack>((int)addrs.size(), needed);
+	shared_ptr<const Request> shared = make_shared<const Request>(request);
+	size_t bytes = request.ByteSizeLong();
+	int64_t queuedNanos = nanosNow();
+
+	// Serialized once for every journal
+	string serialized;
+	if(journalDir != "") {
+		serialized = request.SerializeAsString();
+	}
+
+	for(const string &addr : addrs) {
+		Replica *r = getReplica(addr);
+
+		lock_guard<mutex> lock(r->mtx);
+		if(stopping) {
+			ack->done(false);
+			continue;
+		}
+		r->group = group;
+		r->retired = false;
+		if(r->queueId == 0) {
+			openQueue(r);
+		}
+
+		PendingOp op;
+		op.type = type;
+		op.seq = r->nextSeq++;
+		op.request = shared;
+		op.ack = ack;
+		op.bytes = bytes;
+		op.queuedNanos = queuedNanos;
+		op.queued = chrono::steady_clock::now();
+		r->ops.push_back(op);
+
+		if(r->journal != NULL) {
+			r->journal->append({op.seq, op.queuedNanos, type, shared}, serialized);
+		}
+
+		if(r->stream == NULL && !r->reconnectArmed) {
+			connect(r);
+		} else {
+			maybeFlush(r);
+		}
+	}
+	return ack;
+}
+
+void Replicator::connect(Replica *r)
+{
+	bool created;
+	shared_ptr<SNSService::Stub> stub = pool.get(r->addr, r->group, created);
+
+	addCallback();
+	r->stream = new Stream(this, r, stub);
+	r->writing = false;
+	r->numSent = 0;
+
+	log(INFO, "Opened replication stream to " + r->addr + " with " + to_string(r->ops.size()) + " operations queued");
+	maybeFlush(r);
+}
+
+void Replicator::maybeFlush(Replica *r)
+{
+	if(r->stream == NULL || r->stream->readsDone || r->writing || r->numSent == r->ops.size()) {
+		return;
+	}
+
+	size_t unsentOps = r->ops.size() - r->numSent;
+	size_t unsentBytes = 0;
+	for(size_t i = r->numSent; i < r->ops.size() && unsentBytes < (size_t)maxBatchBytes; i++) {
+		unsentBytes += r->ops[i].bytes;
+	}
+
+	// An idle stream sends at once. The window only applies while earlier
+	// batches are unacknowledged, which is when more operations are likely.
+	chrono::microseconds delay(batchDelayUs);
+	chrono::steady_clock::time_point due = r->ops[r->numSent].queued + delay;
+	bool idle = r->numSent == 0;
+	if(idle || unsentOps >= (size_t)maxBatchOps || unsentBytes >= (size_t)maxBatchBytes || due <= chrono::steady_clock::now()) {
+		flush(r);
+		return;
+	}
+
+	if(!r->flushArmed) {
+		r->flushArmed = true;
+		addCallback();
+		r->flushAlarm = make_unique<grpc::Alarm>();
+		r->flushAlarm->Set(chrono::system_clock::now() + delay, [this, r](bool ok) {
+			{
+				lock_guard<mutex> lock(r->mtx);
+				r->flushArmed = false;
+				if(ok) {
+					maybeFlush(r);
+				}
+			}
+			callbackDone();
+		});
+	}
+}
+
+void Replicator::flush(Replica *r)
+{
+	Stream *s = r->stream;
+	s->batch.Clear();
+	s->batch.set_queue(r->queueId);
+	s->batch.set_term(currentTerm);
+	s->batch.set_term_start(termStart);
+
+	size_t bytes = 0;
+	size_t first = r->numSent;
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	while(r->numSent < r->ops.size() && s->batch.operations_size() < maxBatchOps && bytes < (size_t)maxBatchBytes) {
+		PendingOp &op = r->ops[r->numSent++];
+		op.sent = now;
+		bytes += op.bytes;
+
+		Operation *operation = s->batch.add_operations();
+		operation->set_type(op.type);
+		operation->set_seq(op.seq);
+		*operation->mutable_request() = *op.request;
+	}
+	for(size_t i = first; i < r->numSent; i++) {
+		r->ops[i].batchEnd = r->ops[r->numSent - 1].seq;
+	}
+
+	numBatches++;
+	r->writing = true;
+	s->StartWrite(&s->batch);
+
+	if(!r->stallArmed) {
+		armStallCheck(r, r->ops.front().sent + chrono::milliseconds(ackTimeoutMs));
+	}
+}
+
+void Replicator::onWriteDone(Replica *r, Stream *s, bool ok)
+{
+	lock_guard<mutex> lock(r->mtx);
+	if(r->stream != s) {
+		return;
+	}
+
+	r->writing = false;
+	if(ok) {
+		maybeFlush(r);
+	}
+}
+
+// No more writes are started on s, which is ending
+void Replicator::onReadsDone(Replica *r, Stream *s)
+{
+	lock_guard<mutex> lock(r->mtx);
+	s->readsDone = true;
+}
+
+void Replicator::onAck(Replica *r, Stream *s, const ReplicationAck &ack)
+{
+	lock_guard<mutex> lock(r->mtx);
+	if(r->stream != s) {
+		return;
+	}
+
+	set<uint64_t> held(ack.held().begin(), ack.held().end());
+	uint64_t seq = ack.seq();
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	while(!r->ops.empty() && r->ops.front().seq <= seq && r->numSent > 0) {
+		PendingOp &op = r->ops.front();
+		numOps++;
+		totalMicros += chrono::duration_cast<chrono::microseconds>(now - op.queued).count();
+		if(op.ack != NULL) {
+			if(held.count(op.batchEnd) > 0) {
+				r->held[op.batchEnd].push_back(op.ack);
+			} else {
+				op.ack->done(true);
+			}
+		}
+
+		r->ops.pop_front();
+		r->numSent--;
+	}
+	if(r->journal != NULL) {
+		r->journal->ack(seq);
+	}
+	r->failures = 0;
+
+	for(uint64_t batch : ack.released()) {
+		auto it = r->held.find(batch);
+		if(it == r->held.end()) {
+			continue;
+		}
+		for(shared_ptr<Ack> &waiter : it->second) {
+			waiter->done(true);
+		}
+		r->held.erase(it);
+	}
+}
+
+/*
+	Tells whoever waits on operations in held batches that they failed.
+	The replica still has them, but its stream is gone and with it any
+	word of when it passed them on. Called with r->mtx held.
+*/
+void Replicator::failHeld(Replica *r)
+{
+	for(auto &entry : r->held) {
+		for(shared_ptr<Ack> &waiter : entry.second) {
+			waiter->done(false);
+			numFailed++;
+		}
+	}
+	r->held.clear();
+}
+
+/*
+	Tells whoever waits on the queued operations that they failed, and
+	empties the queue. A replica that left its group loses its journal
+	too; if it comes back it catches up from a snapshot. On shutdown the
+	journal keeps the operations for the next run. Called with r->mtx held.
+*/
+void Replicator::failAll(Replica *r)
+{
+	for(PendingOp &op : r->ops) {
+		if(op.ack != NULL) {
+			op.ack->done(false);
+			numFailed++;
+		}
+	}
+	r->ops.clear();
+	r->numSent = 0;
+	failHeld(r);
+
+	if(r->retired) {
+		if(r->journal != NULL) {
+			r->journal->remove();
+			r->journal.reset();
+		}
+		r->queueId = 0;
+	}
+}
+
+void Replicator::onStreamDone(Replica *r, Stream *s, const Status &status)
+{
+	lock_guard<mutex> lock(r->mtx);
+	if(r->stream != s) {
+		return;
+	}
+	r->stream = NULL;
+	r->writing = false;
+	r->numSent = 0;
+
+	if(stopping || r->retired) {
+		failAll(r);
+		return;
+	}
+	failHeld(r);
+
+	// The replica is unreachable, reconnect on a new channel
+	if(status.error_code() == StatusCode::UNAVAILABLE) {
+		pool.evict(r->addr);
+	}
+
+	// Every queued operation used up an attempt, whether it was sent or not.
+	// Past maxAttempts its waiters are let go, but it is still resent.
+	size_t released = 0;
+	for(PendingOp &op : r->ops) {
+		if(++op.attempts >= maxAttempts && op.ack != NULL) {
+			op.ack->done(false);
+			op.ack.reset();
+			released++;
+		}
+	}
+	numFailed += released;
+
+	string message = "Replication stream to " + r->addr + " closed: " + status.error_message() + ".";
+	if(released > 0) {
+		message += " Stopped waiting for " + to_string(released) + " operations, which stay queued.";
+	}
+
+	if(r->ops.empty()) {
+		log(WARNING, message);
+		return;
+	}
+
+	r->failures++;
+	int delay = min(baseBackoffMs << min(r->failures - 1, 16), MAX_BACKOFF_MS);
+	numReconnects++;
+	log(WARNING, message + " Reconnecting in " + to_string(delay) + "ms with " + to_string(r->ops.size()) + " operations queued");
+
+	r->reconnectArmed = true;
+	addCallback();
+	r->reconnectAlarm = make_unique<grpc::Alarm>();
+	r->reconnectAlarm->Set(chrono::system_clock::now() + chrono::milliseconds(delay), [this, r](bool ok) {
+		{
+			lock_guard<mutex> lock(r->mtx);
+			r->reconnectArmed = false;
+			if(ok && !stopping && r->stream == NULL && !r->ops.empty()) {
+				connect(r);
+			}
+		}
+		callbackDone();
+	});
+}
+
+void Replicator::retain(const string &group, const vector<string> &addrs)
+{
+	pool.retain(group, addrs);
+
+	set<string> live(addrs.begin(), addrs.end());
+	lock_guard<mutex> lock(replicasMtx);
+	for(auto &entry : replicas) {
+		Replica *r = entry.second.get();
+
+		lock_guard<mutex> replicaLock(r->mtx);
+		if(r->group != group || r->retired || live.count(r->addr) > 0) {
+			continue;
+		}
+
+		r->retired = true;
+		if(r->stream != NULL) {
+			r->stream->context.TryCancel();
+		} else {
+			failAll(r);
+		}
+	}
+}
+
+/*
+	Checks the replica's stream again at due, which is when its oldest
+	unacknowledged operation will have waited ackTimeoutMs. Called with
+	r->mtx held.
+*/
+void Replicator::armStallCheck(Replica *r, chrono::steady_clock::time_point due)
+{
+	r->stallArmed = true;
+	addCallback();
+	r->stallAlarm = make_unique<grpc::Alarm>();
+	r->stallAlarm->Set(chrono::system_clock::now() + (due - chrono::steady_clock::now()), [this, r](bool ok) {
+		{
+			lock_guard<mutex> lock(r->mtx);
+			r->stallArmed = false;
+			if(ok && !stopping) {
+				checkStalled(r);
+			}
+		}
+		callbackDone();
+	});
+}
+
+// Cancels the stream if it has gone ackTimeoutMs without acking, so it
+// reconnects, or else waits for the operation now oldest. Called with r->mtx held.
+void Replicator::checkStalled(Replica *r)
+{
+	if(r->stream == NULL || r->numSent == 0) {
+		// The next flush checks again
+		return;
+	}
+
+	chrono::steady_clock::time_point sent = r->ops.front().sent;
+	long waited = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - sent).count();
+	if(waited >= ackTimeoutMs) {
+		log(WARNING, "No ack from " + r->addr + " in " + to_string(waited) + "ms, restarting its replication stream");
+		r->stream->context.TryCancel();
+		return;
+	}
+	armStallCheck(r, sent + chrono::milliseconds(ackTimeoutMs));
+}
+
+void Replicator::compactJournals()
+{
+	lock_guard<mutex> lock(replicasMtx);
+	for(auto &entry : replicas) {
+		Replica *r = entry.second.get();
+
+		lock_guard<mutex> replicaLock(r->mtx);
+		if(r->journal != NULL && r->journal->compact(JOURNAL_COMPACT_BYTES) == -1) {
+			log(WARNING, "Failed to compact the replication journal for " + r->addr);
+		}
+	}
+}
+
+vector<Replicator::Lag> Replicator::lag()
+{
+	int64_t now = nanosNow();
+	vector<Lag> lags;
+
+	lock_guard<mutex> lock(replicasMtx);
+	for(auto &entry : replicas) {
+		Replica *r = entry.second.get();
+
+		lock_guard<mutex> replicaLock(r->mtx);
+		if(r->retired || r->queueId == 0) {
+			continue;
+		}
+		double seconds = r->ops.empty() ? 0 : max<int64_t>(0, now - r->ops.front().queuedNanos) / 1e9;
+		lags.push_back({r->addr, r->ops.size(), seconds});
+	}
+	return lags;
+}
+
+string Replicator::stats()
+{
+	long ops = numOps.exchange(0);
+	long batches = numBatches.exchange(0);
+	long micros = totalMicros.exchange(0);
+	long reconnects = numReconnects.exchange(0);
+	long failed = numFailed.exchange(0);
+	if(ops == 0 && batches == 0 && reconnects == 0 && failed == 0) {
+		return "";
+	}
+
+	long average = ops > 0 ? micros / ops : 0;
+	string opsPerBatch = batches > 0 ? to_string(ops / (double)batches).substr(0, 4) : "0";
+	return to_string(ops) + " operations acked in " + to_string(batches) + " batches "
+			"(" + opsPerBatch + " per batch), average ack latency " + to_string(average) + "us, " +
+			to_string(reconnects) + " reconnects, " + to_string(failed) + " failed";
+}
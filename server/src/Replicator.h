@@ -0,0 +1,254 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+#include <grpcpp/alarm.h>
+#include <snsproto/sns.grpc.pb.h>
+
+#include "ChannelPool.h"
+#include "ReplicaJournal.h"
+#include "WriteAheadLog.h"
+
+/*
+	Sends replicated operations to other servers without blocking the caller.
+
+	Each replica gets one long-lived Replicate stream. Operations queued for
+	a replica close together are coalesced into one ReplicationBatch. On an
+	idle stream an operation is written at once. While earlier batches are
+	unacknowledged, a batch is written once it holds maxBatchOps operations
+	or maxBatchBytes bytes, or batchDelayUs after its oldest operation was
+	queued. Only one batch is written at a time, and operations queued
+	meanwhile form the next one. Batches do not wait for the acks of earlier ones. The replica
+	acks the sequence number of the last operation it applied, which
+	acknowledges everything before it. A master that forwards a batch
+	acks it at once but holds it until its own replicas have it, and
+	waiters are told once it is released.
+
+	A stream that fails is reopened with exponential backoff and every
+	unacknowledged operation is resent in order. Operations stay queued
+	until the replica acks them or leaves its group. Once maxAttempts
+	streams failed while an operation was queued, whoever waits on it is
+	told it failed, but it is still resent.
+
+	Each replica's queue has a random id, sent with every batch, and its
+	operations are numbered in order. A replica applies each (queue, seq)
+	once however often it is resent. With a journal directory, each queue
+	is also kept in a ReplicaJournal there, so a master that restarts
+	resumes sending where it left off, under the same queue id.
+*/
+class Replicator {
+
+public:
+	enum AckPolicy {
+		ACK_NONE,	// reply without waiting for replicas
+		ACK_QUORUM,	// wait until a majority of the local cluster has the request
+		ACK_ALL		// wait for every replica, including other cluster masters
+	};
+
+	// How far behind one replica is
+	struct Lag {
+		std::string addr;
+		size_t ops;			// queued and not acked
+		double seconds;		// since the oldest of them was queued
+	};
+
+	// Outcome of one operation sent to a set of replicas
+	class Ack {
+
+	public:
+		Ack(int total, int needed) : total(total), needed(needed) {};
+
+		// Blocks until enough replicas acked or every replica finished.
+		// Returns true if enough replicas acked.
+		bool wait();
+
+		// Calls callback with what wait() returns once it would return,
+		// at once if it would now. It may run on a replication thread, and
+		// must not block. At most one callback per Ack.
+		void whenDone(std::function<void(bool)> callback);
+
+		int acked();
+		int failed();
+		int size() const { return total; }
+
+	private:
+		friend class Replicator;
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		int total;
+		int needed;
+		int numAcked = 0;
+		int numFailed = 0;
+		std::function<void(bool)> callback;
+
+		void done(bool ok);
+	};
+
+	Replicator(ChannelPool &pool) : pool(pool) {};
+	virtual ~Replicator();
+
+	void setBatching(int delayUs, int maxOps, int maxBytes) {
+		batchDelayUs = delayUs;
+		maxBatchOps = maxOps;
+		maxBatchBytes = maxBytes;
+	}
+
+	// Streams per operation, how long a replica may take to ack, and first reconnect delay
+	void setRetries(int attempts, int timeoutMs, int backoffMs) {
+		maxAttempts = attempts;
+		ackTimeoutMs = timeoutMs;
+		baseBackoffMs = backoffMs;
+	}
+
+	// Keeps each replica's queue in a file in dir, which must exist. Set
+	// before anything is sent.
+	void setJournal(const std::string &dir, WriteAheadLog::Durability durability) {
+		journalDir = dir;
+		journalDurability = durability;
+	}
+
+	// Stamped on every batch from now on (see ReplicationBatch)
+	void setTerm(uint64_t term, uint64_t start) {
+		termStart = start;
+		currentTerm = term;
+	}
+
+	// Reopens the journals left in the journal directory and resends the
+	// operations they hold. Returns how many there were.
+	size_t recover();
+
+	// Deletes the journals left in the journal directory
+	void clearJournals();
+
+	// Queues request for every address in addrs. The returned Ack is
+	// satisfied once needed of them have acknowledged it.
+	std::shared_ptr<Ack> send(SNS::Operation::Type type, const SNS::Request &request,
+							const std::string &group, const std::vector<std::string> &addrs, int needed);
+
+	// addrs is the complete current membership of group. Streams to
+	// servers that left it are closed and their operations failed.
+	void retain(const std::string &group, const std::vector<std::string> &addrs);
+
+	// Writes acks to the journals, and drops acked operations from those
+	// with enough of them
+	void compactJournals();
+
+	// Every replica still in its group, by address
+	std::vector<Lag> lag();
+
+	// Counts since the previous call, or "" if nothing was sent
+	std::string stats();
+
+	static bool parseAckPolicy(const std::string &name, AckPolicy &policy);
+
+private:
+	class Stream;
+
+	struct PendingOp {
+		SNS::Operation::Type type;
+		uint64_t seq;
+		std::shared_ptr<const SNS::Request> request;
+		std::shared_ptr<Ack> ack;	// NULL once told, or if recovered from a journal
+		int attempts = 0;
+		uint64_t batchEnd = 0;		// seq of the last operation of the batch it was last sent in
+		size_t bytes = 0;
+		int64_t queuedNanos = 0;	// since the epoch, kept across restarts
+		std::chrono::steady_clock::time_point queued;
+		std::chrono::steady_clock::time_point sent;
+	};
+
+	// Outbound state of one replica, guarded by mtx
+	struct Replica {
+		std::string addr;
+		std::string group;
+		bool retired = false;
+
+		std::mutex mtx;
+		std::deque<PendingOp> ops;	// unacknowledged, in seq order
+		// Acks of operations applied in batches the replica still holds
+		// (see ReplicationAck), by the batch's last seq
+		std::map<uint64_t, std::vector<std::shared_ptr<Ack>>> held;
+		size_t numSent = 0;			// ops before this index were written to stream
+		uint64_t queueId = 0;
+		uint64_t nextSeq = 1;
+		std::unique_ptr<ReplicaJournal> journal;
+
+		Stream *stream = NULL;
+		bool writing = false;
+		int failures = 0;			// streams failed since the last ack
+
+		// A new alarm per wait, so one can be set from the previous one's callback
+		std::unique_ptr<grpc::Alarm> flushAlarm;
+		std::unique_ptr<grpc::Alarm> reconnectAlarm;
+		std::unique_ptr<grpc::Alarm> stallAlarm;
+		bool flushArmed = false;
+		bool reconnectArmed = false;
+		bool stallArmed = false;
+	};
+
+	ChannelPool &pool;
+
+	int batchDelayUs = 200;
+	int maxBatchOps = 256;
+	int maxBatchBytes = 256 * 1024;
+
+	int maxAttempts = 4;
+	int ackTimeoutMs = 1000;
+	int baseBackoffMs = 50;
+	static constexpr int MAX_BACKOFF_MS = 2000;
+
+	std::atomic<uint64_t> currentTerm{0};
+	std::atomic<uint64_t> termStart{0};
+
+	std::string journalDir;
+	WriteAheadLog::Durability journalDurability = WriteAheadLog::INTERVAL;
+	static constexpr int JOURNAL_SYNC_INTERVAL_MS = 100;
+	static const uint64_t JOURNAL_COMPACT_BYTES = 1024 * 1024;
+
+	// Replicas are never removed, so their addresses stay valid
+	std::mutex replicasMtx;
+	std::map<std::string, std::unique_ptr<Replica>> replicas;
+
+	// Streams and alarms that have yet to call back
+	std::mutex callbacksMtx;
+	std::condition_variable callbacksCv;
+	int pendingCallbacks = 0;
+	std::atomic<bool> stopping{false};
+
+	std::atomic<long> numOps{0};
+	std::atomic<long> numBatches{0};
+	std::atomic<long> numReconnects{0};
+	std::atomic<long> numFailed{0};
+	std::atomic<long> totalMicros{0};
+
+	Replica* getReplica(const std::string &addr);
+
+	// Called with r->mtx held
+	void openQueue(Replica *r);
+	void connect(Replica *r);
+	void maybeFlush(Replica *r);
+	void flush(Replica *r);
+	void failAll(Replica *r);
+	void armStallCheck(Replica *r, std::chrono::steady_clock::time_point due);
+	void checkStalled(Replica *r);
+
+	// Stream and alarm callbacks
+	void onWriteDone(Replica *r, Stream *s, bool ok);
+	void onReadsDone(Replica *r, Stream *s);
+	void onAck(Replica *r, Stream *s, const SNS::ReplicationAck &ack);
+	void failHeld(Replica *r);
+	void onStreamDone(Replica *r, Stream *s, const grpc::Status &status);
+	void addCallback();
+	void callbackDone();
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+
+/*
+	Fixed-capacity circular buffer. Pushing into a full buffer
+	overwrites the oldest element. Elements are read back by age,
+	where index 0 is the newest.
+*/
+template <typename T, int N>
+class RingBuffer {
+
+public:
+	void push(const T &item) {
+		head = (head + 1) % N;
+		items[head] = item;
+		if(count < N) {
+			count++;
+		}
+	}
+
+	// 0 is the most recently pushed element
+	const T& newest(int age) const { return items[(head - age + N) % N]; }
+
+	void clear() { head = N - 1; count = 0; }
+	int size() const { return count; }
+	bool full() const { return count == N; }
+	static constexpr int capacity() { return N; }
+
+private:
+	std::array<T, N> items;
+	int head = N - 1;
+	int count = 0;
+};
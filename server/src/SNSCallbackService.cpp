@@ -0,0 +1,328 @@
+#include "SNSCallbackService.h"
+
+using namespace std;
+
+// ---- TIMELINE REACTOR ----
+
+/*
+	One Timeline stream. Reads are issued one at a time and the next read
+	starts only after the previous message was handled on a worker, so
+	posts from a stream are applied in order. Writes go through a
+	ReactorSubscriber. Finish is only called once reading has failed,
+	and the reactor deletes itself in OnDone.
+*/
+class TimelineReactor : public ServerBidiReactor<Message, Message> {
+
+public:
+	TimelineReactor(CallbackServerContext *context, SNSServer *server, WorkerPool *workers)
+		: context(context), server(server), workers(workers)
+	{
+		StartRead(&incoming);
+	}
+
+	void OnReadDone(bool ok) override {
+		if(!ok) {
+			// Client closed the stream or the call was cancelled
+			workers->submit([this] {
+				if(subscriber != NULL) {
+					server->leaveTimeline(owner, subscriber);
+				}
+				Finish(Status::OK);
+			});
+			return;
+		}
+
+		Message message = incoming;
+		if(subscriber == NULL) {
+			subscriber = make_shared<ReactorSubscriber>(context, this,
+						server->getSendQueueCapacity(), server->getOverflowPolicy());
+			workers->submit([this, message] {
+				owner = server->joinTimeline(message, subscriber);
+				StartRead(&incoming);
+			});
+		} else {
+			workers->submit([this, message] {
+				// A post that can't be persisted ends the stream
+				Status status = server->postToTimeline(message);
+				if(!status.ok()) {
+					server->leaveTimeline(owner, subscriber);
+					Finish(status);
+					return;
+				}
+				StartRead(&incoming);
+			});
+		}
+	}
+
+	void OnWriteDone(bool ok) override {
+		subscriber->onWriteDone(ok);
+	}
+
+	void OnDone() override {
+		delete this;
+	}
+
+private:
+	CallbackServerContext *context;
+	SNSServer *server;
+	WorkerPool *workers;
+
+	Message incoming;
+	shared_ptr<Client> owner;
+	shared_ptr<ReactorSubscriber> subscriber;
+};
+
+// ---- REPLICATE REACTOR ----
+
+/*
+	One Replicate stream from a master. Like TimelineReactor, the next read
+	starts only after the previous batch was applied on a worker, so
+	batches are applied in order. Each batch is acked once applied. One
+	this server forwarded, whose forwards are not yet acked, is acked as
+	held and released once they are (see ReplicationAck); no worker waits
+	for that. Acks are cumulative: whatever was applied, held or released
+	while the previous ack was still being written goes in the next one.
+	Finish waits until no batch is held, as their callbacks use the reactor.
+*/
+class ReplicateReactor : public ServerBidiReactor<ReplicationBatch, ReplicationAck> {
+
+public:
+	ReplicateReactor(SNSServer *server, WorkerPool *workers)
+		: server(server), workers(workers)
+	{
+		StartRead(&incoming);
+	}
+
+	void OnReadDone(bool ok) override {
+		if(!ok) {
+			lock_guard<mutex> lock(mtx);
+			readsDone = true;
+			maybeFinish();
+			return;
+		}
+
+		shared_ptr<ReplicationBatch> batch = make_shared<ReplicationBatch>(std::move(incoming));
+		workers->submit([this, batch] {
+			shared_ptr<Held> held = make_shared<Held>();
+			{
+				lock_guard<mutex> lock(mtx);
+				numHeld++;
+			}
+			uint64_t seq = server->applyBatch(*batch, [this, held] {
+				lock_guard<mutex> lock(mtx);
+				numHeld--;
+				held->acked = true;
+				if(held->applied) {
+					release(held->seq);
+				}
+				maybeFinish();
+			});
+			{
+				lock_guard<mutex> lock(mtx);
+				held->applied = true;
+				held->seq = seq;
+				appliedSeq = max(appliedSeq, seq);
+				if(!held->acked) {
+					heldSeqs.push_back(seq);
+				}
+				startNextWrite();
+			}
+			StartRead(&incoming);
+		});
+	}
+
+	void OnWriteDone(bool ok) override {
+		lock_guard<mutex> lock(mtx);
+		writing = false;
+		failed = !ok;
+		startNextWrite();
+		maybeFinish();
+	}
+
+	void OnDone() override {
+		delete this;
+	}
+
+private:
+	// A batch from when it is applied until its forwards are acked
+	struct Held {
+		uint64_t seq = 0;
+		bool applied = false;
+		bool acked = false;
+	};
+
+	SNSServer *server;
+	WorkerPool *workers;
+
+	ReplicationBatch incoming;
+
+	mutex mtx;
+	ReplicationAck outgoing;
+	uint64_t appliedSeq = 0;
+	vector<uint64_t> heldSeqs;		// held since the last ack was written
+	vector<uint64_t> releasedSeqs;	// released since the last ack was written
+	int numHeld = 0;				// batches whose callback hasn't run
+	bool writing = false;
+	bool failed = false;
+	bool readsDone = false;
+	bool finished = false;
+
+	// Called with mtx held
+	void release(uint64_t seq) {
+		auto unsent = find(heldSeqs.begin(), heldSeqs.end(), seq);
+		if(unsent != heldSeqs.end()) {
+			heldSeqs.erase(unsent);
+		} else {
+			releasedSeqs.push_back(seq);
+		}
+		startNextWrite();
+	}
+
+	// Called with mtx held
+	void startNextWrite() {
+		if(writing || failed) {
+			return;
+		}
+		if(appliedSeq <= outgoing.seq() && heldSeqs.empty() && releasedSeqs.empty()) {
+			return;
+		}
+		writing = true;
+		outgoing.set_seq(appliedSeq);
+		outgoing.clear_held();
+		outgoing.clear_released();
+		for(uint64_t seq : heldSeqs) {
+			outgoing.add_held(seq);
+		}
+		for(uint64_t seq : releasedSeqs) {
+			outgoing.add_released(seq);
+		}
+		heldSeqs.clear();
+		releasedSeqs.clear();
+		StartWrite(&outgoing);
+	}
+
+	// Called with mtx held
+	void maybeFinish() {
+		if(readsDone && !writing && numHeld == 0 && !finished) {
+			finished = true;
+			Finish(Status::OK);
+		}
+	}
+};
+
+// ---- SNAPSHOT REACTOR ----
+
+/*
+	One StreamSnapshot reply. Each chunk is read from the logs on a worker
+	once the previous one was written, so only one chunk is in memory and
+	no worker waits on the network between chunks.
+*/
+class SnapshotReactor : public ServerWriteReactor<SnapshotChunk> {
+
+public:
+	SnapshotReactor(SNSServer *server, WorkerPool *workers, const SiblingRequest *request)
+		: server(server), workers(workers)
+	{
+		workers->submit([this, request] {
+			snapshot = this->server->openSnapshot(*request);
+			writeNext();
+		});
+	}
+
+	void OnWriteDone(bool ok) override {
+		if(!ok) {
+			// Receiver went away
+			workers->submit([this] {
+				log(WARNING, "Snapshot cancelled by the receiver after " + snapshot->stats());
+				Finish(Status::CANCELLED);
+			});
+			return;
+		}
+		workers->submit([this] {
+			writeNext();
+		});
+	}
+
+	void OnDone() override {
+		delete this;
+	}
+
+private:
+	SNSServer *server;
+	WorkerPool *workers;
+
+	unique_ptr<Snapshot> snapshot;
+	SnapshotChunk chunk;
+
+	// Runs on a worker
+	void writeNext() {
+		if(snapshot == NULL) {
+			Finish(Status(grpc::StatusCode::INTERNAL, "Failed to read logs"));
+			return;
+		}
+		if(snapshot->next(chunk)) {
+			StartWrite(&chunk);
+			return;
+		}
+		Finish(server->finishSnapshot(*snapshot));
+	}
+};
+
+// ---- CALLBACK SERVICE ----
+
+SNSCallbackService::SNSCallbackService(SNSServer *server, int numWorkers)
+	: server(server), workers(numWorkers), replicationWorkers(numWorkers)
+{
+
+}
+
+ServerUnaryReactor* SNSCallbackService::runUnary(CallbackServerContext* context, function<Status()> call)
+{
+	ServerUnaryReactor *reactor = context->DefaultReactor();
+	workers.submit([reactor, call] {
+		reactor->Finish(call());
+	});
+	return reactor;
+}
+
+// The sync handlers do not use their context, so none is passed
+
+ServerUnaryReactor* SNSCallbackService::Login(CallbackServerContext* context, const Request* request, Reply* reply)
+{
+	return runUnary(context, [this, request, reply] { return server->Login(NULL, request, reply); });
+}
+
+ServerUnaryReactor* SNSCallbackService::Follow(CallbackServerContext* context, const Request* request, Reply* reply)
+{
+	return runUnary(context, [this, request, reply] { return server->Follow(NULL, request, reply); });
+}
+
+ServerUnaryReactor* SNSCallbackService::UnFollow(CallbackServerContext* context, const Request* request, Reply* reply)
+{
+	return runUnary(context, [this, request, reply] { return server->UnFollow(NULL, request, reply); });
+}
+
+ServerUnaryReactor* SNSCallbackService::List(CallbackServerContext* context, const Request* request, ListReply* list_reply)
+{
+	return runUnary(context, [this, request, list_reply] { return server->List(NULL, request, list_reply); });
+}
+
+ServerBidiReactor<Message, Message>* SNSCallbackService::Timeline(CallbackServerContext* context)
+{
+	return new TimelineReactor(context, server, &workers);
+}
+
+ServerWriteReactor<SnapshotChunk>* SNSCallbackService::StreamSnapshot(CallbackServerContext* context, const SiblingRequest* sb)
+{
+	return new SnapshotReactor(server, &workers, sb);
+}
+
+ServerUnaryReactor* SNSCallbackService::AddPost(CallbackServerContext* context, const Request* request, Reply* reply)
+{
+	return runUnary(context, [this, request, reply] { return server->AddPost(NULL, request, reply); });
+}
+
+ServerBidiReactor<ReplicationBatch, ReplicationAck>* SNSCallbackService::Replicate(CallbackServerContext* context)
+{
+	return new ReplicateReactor(server, &replicationWorkers);
+}
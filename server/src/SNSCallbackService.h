@@ -0,0 +1,52 @@
+#pragma once
+
+#include <functional>
+
+#include "SNSServer.h"
+#include "WorkerPool.h"
+
+using grpc::CallbackServerContext;
+using grpc::ServerBidiReactor;
+using grpc::ServerUnaryReactor;
+using grpc::ServerWriteReactor;
+
+/*
+	SNSService on the gRPC callback API.
+
+	Handlers return immediately and no thread is held by an idle
+	Timeline stream. Reactions must not block, so every call into
+	SNSServer (which writes files and replicates synchronously) runs
+	on a bounded WorkerPool. The sync SNSServer service stays available
+	and both share the same SNSServer state.
+
+	Replicated batches are applied on a pool of their own. A client call
+	may wait for other servers to ack, and those servers may in turn be
+	waiting on a batch this one has to apply, so the two must never
+	compete for the same threads.
+*/
+class SNSCallbackService final : public SNSService::CallbackService {
+
+public:
+	SNSCallbackService(SNSServer *server, int numWorkers);
+	virtual ~SNSCallbackService() {};
+
+	// Client API
+	ServerUnaryReactor* Login(CallbackServerContext* context, const Request* request, Reply* reply) override;
+	ServerUnaryReactor* Follow(CallbackServerContext* context, const Request* request, Reply* reply) override;
+	ServerUnaryReactor* UnFollow(CallbackServerContext* context, const Request* request, Reply* reply) override;
+	ServerUnaryReactor* List(CallbackServerContext* context, const Request* request, ListReply* list_reply) override;
+	ServerBidiReactor<Message, Message>* Timeline(CallbackServerContext* context) override;
+
+	// Cross-Server Communication
+	ServerWriteReactor<SnapshotChunk>* StreamSnapshot(CallbackServerContext* context, const SiblingRequest* sb) override;
+	ServerUnaryReactor* AddPost(CallbackServerContext* context, const Request* request, Reply* reply) override;
+	ServerBidiReactor<ReplicationBatch, ReplicationAck>* Replicate(CallbackServerContext* context) override;
+
+private:
+	SNSServer *server;
+	WorkerPool workers;
+	WorkerPool replicationWorkers;
+
+	// Runs call on a worker and finishes the RPC with its status
+	ServerUnaryReactor* runUnary(CallbackServerContext* context, std::function<Status()> call);
+};
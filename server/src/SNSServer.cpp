@@ -31,6 +31,8 @@
  *
  */
 
+#include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <fstream>
 #include <iostream>
@@ -39,6 +41,7 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <queue>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -52,6 +55,7 @@ using google::protobuf::Duration;
 
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::ClientReader;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
@@ -70,7 +74,7 @@ using SNS::SNSStatus;
 
 // Server-Server Communication
 using SNS::SiblingRequest;
-using SNS::LogReply;
+using SNS::SnapshotChunk;
 
 // Server-Coordinator Communication
 using SNS::CoordService;
@@ -163,34 +167,58 @@ string SNSServer::ADD_POST = "add_post";
 string SNSServer::COUNTERPARTS = "counterparts";
 string SNSServer::OTHER_MASTERS = "other_masters";
 
-// Message format:
 /*
-	Message format:
-	T <timestamp>
-	U <user>
-	W <post content>
-	<newline>
+	Set while applyBatch runs on this thread. Operations in the batch then
+	leave their log records to be flushed once, and their replica acks to
+	be waited for once, for the whole batch.
 */
-string SNSServer::formatMessageOutput(const Message &message) 
-{
-	string timeStr = timestampToStr(message.timestamp());
-	string u = message.username();
-	string m = message.msg();
+struct BatchContext {
+	vector<pair<string, shared_ptr<Replicator::Ack>>> acks;
+};
+static thread_local BatchContext *currentBatch = NULL;
 
-    string output;
+static void warnShortAck(const string &method, shared_ptr<Replicator::Ack> ack)
+{
+	log(WARNING, "Replicated " + method + " request to only " + to_string(ack->acked()) + " "
+				"of " + to_string(ack->size()) + " servers, fewer than the ack policy requires");
+}
 
-    output += "T " + timeStr;
-    output += "\nU " + u;
-    output += "\nW " + m + "\n\n";
-    return output;
+static void waitForAck(const string &method, shared_ptr<Replicator::Ack> ack)
+{
+	if(!ack->wait()) {
+		warnShortAck(method, ack);
+	}
 }
 
+// Calls done once every one of acks is done, without blocking
+static void whenAcked(const vector<pair<string, shared_ptr<Replicator::Ack>>> &acks, function<void()> done)
+{
+	if(acks.empty()) {
+		done();
+		return;
+	}
+
+	shared_ptr<atomic<size_t>> remaining = make_shared<atomic<size_t>>(acks.size());
+	for(const auto &entry : acks) {
+		string method = entry.first;
+		shared_ptr<Replicator::Ack> ack = entry.second;
+		ack->whenDone([method, ack, remaining, done](bool ok) {
+			if(!ok) {
+				warnShortAck(method, ack);
+			}
+			if(--*remaining == 0) {
+				done();
+			}
+		});
+	}
+}
 
 // ---- SERVER ----
 
 SNSServer::SNSServer() 
 {
 	filesys = make_shared<FSLocal>(TOP_LEVEL_DIR);
+	replicator = make_unique<Replicator>(replicas);
 }
 
 // ---- COORDINATOR COMMUNICATION ----
@@ -226,13 +254,27 @@ int SNSServer::connectToCoordinator(string hostname, string port,
 	serverInfo.set_registered(true);
 
 	master = path.master();
+	topologyVersion = path.topology_version();
 	string masterString = master ? MASTER : SLAVE;
 	log(INFO, "Server registered with file lock: " + path.path() + ". Server is " + masterString);
 
 	setFilepaths(clusterId, serverId);
 	initializeData(path.sync_address());
+	openReplicationQueues();
+
+	// Our logs now agree with those of the master we synced from
+	if(master) {
+		beginTerm(path.term());
+	} else {
+		term = path.term();
+		lock_guard<mutex> lock(appliedMtx);
+		heldTerm = path.term();
+	}
 
 	thread(&SNSServer::sendHeartbeat, this).detach();
+	if(checkpointInterval > 0) {
+		thread(&SNSServer::checkpointLoop, this).detach();
+	}
 
 	// Since each server will be on the same machine for now, 
 	// give each one a unique local path in which to save data
@@ -252,197 +294,684 @@ void SNSServer::setFilepaths(int clusterId, int serverId) {
 	of the cluster master. If it's a master, sync address will contain
 	the address of a different cluster master, or will be empty.
 	If empty, try to initialize from local files. 
+
+	A slave keeps its local files and asks its master only for the
+	records it lacks, unless the master answers with a full snapshot.
+	LSNs are only shared within a cluster, so a master syncing from
+	another cluster always takes a full snapshot.
+
+	No need to propogate this initialization.
+
+	If you are a slave, you are initializing from the current cluster master,
+	and slaves do not propogate commands.
+
+	If you are a initializing as a cluster master, there are no slaves
+	available to propogate to yet.
 */
 void SNSServer::initializeData(const string &syncAddress) {
 
 	// Fails if localpath already exists
 	filesys->create(localPath, true, true);
 
-	string userinfo;
-	string posts;
-	bool saveToLocal = false;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// Logs are opened first so new files get a header
+	openLogs();
+
+	string base = TOP_LEVEL_DIR + "/";
+	int numThreads = max(1, (int)thread::hardware_concurrency());
+	unique_ptr<LogLoader> userinfo = make_unique<LogLoader>(base + userinfoPath, numThreads, REPLAY_CHUNK_SIZE);
+	unique_ptr<LogLoader> posts = make_unique<LogLoader>(base + postsPath, numThreads, REPLAY_CHUNK_SIZE);
+	bool readable = userinfo->open() == 0 && posts->open() == 0;
+
 	if(syncAddress == "") {
 
-		// Even reads fails, userinfo and posts will contain empty strings
 		log(INFO, "No other cluster master available to sync with. Trying to sync with local files.");
 
-		int readUserinfo = filesys->read(userinfoPath, userinfo);
-		if(readUserinfo == 0) {
-			log(INFO, "Synced with local userinfo file.");
-		}
-
-		int readPosts = filesys->read(postsPath, posts);
-		if(readPosts == 0) {
-			log(INFO, "Synced with local posts file.");
+		if(!readable) {
+			log(FATAL, "Logs in " + TOP_LEVEL_DIR + "/" + localPath + " are not in the current binary log format. "
+				"Logs from older servers can be converted by running the server with -u.");
 		}
+		replayLogs(*userinfo, *posts);
 
 	} else {
 
-		// Since we are initializing from a different file, clear the contents
-		// of any existing file. Create empty files if they don't exist.
-		filesys->write(userinfoPath, "", true, true);
-		filesys->write(postsPath, "", true, true);
-		saveToLocal = true;
-
-		shared_ptr<Channel> serverChannel = grpc::CreateChannel(syncAddress, grpc::InsecureChannelCredentials());
-		unique_ptr<SNSService::Stub> stub_ = make_unique<SNSService::Stub>(serverChannel);
-
-		ClientContext context;
 		SiblingRequest request;
-		LogReply logReply;
-
-		Status status = stub_->GetLog(&context, request, &logReply);
+		if(!master && readable) {
+			describeLogs(userinfo->data(), posts->data(), request);
+		}
 
 		// Possible source of failure: master fails while just before requesting data
 		// In current system, if any grpc fails on the server side, we exit.
-		if(!status.ok()) {
+		if(syncFrom(syncAddress, request, userinfo, posts) == -1) {
 			log(FATAL, "Initialization sync failed!");
 			// fatal log exits
 		}
-	
-		userinfo = logReply.userinfo();
-		posts = logReply.posts();
+	}
 
-		log(INFO, "Synchronized with server @ " + syncAddress);
+	userinfoLog->flush();
+	postsLog->flush();
+	long elapsedMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+
+	int numPosts = all_posts.size();
+	size_t postBytes = all_posts.memoryUsed();
+	string loaded =
+	"Loaded " + to_string(users.size()) + " users and " + to_string(numPosts) + " posts in " + to_string(elapsedMs) + "ms. "
+	"Post store holds " + to_string(postBytes) + " bytes";
+	if(numPosts > 0) {
+		loaded += ", " + to_string(postBytes / numPosts) + " per post";
 	}
+	log(INFO, loaded + ". Last LSN is " + to_string(lastLsn));
+	log(INFO, "Userinfo log " + userinfoLog->stats() + ". Posts log " + postsLog->stats());
+}
 
-	/* 
-		No need to propogate this initialization.
-		
-		If you are a slave, you are initializing from the current cluster master,
-		and slaves do not propogate commands.
-		
-		If you are a initializing as a cluster master, there are no slaves 
-		available to propogate to yet.
-	*/
-	processUserInfoFromFile(userinfo, saveToLocal);
-	updatePostsFromFile(posts, saveToLocal);
+/*
+	Opens the journal per replica of what was sent it (see Replicator).
+	Only a master resends what its journals hold. A server that restarts
+	as a slave drops them, as its former replicas get the rest from the
+	new master. The last operation applied from each queue that sent us
+	any was restored with the userinfo log.
+*/
+void SNSServer::openReplicationQueues()
+{
+	string dir = localPath + "replication";
+	filesys->create(dir, true, true);
+	replicator->setJournal(TOP_LEVEL_DIR + "/" + dir + "/", durability);
+	if(master) {
+		size_t recovered = replicator->recover();
+		if(recovered > 0) {
+			log(INFO, "Resending " + to_string(recovered) + " replicated operations left in the journals of the last run");
+		}
+	} else {
+		replicator->clearJournals();
+	}
+
+	lock_guard<mutex> lock(appliedMtx);
+	if(!appliedQueues.empty()) {
+		log(INFO, "Restored the last operation applied from " + to_string(appliedQueues.size()) + " replication queues");
+	}
 }
 
 /*
-	Send a heartbeat to the coordinator every heartbeatDelay seconds
-	to inform it that this server is still alive. Each heartbeat conducts 
-	a leader election if the current cluster master is dead.
+	Starts numbering operations in a new term as master. LSNs given out
+	from here on are newTerm's, and our batches say so, so slaves that
+	hold them from an earlier master apply ours anyway.
+*/
+void SNSServer::beginTerm(uint64_t newTerm)
+{
+	term = newTerm;
+	termStart = lastLsn + 1;
+	replicator->setTerm(newTerm, termStart);
+	log(INFO, "Master for term " + to_string(newTerm) + " from LSN " + to_string(termStart));
+}
+
+/*
+	Streams a snapshot from syncAddress and applies each chunk as it
+	arrives, so only one chunk is held at a time. If the snapshot is a
+	tail, our own logs in userinfo and posts are replayed first and kept.
+	Otherwise they are dropped and our files cleared before the first
+	chunk is applied. Either way the loaders are closed once the first
+	chunk arrives. Returns -1 if the stream or our logs fail.
+*/
+int SNSServer::syncFrom(const string &syncAddress, const SiblingRequest &request,
+						unique_ptr<LogLoader> &userinfo, unique_ptr<LogLoader> &posts)
+{
+	shared_ptr<Channel> serverChannel = grpc::CreateChannel(syncAddress, grpc::InsecureChannelCredentials());
+	unique_ptr<SNSService::Stub> stub_ = make_unique<SNSService::Stub>(serverChannel);
+
+	ClientContext context;
+	unique_ptr<ClientReader<SnapshotChunk>> reader = stub_->StreamSnapshot(&context, request);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	SnapshotChunk chunk;
+	bool first = true;
+	bool tail = false;
+	vector<UserId> userMap;
+	size_t received = 0;
+	long numChunks = 0;
+
+	while(reader->Read(&chunk)) {
+		if(first) {
+			first = false;
+			tail = chunk.tail();
+			if(tail) {
+				replayLogs(*userinfo, *posts);
+			}
+			userinfo.reset();
+			posts.reset();
+			if(!tail) {
+				// Since we are initializing from a different file, clear the contents
+				// of any existing file. The logs are closed first and reopened so
+				// the emptied files get a header.
+				userinfoLog.reset();
+				postsLog.reset();
+				filesys->write(userinfoPath, "", true, true);
+				filesys->write(postsPath, "", true, true);
+				openLogs();
+			}
+		}
+
+		LogReader userinfoChunk(chunk.userinfo().data(), chunk.userinfo().size(), LogFormat::VERSION);
+		LogReader postsChunk(chunk.posts().data(), chunk.posts().size(), LogFormat::VERSION);
+		processUserInfoFromFile(userinfoChunk, true, userMap);
+		updatePostsFromFile(postsChunk, true, userMap);
+
+		// Written before the next chunk, so the logs hold at most one chunk in memory
+		if(userinfoLog->flush() == -1 || postsLog->flush() == -1) {
+			return -1;
+		}
+
+		received += chunk.userinfo().size() + chunk.posts().size();
+		numChunks++;
+	}
+
+	Status status = reader->Finish();
+	if(!status.ok() || first) {
+		log(ERROR, "Snapshot from " + syncAddress + " failed: " + status.error_message());
+		return -1;
+	}
+
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	char rate[32];
+	snprintf(rate, sizeof(rate), "%.1f", secs > 0 ? received / (1024.0 * 1024.0) / secs : 0.0);
+	string synced = tail ?
+		"Caught up with server @ " + syncAddress + " from LSN " + to_string(request.last_lsn()) + ", "
+		"missing " + to_string(request.missing_lsns_size()) + " below it" :
+		"Synchronized with server @ " + syncAddress + " from a full snapshot";
+	log(INFO, synced + ". Received and applied " + to_string(received) + " bytes in " + to_string(numChunks) + " chunks, "
+		+ to_string((long)(secs * 1000)) + "ms, " + rate + " MB/s");
+	return 0;
+}
+
+/*
+	Keeps a Session open with the coordinator in place of heartbeats.
+	Every keepaliveMs this thread sends a keepalive with the server's
+	load, and every heartbeatDelay seconds it also does the upkeep below. Promotions and
+	topology changes arrive on the session as the coordinator makes them,
+	and are applied by receiveUpdates on its own thread.
 */
 void SNSServer::sendHeartbeat() 
 {
-	while(true) {
+	ClientContext context;
+	unique_ptr<grpc::ClientReaderWriter<Keepalive, Path>> session = coordStub_->Session(&context);
+
+	// The first says which server this is
+	Keepalive first;
+	*first.mutable_server() = serverInfo;
+	if(!session->Write(first)) {
+		log(ERROR, "Failed to open a session with the coordinator...");
+		exit(1);
+	}
+	thread(&SNSServer::receiveUpdates, this, session.get()).detach();
 
-		sleep(heartbeatDelay);
+	uint64_t queued = 0;
+	chrono::steady_clock::time_point nextUpkeep = chrono::steady_clock::now();
+	while(true) {
 
-		ClientContext context;
-		Status status = coordStub_->Heartbeat(&context, serverInfo, &path);
+		this_thread::sleep_for(chrono::milliseconds(keepaliveMs));
 
-		if(!status.ok()) {
+		Keepalive keepalive;
+		keepalive.set_users(users.size());
+		keepalive.set_last_lsn(lastLsn);
+		keepalive.set_replication_queued(queued);
+		if(!session->Write(keepalive)) {
 			log(ERROR, "Heartbeat failed...");
 			exit(1);
 		}
 
-		bool originalMasterStatus = master;
-		master = path.master();
-		if(master && master != originalMasterStatus) {
-			string message =
-			"Master file lock acquired! Server is now master.";
-			log(INFO, message);
+		if(chrono::steady_clock::now() < nextUpkeep) {
+			continue;
+		}
+		nextUpkeep = chrono::steady_clock::now() + chrono::seconds(heartbeatDelay);
+
+		// Keep pooled replica channels connected and report replication latency
+		int unhealthy = replicas.checkHealth();
+		if(unhealthy > 0) {
+			log(WARNING, to_string(unhealthy) + " of " + to_string(replicas.size()) + " replica channels are not ready");
+		}
+
+		replicator->compactJournals();
+		string replication = replicator->stats();
+		if(replication != "") {
+			log(INFO, "Replication: " + replication);
+		}
+
+		string lagging;
+		queued = 0;
+		for(const Replicator::Lag &lag : replicator->lag()) {
+			queued += lag.ops;
+			if(lag.ops > 0) {
+				char seconds[32];
+				snprintf(seconds, sizeof(seconds), "%.1fs", lag.seconds);
+				lagging += (lagging == "" ? "" : ", ") + lag.addr + " " + to_string(lag.ops) + " operations, " + seconds;
+			}
+		}
+		if(lagging != "") {
+			log(INFO, "Replication lag: " + lagging);
 		}
 	}
 }
 
+// Applies updates from the coordinator. A broken session means the
+// coordinator has released this server, so it exits as on a failed heartbeat.
+void SNSServer::receiveUpdates(grpc::ClientReaderWriter<Keepalive, Path> *session)
+{
+	Path update;
+	while(session->Read(&update)) {
+		applyPath(update);
+	}
+
+	log(ERROR, "Session with the coordinator closed...");
+	exit(1);
+}
+
+void SNSServer::applyPath(const Path &update)
+{
+	bool originalMasterStatus = master;
+
+	// The term starts after the last LSN we had as a slave
+	if(update.master() && (!originalMasterStatus || update.term() != term)) {
+		beginTerm(update.term());
+	} else if(update.term() > term) {
+		term = update.term();
+	}
+
+	master = update.master();
+	topologyVersion = update.topology_version();
+	if(master && master != originalMasterStatus) {
+		string message =
+		"Master file lock acquired! Server is now master.";
+		log(INFO, message);
+	}
+}
+
 // ---- CLIENT HELPERS ----
 
 // Returns pointer to the client with provided username
-// If createNew is true, creates a new client with username
-shared_ptr<Client> SNSServer::getClient(const string &username, bool createNew)
+// If createNew is true, registers a new client with username. Given lsn,
+// a new client's USER record is appended to userinfo under the same lock
+// that assigns its id, so the log lists users in id order. *lsn is the
+// LSN to record, 0 to assign one, and is set to the record's LSN and
+// *ticket to its ticket, or both to 0 if the client already existed.
+shared_ptr<Client> SNSServer::getClient(const string &username, bool createNew, uint64_t *lsn, uint64_t *ticket)
 {
-	shared_ptr<Client> client = NULL;
-	bool found = false;
-	for(int i = 0; i < (int)(client_db.size()); i++) {
-		shared_ptr<Client> c = client_db[i];
-		if(username == c->username) {
-			client = client_db[i];
-			found = true;
-			break;
+	if(lsn != NULL) {
+		*ticket = 0;
+	}
+
+	UserId id = users.find(username);
+	if(id != INVALID_USER) {
+		if(lsn != NULL) {
+			*lsn = 0;
 		}
+		return client_db[id];
 	}
 
-	// If not found, returns a new client with provided username
+	// If not found, interns the username and adds a new client to client_db
 	// So logging in with a new username creates a new user.
-	if(!found && createNew) {
-		client = make_shared<Client>();
-		client->username = username;
+	if(!createNew) {
+		return NULL;
 	}
 
+	// The client is published in client_db before its name is interned,
+	// so any thread that finds the id can already index client_db with it.
+	lock_guard<mutex> lock(clientsMtx);
+	id = users.find(username);
+	if(id != INVALID_USER) {
+		if(lsn != NULL) {
+			*lsn = 0;
+		}
+		return client_db[id];
+	}
+
+	shared_ptr<Client> client = make_shared<Client>();
+	client->id = (UserId)client_db.size();
+
+	// Replay assigns ids in record order, so a record appended after
+	// the lock is released could swap ids with a concurrent login
+	if(lsn != NULL) {
+		*lsn = assignLsn(*lsn);
+		string data;
+		LogFormat::encodeUser(data, *lsn, client->id, username);
+		*ticket = userinfoLog->append(data);
+	}
+
+	client_db.push_back(client);
+	users.intern(username);
+
 	return client;
 }
 
-// Returns the index of client2 in client1's following list
-int SNSServer::indexOfFollowing(shared_ptr<Client> client1, shared_ptr<Client> client2)
+/*
+	Removes the posts of author from c's inbox after c unfollows them,
+	keeping the order of the rest. This only walks the inbox, so an
+	unfollow costs O(TIMELINE_SIZE). The inbox holds fewer posts until
+	the remaining followees post again. Older posts of theirs that were
+	pushed out are not brought back.
+*/
+void SNSServer::dropFromInbox(shared_ptr<Client> c, UserId author)
+{
+	vector<PostId> kept;
+	for(int age = c->inbox.size() - 1; age >= 0; age--) {
+		PostId post = c->inbox.newest(age);
+		if(all_posts[post].author != author) {
+			kept.push_back(post);
+		}
+	}
+
+	// Push oldest first so the newest post ends up at the head
+	c->inbox.clear();
+	for(PostId post : kept) {
+		c->inbox.push(post);
+	}
+}
+
+/*
+	Returns the ids of the latest TIMELINE_SIZE posts for c, newest first.
+
+	If none of the users c follows have pulled posts, this is just c's inbox.
+	Otherwise the inbox and the pulled_posts of each such author are merged
+	with a max-heap on PostId, since post ids increase in arrival order.
+	Pulled posts only count if they were made after c followed the author.
+
+	Each source is copied under its own shard lock first, so no two
+	shard locks are ever held at once.
+*/
+vector<PostId> SNSServer::getTimelinePosts(shared_ptr<Client> c)
 {
-	int idx = -1;
-	for(int i = 0; i < ((int)client1->client_following.size()); i++) {
-		if(*client1->client_following[i] == *client2) {
-			idx = i;
-			break;
+	// Source 0 is the inbox, the rest are pulled authors. Each is newest first.
+	vector<vector<PostId>> sources(1);
+	vector<FollowEdge> pulledAuthors;
+	{
+		ShardLocks::ReadGuard lock = locks.read(c->id);
+		for(int age = 0; age < c->inbox.size(); age++) {
+			sources[0].push_back(c->inbox.newest(age));
+		}
+		for(const FollowEdge &edge : c->client_following) {
+			if(client_db[edge.user]->hasPulledPosts) {
+				pulledAuthors.push_back(edge);
+			}
+		}
+	}
+
+	if(pulledAuthors.empty()) {
+		inboxReads++;
+		return sources[0];
+	}
+
+	// Posts arrive roughly in time order, but replicated ones can land
+	// out of order, so skip posts older than the follow instead of
+	// stopping at the first. Once TIMELINE_SIZE have been skipped the
+	// rest are assumed older too, which bounds the scan.
+	for(const FollowEdge &edge : pulledAuthors) {
+		shared_ptr<Client> author = client_db[edge.user];
+		vector<PostId> newest;
+		int64_t followNanos = edge.timeNanos;
+		int skipped = 0;
+
+		ShardLocks::ReadGuard lock = locks.read(author->id);
+		const vector<PostId> &posts = author->pulled_posts;
+		for(int i = (int)posts.size() - 1; i >= 0 && (int)newest.size() < TIMELINE_SIZE; i--) {
+			if(all_posts[posts[i]].timeNanos <= followNanos) {
+				if(++skipped == TIMELINE_SIZE) {
+					break;
+				}
+				continue;
+			}
+			newest.push_back(posts[i]);
+		}
+		sources.push_back(std::move(newest));
+	}
+
+	struct Head {
+		PostId post;
+		int source;
+		int pos;
+		bool operator<(const Head &h) const { return post < h.post; }
+	};
+	priority_queue<Head> heap;
+
+	for(int i = 0; i < (int)sources.size(); i++) {
+		if(!sources[i].empty()) {
+			heap.push(Head{sources[i][0], i, 0});
 		}
 	}
-	return idx;
+
+	vector<PostId> timelinePosts;
+	while(!heap.empty() && (int)timelinePosts.size() < TIMELINE_SIZE) {
+		Head head = heap.top();
+		heap.pop();
+		timelinePosts.push_back(head.post);
+
+		const vector<PostId> &source = sources[head.source];
+		if(head.pos + 1 < (int)source.size()) {
+			heap.push(Head{source[head.pos + 1], head.source, head.pos + 1});
+		}
+	}
+
+	mergedReads++;
+	return timelinePosts;
+}
+
+// ---- LOCAL PERSISTENCE ----
+
+// Opens the userinfo and posts logs. Files are created if they don't exist.
+void SNSServer::openLogs()
+{
+	string base = TOP_LEVEL_DIR + "/";
+	userinfoLog = make_unique<WriteAheadLog>(base + userinfoPath, durability, logSyncInterval);
+	postsLog = make_unique<WriteAheadLog>(base + postsPath, durability, logSyncInterval);
+
+	string header = LogFormat::header();
+	if(userinfoLog->open(header) == -1 || postsLog->open(header) == -1) {
+		log(FATAL, "Failed to open local logs in " + base + localPath);
+	}
 }
 
-// Returns index of client2 in client1's follower list
-int SNSServer::indexOfFollower(shared_ptr<Client> client1, shared_ptr<Client> client2)
+// Checks every checkpointInterval seconds whether the userinfo log is due a checkpoint
+void SNSServer::checkpointLoop()
 {
-	int idx = -1;
-	for(int i = 0; i < ((int)client1->client_followers.size()); i++) {
-		if(*client1->client_followers[i] == *client2) {
-			idx = i;
-			break;
+	while(true) {
+		sleep(checkpointInterval);
+		checkpoint();
+	}
+}
+
+/*
+	Folds the userinfo log into a checkpoint (see LogCompactor) once the
+	records after the last one outgrow it. The log is read without
+	holding up writers, and only replaced once the checkpoint is built.
+	Records appended meanwhile are kept after it.
+	Returns -1 if the logs could not be read or replaced.
+*/
+int SNSServer::checkpoint()
+{
+	// Posts first, so the userinfo read introduces every author in them
+	int64_t postsLength = postsLog->length();
+	int64_t userinfoLength = userinfoLog->length();
+	if(userinfoLength == -1 || postsLength == -1) {
+		log(ERROR, "Failed to read local logs for a checkpoint");
+		return -1;
+	}
+
+	uint64_t added = userinfoLength - min<uint64_t>(userinfoLength, checkpointLength);
+	if(added < max<uint64_t>(checkpointLength, CHECKPOINT_MIN_BYTES)) {
+		return 0;
+	}
+
+	string base = TOP_LEVEL_DIR + "/";
+	LogCompactor compactor(base + userinfoPath, userinfoLength, base + postsPath, postsLength, MAX_MISSING_LSNS);
+	if(compactor.run() == -1) {
+		log(WARNING, "Could not checkpoint the userinfo log. It is unreadable or lacks more than "
+			+ to_string(MAX_MISSING_LSNS) + " LSNs");
+		return -1;
+	}
+
+	{
+		lock_guard<mutex> lock(compactMtx);
+		if(userinfoLog->replacePrefix(userinfoLength, compactor.checkpoint()) == -1) {
+			log(ERROR, "Failed to replace the userinfo log with its checkpoint");
+			return -1;
 		}
 	}
-	return idx;
+	checkpointLength = compactor.checkpoint().size();
+
+	log(INFO, "Checkpointed " + compactor.stats());
+	return 0;
 }
 
-// Gets the latest maxPosts number of posts made by users followed by c
-// Posts are only considered if they were made after c followed the poster
-vector<shared_ptr<Post>> SNSServer::getFollowingPosts(shared_ptr<Client> c, int maxPosts)
+/*
+	Rewrites this server's userinfo and posts files from the old text format:
+		userinfo lines:	user <name> | follow <a> <b> <time> | unfollow <a> <b>
+		posts:			T <time>\nU <name>\nW <content>\n\n
+	into the binary log format. Users get ids in order of first appearance.
+	Binary logs from before LSNs (version 1) are rewritten in the current
+	version. Either way records are numbered in order, userinfo first.
+	The originals are kept next to the new files with a .txt or .v1 suffix.
+	Returns 0 on success and -1 on failure.
+*/
+int SNSServer::convertTextLogs(int clusterId, int serverId)
 {
-	vector<shared_ptr<Client>> *following = &c->client_following;
-	vector<Timestamp> *timestamps = &c->follow_time;
+	setFilepaths(clusterId, serverId);
 
-	vector<shared_ptr<Post>> timelinePosts;
-	int i = (int)(all_posts.size()) - 1;
-	while(i >= 0 && maxPosts > 0) {
+	// Logs already converted are only read as far as their header
+	shared_ptr<FileView> userinfoView;
+	shared_ptr<FileView> postsView;
+	if(filesys->readView(userinfoPath, userinfoView) == -1 || filesys->readView(postsPath, postsView) == -1) {
+		log(ERROR, "Could not read the logs in " + TOP_LEVEL_DIR + "/" + localPath);
+		return -1;
+	}
+	string_view userinfo = userinfoView->data();
+	string_view posts = postsView->data();
 
-		shared_ptr<Post> post = all_posts[i];
+	LogReader binary(userinfo);
+	if(!userinfo.empty() && binary.valid() && binary.version() == LogFormat::VERSION) {
+		log(INFO, "Logs in " + TOP_LEVEL_DIR + "/" + localPath + " are already in the binary log format.");
+		return 0;
+	}
 
-		// Posts can only be made by existing users so this won't fail
-		shared_ptr<Client> author = getClient(post->username);
-		Timestamp postTime = post->timestamp;
-		
-		auto it = find(following->begin(), following->end(), author);
-		if(it != following->end()) {
-			
-			int idx = it - following->begin();
-			Timestamp followTime = (*timestamps)[idx];
+	unordered_map<string, UserId> ids;
+	string userinfoOut = LogFormat::header();
+	string postsOut = LogFormat::header();
+	uint64_t lsn = 0;
+	int numUsers = 0;
+	int numPosts = 0;
+	string suffix = ".txt";
+
+	auto idOf = [&](const string &name) {
+		auto it = ids.find(name);
+		if(it != ids.end()) {
+			return it->second;
+		}
+		UserId id = (UserId)ids.size();
+		ids.emplace(name, id);
+		LogFormat::encodeUser(userinfoOut, ++lsn, id, name);
+		numUsers++;
+		return id;
+	};
+
+	if(!userinfo.empty() && binary.valid()) {
+		suffix = ".v1";
+
+		LogRecord record;
+		while(binary.next(record) == 1) {
+			record.lsn = ++lsn;
+			LogFormat::encode(userinfoOut, record);
+			numUsers += record.type == RECORD_USER;
+		}
+		LogReader oldPosts(posts);
+		while(oldPosts.valid() && oldPosts.next(record) == 1) {
+			record.lsn = ++lsn;
+			LogFormat::encode(postsOut, record);
+			numPosts += record.type == RECORD_POST;
+		}
+	} else {
+		stringstream ss{string(userinfo)};
+		string line;
+		while(getline(ss, line, '\n')) {
+			vector<string> args = split(line);
+			if(args.size() >= 2 && args[0] == USER) {
+				idOf(args[1]);
+			} else if(args.size() >= 4 && args[0] == FOLLOW) {
+				int64_t timeNanos = (int64_t)strToSeconds(args[3]) * 1000000000LL;
+				UserId follower = idOf(args[1]);
+				UserId followee = idOf(args[2]);
+				LogFormat::encodeFollow(userinfoOut, ++lsn, follower, followee, timeNanos);
+			} else if(args.size() >= 3 && args[0] == UNFOLLOW) {
+				UserId follower = idOf(args[1]);
+				UserId followee = idOf(args[2]);
+				LogFormat::encodeUnfollow(userinfoOut, ++lsn, follower, followee);
+			}
+		}
 
-			if(postTime > followTime) {
-				timelinePosts.push_back(post);
-				maxPosts--;
+		for(const string &token : splitString(string(posts), "\n\n")) {
+			vector<string> postParts = splitString(token, "\n");
+			if(postParts.size() < 3) {
+				continue;
 			}
+			int64_t timeNanos = (int64_t)strToSeconds(postParts[0].substr(2)) * 1000000000LL;
+			UserId author = idOf(postParts[1].substr(2));
+			LogFormat::encodePost(postsOut, ++lsn, author, timeNanos, postParts[2].substr(2));
+			numPosts++;
 		}
+	}
 
-		i--;
+	if(filesys->write(userinfoPath + suffix, string(userinfo), false, true) == -1 ||
+		filesys->write(postsPath + suffix, string(posts), false, true) == -1 ||
+		filesys->write(userinfoPath, userinfoOut, false, true) == -1 ||
+		filesys->write(postsPath, postsOut, false, true) == -1) {
+		log(ERROR, "Could not write the converted logs in " + TOP_LEVEL_DIR + "/" + localPath);
+		return -1;
 	}
 
-	return timelinePosts;
+	log(INFO, "Converted " + to_string(numUsers) + " users and " + to_string(numPosts) + " posts "
+		"in " + TOP_LEVEL_DIR + "/" + localPath + " to the binary log format.");
+	return 0;
+}
+
+/*
+	Blocks until the record with ticket is persisted to the configured
+	durability. Returns INTERNAL if it wasn't: the log has failed and
+	stays failed, so the caller replies with it and replicates nothing.
+*/
+Status SNSServer::waitDurable(WriteAheadLog &wal, uint64_t ticket)
+{
+	// applyBatch waits for the whole batch
+	if(currentBatch != NULL) {
+		return Status::OK;
+	}
+
+	if(wal.wait(ticket) == -1) {
+		log(ERROR, "Failed to persist record " + to_string(ticket) + " to local log");
+		return Status(grpc::StatusCode::INTERNAL, "Failed to persist the request to the local log");
+	}
+	return Status::OK;
+}
+
+/*
+	Returns the LSN to write a record under. A master numbers its own
+	records. A slave writes the LSN its master gave the operation, so both
+	have it under the same LSN, or 0 if the operation came without one.
+*/
+uint64_t SNSServer::assignLsn(uint64_t given)
+{
+	if(master) {
+		return ++lastLsn;
+	}
+	raiseLsn(given);
+	return given;
 }
 
-// WRITE DATA TO LOCAL FILE
-void SNSServer::write(string &file, string &data)
+// A slave that becomes master continues after the highest LSN it has
+void SNSServer::raiseLsn(uint64_t lsn)
 {
-	// Note: when using a string &reference, you cannot perform
-	// string concatenation in the function call. Ex. func(a + b);
+	if(!master && lsn != 0) {
+		heldLsns.add(lsn);
+	}
 
-	filesys->write(file, data, false, false);
+	uint64_t last = lastLsn;
+	while(lsn > last && !lastLsn.compare_exchange_weak(last, lsn)) {
+	}
 }
 
 // ---- REPLICATION HELPERS ----
@@ -451,136 +980,368 @@ void SNSServer::write(string &file, string &data)
 	These helper methods assume that the input is valid
 */
 
-void SNSServer::loginHelper(string user)
+// Returns the id of user. With writeToFile, a new user is recorded in userinfo.
+UserId SNSServer::loginHelper(const string &user, bool writeToFile, uint64_t lsn)
 {
-	shared_ptr<Client> client = getClient(user, true);
+	uint64_t ticket;
+	shared_ptr<Client> client = getClient(user, true, writeToFile ? &lsn : NULL, &ticket);
+
+	ShardLocks::WriteGuard lock = locks.write(client->id);
 	client->connected = true;
-	client_db.push_back(client);
+	return client->id;
 }
 
-void SNSServer::followHelper(string user1, string user2, string timestampStr)
+void SNSServer::followHelper(UserId follower, UserId followee, int64_t timeNanos, bool writeToFile, uint64_t lsn)
 {
-	shared_ptr<Client> client = getClient(user1);
-	shared_ptr<Client> toFollow = getClient(user2);
-	Timestamp t = strToTimestamp(timestampStr);
-
-	client->client_following.push_back(toFollow);
-	client->follow_time.push_back(t);
-	toFollow->client_followers.push_back(client);
+	shared_ptr<Client> client = getClient(follower);
+	shared_ptr<Client> toFollow = getClient(followee);
+
+	ShardLocks::PairGuard lock = locks.writePair(client->id, toFollow->id);
+	if(client->client_following.insert(toFollow->id, timeNanos)) {
+		toFollow->client_followers.insert(client->id, timeNanos);
+		if(writeToFile) {
+			string data;
+			LogFormat::encodeFollow(data, assignLsn(lsn), follower, followee, timeNanos);
+			userinfoLog->append(data);
+		}
+	}
 }
 
-void SNSServer::unfollowHelper(string user1, string user2)
+void SNSServer::unfollowHelper(UserId follower, UserId followee, bool writeToFile, uint64_t lsn)
 {
-	shared_ptr<Client> client = getClient(user1);
-	shared_ptr<Client> toUnFollow = getClient(user2);
-
-	vector<shared_ptr<Client>> *clientFollowing = &client->client_following;
-	vector<Timestamp> *clientFollowTimes = &client->follow_time;
-	vector<shared_ptr<Client>> *targetFollowers = &toUnFollow->client_followers;
-
-	int index = indexOfFollowing(client, toUnFollow);
-	int index2 = indexOfFollower(toUnFollow, client);
+	shared_ptr<Client> client = getClient(follower);
+	shared_ptr<Client> toUnFollow = getClient(followee);
+
+	ShardLocks::PairGuard lock = locks.writePair(client->id, toUnFollow->id);
+	if(client->client_following.erase(toUnFollow->id)) {
+		toUnFollow->client_followers.erase(client->id);
+		dropFromInbox(client, toUnFollow->id);
+		if(writeToFile) {
+			string data;
+			LogFormat::encodeUnfollow(data, assignLsn(lsn), follower, followee);
+			userinfoLog->append(data);
+		}
+	}
+}
 
-	clientFollowing->erase(clientFollowing->begin() + index);
-	clientFollowTimes->erase(clientFollowTimes->begin() + index);
-	targetFollowers->erase(targetFollowers->begin() + index2);
+uint64_t SNSServer::addPostHelper(const Message &message, shared_ptr<Client> client, uint64_t &lsn)
+{
+	return addPostHelper(client, PostStore::toNanos(message.timestamp()), message.msg(), true, &message, lsn);
 }
 
-void SNSServer::addPostHelper(const Message &message, shared_ptr<Client> client, bool writeToFile)
+/*
+	Stores a post and fans it out to follower inboxes. If message is
+	given it is also queued to the streams of followers in timeline mode.
+	Replay passes no message, since no streams exist yet.
+*/
+uint64_t SNSServer::addPostHelper(shared_ptr<Client> client, int64_t timeNanos, string_view content,
+								bool writeToFile, const Message *message, uint64_t &lsn)
 {
 	// Don't write to you own stream
 
-	// Store message in list
-	shared_ptr<Post> p = make_shared<Post>(message);
-	all_posts.push_back(p);
+	uint64_t ticket = 0;
+
+	PostId postId;
+	bool pushed;
+	vector<FollowEdge> followers;
+	{
+		// Posts by one author are stored in order under the author's lock
+		ShardLocks::WriteGuard lock = locks.write(client->id);
 
-	// Write message to file
-	string data = formatMessageOutput(message);
-	if(writeToFile) {
-		write(postsPath, data);
+		// Authors with many followers are pulled on read instead of pushed
+		pushed = client->client_followers.size() < fanoutThreshold;
+
+		// Store message in list
+		postId = all_posts.append(client->id, timeNanos, content, pushed);
+
+		if(!pushed) {
+			client->pulled_posts.push_back(postId);
+			client->hasPulledPosts = true;
+		}
+
+		followers.assign(client->client_followers.begin(), client->client_followers.end());
+
+		// Write message to file, in the author's post order
+		if(writeToFile) {
+			lsn = assignLsn(lsn);
+			string data;
+			LogFormat::encodePost(data, lsn, client->id, timeNanos, content);
+			ticket = postsLog->append(data);
+		}
 	}
 
-	// Write to all followers streams if they exist
+	// Fan out to the inbox of every follower who followed before the post was made,
+	// and queue the post for all followers streams if they exist.
+	// Queuing never waits on the network; each stream has its own writer.
 	// If you are a slave, no client streams eixst
-	for(shared_ptr<Client> follower : client->client_followers) {
-		
-		// Only write to stream if follower has joined the timeline
-		if(!(follower->stream == NULL)) {
-			follower->stream->Write(message);
+
+	// Visit followers shard by shard so each shard is locked once
+	sort(followers.begin(), followers.end(), [](const FollowEdge &a, const FollowEdge &b) {
+		return ShardLocks::shardOf(a.user) < ShardLocks::shardOf(b.user);
+	});
+
+	vector<shared_ptr<TimelineSubscriber>> subscribers;
+	ShardLocks::WriteGuard lock;
+	int lockedShard = -1;
+	for(const FollowEdge &edge : followers) {
+		if(ShardLocks::shardOf(edge.user) != lockedShard) {
+			if(lock.owns_lock()) {
+				lock.unlock();
+			}
+			lockedShard = ShardLocks::shardOf(edge.user);
+			lock = locks.write(edge.user);
+		}
+		shared_ptr<Client> follower = client_db[edge.user];
+
+		if(pushed && timeNanos > edge.timeNanos) {
+			follower->inbox.push(postId);
 		}
+
+		// Only queue if follower has joined the timeline
+		if(message != NULL && follower->subscriber != NULL) {
+			subscribers.push_back(follower->subscriber);
+		}
+	}
+	if(lock.owns_lock()) {
+		lock.unlock();
 	}
+
+	if(!subscribers.empty()) {
+		shared_ptr<const Message> outbound = make_shared<Message>(*message);
+		for(shared_ptr<TimelineSubscriber> &subscriber : subscribers) {
+			subscriber->enqueue(outbound);
+		}
+	}
+
+	return ticket;
 }
 
-// Uses the client API helpers to process input from file
-void SNSServer::processUserInfoFromFile(string filedata, bool save)
+// Replays our own userinfo and posts logs, and logs how fast they were read
+void SNSServer::replayLogs(LogLoader &userinfo, LogLoader &posts)
 {
-	stringstream ss(filedata);
-	string s;
-
-	while(getline(ss, s, '\n')) {
-		vector<string> args = split(s);
-		string op = args[0];
+	vector<UserId> userMap;
+	processUserInfoFromFile(userinfo, false, userMap);
+	updatePostsFromFile(posts, false, userMap);
+	log(INFO, "Replayed userinfo log: " + userinfo.stats() + ". Posts log: " + posts.stats());
+}
 
-		string methodStr;
-		Request r;
-		if(op == USER) {
-			loginHelper(args[1]);
-		} else if(op == FOLLOW) {
-			followHelper(args[1], args[2], args[3]);
-		} else if(op == UNFOLLOW) {
-			unfollowHelper(args[1], args[2]);
+/*
+	Replays an encoded userinfo log through the replication helpers.
+	userMap maps the user ids of the server that wrote the log to ours,
+	and is filled here for updatePostsFromFile. With save, every record
+	that changed our state is written back to our own log under our ids
+	and, if this server is a slave, under the record's LSN. Without save
+	the log is our own, and lastLsn is raised to the LSNs in it.
+	A checkpoint at the start of the log replays like any other records.
+	Returns the number of records replayed.
+*/
+int SNSServer::processUserInfoFromFile(RecordSource &reader, bool save, vector<UserId> &userMap)
+{
+	auto mapped = [&userMap](UserId id) {
+		return (id >= 0 && id < (int)userMap.size()) ? userMap[id] : INVALID_USER;
+	};
+
+	int count = 0;
+	LogRecord record;
+	int ret;
+	while((ret = reader.next(record)) == 1) {
+		if(!save) {
+			raiseLsn(record.lsn);
 		}
 
-		// Write the line back to our own current file
-		if(save) {
-			s += "\n";
-			write(userinfoPath, s);
+		if(record.type == RECORD_USER) {
+			if(record.user < 0) {
+				continue;
+			}
+			if(record.user >= (int)userMap.size()) {
+				userMap.resize(record.user + 1, INVALID_USER);
+			}
+			userMap[record.user] = loginHelper(string(record.text), save, record.lsn);
+		} else if(record.type == RECORD_FOLLOW || record.type == RECORD_UNFOLLOW) {
+			UserId follower = mapped(record.user);
+			UserId followee = mapped(record.target);
+			if(follower == INVALID_USER || followee == INVALID_USER) {
+				log(WARNING, "Skipping userinfo record for an unknown user at offset " + to_string(reader.offset()));
+				continue;
+			}
+			if(record.type == RECORD_FOLLOW) {
+				followHelper(follower, followee, record.timeNanos, save, record.lsn);
+			} else {
+				unfollowHelper(follower, followee, save, record.lsn);
+			}
+		} else if(record.type == RECORD_CHECKPOINT) {
+			// The LSNs a checkpoint replaced are held, except those it lists as missing
+			if(!master) {
+				heldLsns.addThrough(record.lsn);
+				for(uint64_t lsn : LogFormat::missingLsns(record)) {
+					heldLsns.erase(lsn);
+				}
+			}
+
+			if(!save) {
+				checkpointLength = reader.offset();
+			} else if(!master) {
+				// A slave keeps its master's checkpoint, which stands for the LSNs it replaced
+				string data;
+				LogFormat::encode(data, record);
+				userinfoLog->append(data);
+				raiseLsn(record.lsn);
+			}
+		} else if(record.type == RECORD_APPLIED) {
+			// Another server's queues say nothing of what we applied
+			if(!save) {
+				lock_guard<mutex> lock(appliedMtx);
+				AppliedQueue &applied = appliedQueues[record.queue];
+				applied.seq = max(applied.seq, record.seq);
+				applied.lastBatch = ++numAppliedBatches;
+				trimAppliedQueues();
+			}
 		}
+		count++;
+	}
+
+	// A torn record at the end is what a crash mid-write leaves behind
+	if(ret == -1) {
+		log(WARNING, "Userinfo log is truncated or corrupt at offset " + to_string(reader.offset()) + ". Ignoring the rest.");
 	}
+	return count;
 }
 
-void SNSServer::updatePostsFromFile(string filedata, bool save)
+// Replays an encoded posts log. See processUserInfoFromFile.
+int SNSServer::updatePostsFromFile(RecordSource &reader, bool save, const vector<UserId> &userMap)
 {
-	// Posts in file will always follow the format:
-	// T <timestamp>
-	// U <username>
-	// W <post content>
-	// newline
+	int count = 0;
+	LogRecord record;
+	int ret;
+	while((ret = reader.next(record)) == 1) {
+		if(record.type != RECORD_POST) {
+			continue;
+		}
+		if(!save) {
+			raiseLsn(record.lsn);
+		}
 
-	// post content not allowed to contain newlines
+		UserId author = (record.user >= 0 && record.user < (int)userMap.size()) ? userMap[record.user] : INVALID_USER;
+		if(author == INVALID_USER) {
+			log(WARNING, "Skipping post by an unknown user at offset " + to_string(reader.offset()));
+			continue;
+		}
 
-	// Method from filesystem_utils.h.
-	// TODO: would be nice to have my own lib of c++ utils
-	vector<string> postTokens = splitString(filedata, "\n\n");
-	for(string token : postTokens) {
+		// Content goes straight from the buffer into the post store
+		addPostHelper(getClient(author), record.timeNanos, record.text, save, NULL, record.lsn);
+		count++;
+	}
+
+	if(ret == -1) {
+		log(WARNING, "Posts log is truncated or corrupt at offset " + to_string(reader.offset()) + ". Ignoring the rest.");
+	}
+	return count;
+}
 
-		vector<string> postParts = splitString(token, "\n");
-		
-		// May contain a dangling empty string at the end
-		if(postParts.size() > 0) {
-			Timestamp *timestamp = strToAllocatedTimestamp(postParts[0].substr(2));
-			string username = postParts[1].substr(2);
-			shared_ptr<Client> client = getClient(username);
-			string content = postParts[2].substr(2);
+/*
+	Fills request with what this server's own logs hold, so its master can
+	send just the rest: the highest LSN in them, that record's fingerprint,
+	and every lower LSN they lack. Returns false and leaves request empty,
+	asking for a full snapshot, if the logs are unreadable, hold no
+	numbered records, or lack more than MAX_MISSING_LSNS records.
+*/
+bool SNSServer::describeLogs(string_view userinfo, string_view posts, SiblingRequest &request)
+{
+	vector<string_view> names;	// by the user ids in the logs
+	vector<bool> present;		// by LSN
+	LogRecord last{};
+	bool found = false;
+	uint64_t covered = 0;		// LSN of our checkpoint
+	unordered_set<uint64_t> coveredMissing;
 
-			Message message;
+	for(string_view data : {userinfo, posts}) {
+		LogReader reader(data);
+		if(!reader.valid() || reader.version() != LogFormat::VERSION) {
+			return false;
+		}
 
-			// set_allocated_* takes ownership of pointer and deletes it when done with it
-			message.set_allocated_timestamp(timestamp);
-			message.set_username(username);
-			message.set_msg(content);
+		LogRecord record;
+		while(reader.next(record) == 1) {
+			if(record.type == RECORD_USER && record.user >= 0) {
+				if(record.user >= (int)names.size()) {
+					names.resize(record.user + 1);
+				}
+				names[record.user] = record.text;
+			}
+			if(record.type == RECORD_CHECKPOINT) {
+				covered = record.lsn;
+				vector<uint64_t> lsns = LogFormat::missingLsns(record);
+				coveredMissing = unordered_set<uint64_t>(lsns.begin(), lsns.end());
+			}
+			if(record.lsn == 0) {
+				continue;
+			}
+			if(record.lsn >= present.size()) {
+				present.resize(max((size_t)record.lsn + 1, present.size() * 2));
+			}
+			present[record.lsn] = true;
+			if(!found || record.lsn > last.lsn) {
+				last = record;
+				found = true;
+			}
+		}
+	}
+	if(!found) {
+		return false;
+	}
 
-			addPostHelper(message, client, save);
+	vector<uint64_t> missing;
+	for(uint64_t lsn = 1; lsn < last.lsn; lsn++) {
+		// Our checkpoint replaced the records it covers that we had
+		if(!present[lsn] && (lsn > covered || coveredMissing.count(lsn) > 0)) {
+			if((int)missing.size() == MAX_MISSING_LSNS) {
+				log(INFO, "Local logs lack more than " + to_string(MAX_MISSING_LSNS) + " records below LSN " + to_string(last.lsn));
+				return false;
+			}
+			missing.push_back(lsn);
 		}
 	}
+
+	auto nameOf = [&names](UserId id) {
+		return (id >= 0 && id < (int)names.size()) ? names[id] : string_view();
+	};
+	request.set_last_lsn(last.lsn);
+	request.set_last_fingerprint(LogFormat::fingerprint(last, nameOf(last.user), nameOf(last.target)));
+	for(uint64_t lsn : missing) {
+		request.add_missing_lsns(lsn);
+	}
+	return true;
 }
 
-void SNSServer::propogateHelper(string method, const Request &request, string destination) 
+/*
+	Returns the servers to replicate to for destination. The list is only
+	requested from the coordinator when the cached one is older than the
+	topology version reported by the latest heartbeat, so the coordinator
+	sees a request per topology change instead of one per write.
+
+	The request is made without topologyMtx, so writes to destinations
+	that are cached never wait on the coordinator. Threads that miss at
+	the same time each fetch, and the result is only stored if nothing
+	newer or an invalidation was stored meanwhile.
+*/
+ServerList SNSServer::getTopology(const string &destination)
 {
+	// Read before fetching, so a change during the fetch causes another
+	uint64_t version = topologyVersion;
+	uint64_t generation;
+	{
+		lock_guard<mutex> lock(topologyMtx);
+		Topology &cached = topology[destination];
+		if(cached.valid && cached.version == version) {
+			return cached.servers;
+		}
+		generation = cached.generation;
+	}
+
 	ClientContext context;
 	ServerList serverList;
 	Status status;
-	
+
 	if(destination == COUNTERPARTS) {
 		status = coordStub_->GetCounterparts(&context, serverInfo, &serverList);
 	} else if(destination == OTHER_MASTERS) {
@@ -594,54 +1355,201 @@ void SNSServer::propogateHelper(string method, const Request &request, string de
 		log(FATAL, "Request to coordinator for " + destination + " failed!");
 	}
 
-	// Not sure if creating stubs each time will have a big performance impact
-	for(const ServerInfo &s : serverList.servers()) {
+	lock_guard<mutex> lock(topologyMtx);
+	Topology &cached = topology[destination];
+	if(cached.generation == generation && (!cached.valid || cached.version <= version)) {
+		cached.valid = true;
+		cached.version = version;
+		cached.servers = serverList;
+		log(INFO, "Fetched " + to_string(serverList.servers_size()) + " " + destination + " at topology version " + to_string(version));
+	}
+	return serverList;
+}
 
-		string addr = s.hostname() + ":" + s.port();
-		shared_ptr<Channel> slaveChannel = grpc::CreateChannel(addr, grpc::InsecureChannelCredentials());
-		unique_ptr<SNSService::Stub> slaveStub_ = make_unique<SNSService::Stub>(slaveChannel);
+// Forces the next propogation to each destination to refetch its servers
+void SNSServer::invalidateTopology()
+{
+	lock_guard<mutex> lock(topologyMtx);
+	for(auto &entry : topology) {
+		entry.second.valid = false;
+		entry.second.generation++;
+	}
+}
 
-		ClientContext slaveContext;
-		Reply reply;
-		Status status;
-
-		if(method == LOGIN) {
-			status = slaveStub_->Login(&slaveContext, request, &reply);
-		} else if(method == FOLLOW) {
-			status = slaveStub_->Follow(&slaveContext, request, &reply);
-		} else if(method == UNFOLLOW) {
-			status = slaveStub_->UnFollow(&slaveContext, request, &reply);
-		} else if(method == ADD_POST) {
-			status = slaveStub_->AddPost(&slaveContext, request, &reply);
-		} else {
-			// sanity check: invalid option
-			log(FATAL, "Invalid replication method!");
-			return;
+/*
+	The other masters this one forwards request to. Without a tree degree
+	only the origin forwards, to every other master. With a tree degree d,
+	the origin ranks the masters in cluster order starting at itself and
+	records the ranking in request. Rank r forwards to ranks d*r+1 through
+	d*r+d of that ranking, so each write reaches each ranked master once
+	even while masters hold different topology versions, and the origin
+	sends at most d copies. A child whose master this one doesn't know of
+	is skipped for its own children, so its subtree still gets the write.
+*/
+vector<string> SNSServer::treeChildren(const ServerList &masters, Request &request)
+{
+	int self = serverInfo.clusterid();
+
+	map<int, string> byCluster;
+	for(const ServerInfo &s : masters.servers()) {
+		byCluster[s.clusterid()] = s.hostname() + ":" + s.port();
+	}
+
+	// The origin has no ranking yet
+	vector<string> addrs;
+	if(request.origin_cluster() == self && request.tree_size() == 0) {
+		if(masters.tree_degree() == 0) {
+			for(auto &entry : byCluster) {
+				addrs.push_back(entry.second);
+			}
+			return addrs;
+		}
+
+		// Ours isn't listed, and comes first
+		request.add_tree(self);
+		for(auto it = byCluster.upper_bound(self); it != byCluster.end(); it++) {
+			request.add_tree(it->first);
+		}
+		for(auto it = byCluster.begin(); it != byCluster.end() && it->first < self; it++) {
+			request.add_tree(it->first);
 		}
+		request.set_tree_degree(masters.tree_degree());
+	}
+
+	const auto &tree = request.tree();
+	size_t degree = request.tree_degree();
+	size_t rank = find(tree.begin(), tree.end(), self) - tree.begin();
+	if(degree == 0 || rank == (size_t)tree.size()) {
+		return addrs;
+	}
 
-		// TODO: No handling of error status right now
-		// Ideally, fail if propogation fails and retry
+	vector<size_t> children;
+	for(size_t child = degree * rank + 1; child <= degree * rank + degree; child++) {
+		children.push_back(child);
+	}
+	while(!children.empty()) {
+		size_t child = children.back();
+		children.pop_back();
+		if(child >= (size_t)tree.size()) {
+			continue;
+		}
+
+		auto it = byCluster.find(tree[child]);
+		if(it != byCluster.end()) {
+			addrs.push_back(it->second);
+			continue;
+		}
+		for(size_t grandchild = degree * child + 1; grandchild <= degree * child + degree; grandchild++) {
+			children.push_back(grandchild);
+		}
+	}
+	return addrs;
+}
 
-		log(INFO, "Sent " + method + " request to " + addr);
+// The ack policy a request asked for, or this server's if it asked for none
+Replicator::AckPolicy SNSServer::ackPolicyOf(const Request &request)
+{
+	switch(request.ack_policy()) {
+		case Request::ACK_NONE:
+			return Replicator::ACK_NONE;
+		case Request::ACK_QUORUM:
+			return Replicator::ACK_QUORUM;
+		case Request::ACK_ALL:
+			return Replicator::ACK_ALL;
+		default:
+			return ackPolicy;
 	}
 }
 
-void SNSServer::propogate(string method, const Request *request) {
+shared_ptr<Replicator::Ack> SNSServer::propogateHelper(string method, Request &request, string destination) 
+{
+	ServerList serverList = getTopology(destination);
+
+	vector<string> addrs;
+	for(const ServerInfo &s : serverList.servers()) {
+		addrs.push_back(s.hostname() + ":" + s.port());
+	}
+
+	// Servers the coordinator no longer lists for this destination are evicted
+	replicator->retain(destination, addrs);
+
+	if(destination == OTHER_MASTERS) {
+		addrs = treeChildren(serverList, request);
+	}
+
+	/*
+		A majority of the local cluster includes this server, so a quorum
+		of n counterparts is (n + 1) / 2 of them. Other cluster masters
+		are only waited for under ACK_ALL.
+	*/
+	Replicator::AckPolicy policy = ackPolicyOf(request);
+	int needed = 0;
+	if(policy == Replicator::ACK_ALL) {
+		needed = addrs.size();
+	} else if(policy == Replicator::ACK_QUORUM && destination == COUNTERPARTS) {
+		needed = (addrs.size() + 1) / 2;
+	}
+
+	Operation::Type type;
+	if(method == LOGIN) {
+		type = Operation::LOGIN;
+	} else if(method == FOLLOW) {
+		type = Operation::FOLLOW;
+	} else if(method == UNFOLLOW) {
+		type = Operation::UNFOLLOW;
+	} else if(method == ADD_POST) {
+		type = Operation::ADD_POST;
+	} else {
+		// sanity check: invalid option
+		log(FATAL, "Invalid replication method!");
+		return NULL;
+	}
+
+	return replicator->send(type, request, destination, addrs, needed);
+}
+
+// lsn is the LSN the request's record was written under, 0 if it wrote none
+void SNSServer::propogate(string method, const Request *request, uint64_t lsn) {
 	
 	// Any propogation only occurs if you are a master
-	if(master) {
+	if(!master) {
+		return;
+	}
+
+	Request newRequest;
+	newRequest.CopyFrom(*request);
+	newRequest.set_from_server(true);
+	newRequest.set_lsn(lsn);
+	if(!request->from_server()) {
+		newRequest.set_origin_cluster(serverInfo.clusterid());
+		if(request->ack_policy() == Request::ACK_DEFAULT) {
+			newRequest.set_ack_policy(ackPolicy == Replicator::ACK_ALL ? Request::ACK_ALL :
+									  ackPolicy == Replicator::ACK_QUORUM ? Request::ACK_QUORUM : Request::ACK_NONE);
+		}
+	}
 
-		Request newRequest;
-		newRequest.CopyFrom(*request);
-		newRequest.set_from_server(true);
+	// Counterparts and other masters are sent to concurrently
 
-		// If you are a master, you always propogate to slaves
-		propogateHelper(method, newRequest, COUNTERPARTS);
+	// If you are a master, you always propogate to slaves, except a login
+	// that wrote no record. It changes nothing there, and as it doesn't
+	// wait for the log it could overtake the login that did.
+	vector<shared_ptr<Replicator::Ack>> acks;
+	if(method != LOGIN || lsn != 0) {
+		acks.push_back(propogateHelper(method, newRequest, COUNTERPARTS));
+	}
+
+	// If the request is from a client, propogate to other cluster masters.
+	// from_server is only set by servers. A request from another master
+	// is passed on to this one's children if the masters form a tree.
+	if(!request->from_server() || newRequest.tree_size() > 0) {
+		acks.push_back(propogateHelper(method, newRequest, OTHER_MASTERS));
+	}
 
-		// If the request is from a client, propogate to other cluster masters
-		// from_server is only set by servers
-		if(!request->from_server()) {
-			propogateHelper(method, newRequest, OTHER_MASTERS);
+	for(shared_ptr<Replicator::Ack> ack : acks) {
+		if(currentBatch != NULL) {
+			currentBatch->acks.push_back({method, ack});
+		} else {
+			waitForAck(method, ack);
 		}
 	}
 }
@@ -661,31 +1569,39 @@ Status SNSServer::Login(ServerContext* context, const Request* request, Reply* r
 {
 	// Guaranteed to be non-null because method returns a new Client
 	// with provided username if one is not found
-	shared_ptr<Client> client = getClient(request->username(), true);
+	// A new client's USER record is written as its id is assigned
+	uint64_t ticket = 0;
+	uint64_t lsn = request->lsn();
+	shared_ptr<Client> client = getClient(request->username(), true, &lsn, &ticket);
 
 	SNSStatus status = SUCCESS;
 	string message;
 
 	// If client disconnects, it still exists in server memory
 	// Allow reconnecting.
+	ShardLocks::WriteGuard lock = locks.write(client->id);
 	if(client->connected) {
 		message = "Welcome back, " + request->username();
 	} else {
 		client->connected = true;
-		client_db.push_back(client);
 		message = "User " + request->username() + " successfully logged in!";
+	}
+	lock.unlock();
 
-		string data = USER + " " + request->username() + "\n";
-		write(userinfoPath, data);
+	if(ticket != 0) {
+		Status durable = waitDurable(*userinfoLog, ticket);
+		if(!durable.ok()) {
+			return durable;
+		}
 	}
 
 	reply->set_status(status);
 	reply->set_msg(message);
 
 	/* Replicate */
-	log(INFO, "Received login command for user " + client->username);
+	log(INFO, "Received login command for user " + request->username());
 	
-	propogate(LOGIN, request);
+	propogate(LOGIN, request, lsn);
 	
 	// TODO: Log login command
 	
@@ -702,6 +1618,8 @@ Status SNSServer::Follow(ServerContext* context, const Request* request, Reply*
 
 	SNSStatus status = SUCCESS;
 	string message;
+	uint64_t ticket = 0;
+	uint64_t lsn = 0;
 
 	if(toFollow == NULL) {
 
@@ -717,21 +1635,32 @@ Status SNSServer::Follow(ServerContext* context, const Request* request, Reply*
 
 	} else {
 
-		int index = indexOfFollowing(client, toFollow);
+		// The userinfo line is written under the lock so the file
+		// records follows and unfollows in the order they were applied
+		ShardLocks::PairGuard lock = locks.writePair(client->id, toFollow->id);
+
 		// You already follow this user
-		if(index >= 0) {
+		if(client->client_following.contains(toFollow->id)) {
 			status = FAILURE_ALREADY_EXISTS;
 			message = "You already follow this user";
 		} else {
-			client->client_following.push_back(toFollow);
-			client->follow_time.push_back(t);
-			toFollow->client_followers.push_back(client);
+			int64_t timeNanos = PostStore::toNanos(t);
+			client->client_following.insert(toFollow->id, timeNanos);
+			toFollow->client_followers.insert(client->id, timeNanos);
 
-			string timeStr = timestampToStr(t);
-			string data = FOLLOW + " " + client->username + " " + toFollow->username + " " + timeStr + "\n";
-			write(userinfoPath, data);
+			lsn = assignLsn(request->lsn());
+			string data;
+			LogFormat::encodeFollow(data, lsn, client->id, toFollow->id, timeNanos);
+			ticket = userinfoLog->append(data);
+
+			message = "Successfully followed " + users.name(toFollow->id);
+		}
+	}
 
-			message = "Successfully followed " + toFollow->username;
+	if(ticket != 0) {
+		Status durable = waitDurable(*userinfoLog, ticket);
+		if(!durable.ok()) {
+			return durable;
 		}
 	}
 
@@ -739,9 +1668,9 @@ Status SNSServer::Follow(ServerContext* context, const Request* request, Reply*
 	reply->set_msg(message);
 
 	// REPLICATION
-	log(INFO, "Received follow request from " + client->username + " for " + toFollow->username + ": " + message);
+	log(INFO, "Received follow request from " + request->username() + " for " + request->arguments()[0] + ": " + message);
 	
-	propogate(FOLLOW, request);
+	propogate(FOLLOW, request, lsn);
 
 	return Status::OK; 
 }
@@ -753,6 +1682,8 @@ Status SNSServer::UnFollow(ServerContext* context, const Request* request, Reply
 
 	SNSStatus status = SUCCESS;
 	string message;
+	uint64_t ticket = 0;
+	uint64_t lsn = 0;
 
 	if(toUnFollow == NULL) {
 
@@ -766,35 +1697,39 @@ Status SNSServer::UnFollow(ServerContext* context, const Request* request, Reply
 
 	} else {
 
-		int index = indexOfFollowing(client, toUnFollow);
-		if(index < 0) { 
+		ShardLocks::PairGuard lock = locks.writePair(client->id, toUnFollow->id);
+
+		if(!client->client_following.contains(toUnFollow->id)) {
 			status = FAILURE_NOT_A_FOLLOWER;
 			message = "You already do not follow this user...";
 		} else {
-			vector<shared_ptr<Client>> *clientFollowing = &client->client_following;
-			vector<Timestamp> *clientFollowTimes = &client->follow_time;
-			vector<shared_ptr<Client>> *targetFollowers = &toUnFollow->client_followers;
+			client->client_following.erase(toUnFollow->id);
+			toUnFollow->client_followers.erase(client->id);
+			dropFromInbox(client, toUnFollow->id);
 
-			int index2 = indexOfFollower(toUnFollow, client);
+			lsn = assignLsn(request->lsn());
+			string data;
+			LogFormat::encodeUnfollow(data, lsn, client->id, toUnFollow->id);
+			ticket = userinfoLog->append(data);
 
-			clientFollowing->erase(clientFollowing->begin() + index);
-			clientFollowTimes->erase(clientFollowTimes->begin() + index);
-			targetFollowers->erase(targetFollowers->begin() + index2);
+			message = "Successfully unfollowed user " + users.name(toUnFollow->id);
+		}
 
-			string data = UNFOLLOW + " " + client->username + " " + toUnFollow->username + "\n";
-			write(userinfoPath, data);
+	}
 
-			message = "Successfully unfollowed user " + toUnFollow->username;
+	if(ticket != 0) {
+		Status durable = waitDurable(*userinfoLog, ticket);
+		if(!durable.ok()) {
+			return durable;
 		}
-
 	}
 
 	reply->set_msg(message);
 	reply->set_status(status);
 
-	log(INFO, "Received unfollow request from " + client->username + " for " + toUnFollow->username + ": " + message);
+	log(INFO, "Received unfollow request from " + request->username() + " for " + request->arguments()[0] + ": " + message);
 	
-	propogate(UNFOLLOW, request);
+	propogate(UNFOLLOW, request, lsn);
 
 	return Status::OK; 
 }
@@ -803,23 +1738,23 @@ Status SNSServer::List(ServerContext* context, const Request* request, ListReply
 {
 	shared_ptr<Client> client = getClient(request->username());
 
-	int numUsers = (int)client_db.size();
+	int numUsers = users.size();
 	for(int i = 0; i < numUsers; i++) {
-		list_reply->add_all_users(client_db[i]->username);
+		list_reply->add_all_users(users.name(i));
 	}
 
-	int numFollowers = (int)client->client_followers.size();
-	for(int i = 0; i < numFollowers; i++) {
-		list_reply->add_followers(client->client_followers[i]->username);
+	ShardLocks::ReadGuard lock = locks.read(client->id);
+	for(const FollowEdge &edge : client->client_followers) {
+		list_reply->add_followers(users.name(edge.user));
 	}
 
-	int numFollowing = (int)client->client_following.size();
-	for(int i = 0; i < numFollowing; i++) {
-		list_reply->add_following(client->client_following[i]->username);
+	for(const FollowEdge &edge : client->client_following) {
+		list_reply->add_following(users.name(edge.user));
 	}
+	lock.unlock();
 
 	// TODO: Log command
-	log(INFO, "Received list request from " + client->username);
+	log(INFO, "Received list request from " + request->username());
 	return Status::OK;
 }
 
@@ -827,80 +1762,185 @@ Status SNSServer::Timeline(ServerContext* context, ServerReaderWriter<Message, M
 {
 	// https://grpc.io/docs/languages/cpp/basics/
 	Message message;
+	shared_ptr<Client> owner = NULL;
+	shared_ptr<TimelineSubscriber> subscriber = NULL;
+	Status status = Status::OK;
 
 	while (stream->Read(&message)) {
-		
-		const Timestamp &t = message.timestamp();
-		const string &u = message.username();
-		const string &m = message.msg();
 
 		// If you do this inside the while loop,
 		// the current client doesn't start receiving 
 		// messages until after it writes its first message
-		shared_ptr<Client> client = getClient(u);
-		if(client->stream == NULL) {
-			
-
-			log(INFO, "Entering timeline with " + client->username);
-	
-			// Upon joining the timeline, user sends an initial empty message
-			// to indicate that this stream belongs to it. Don't write this
-			// message to the timeline, and simply set the client's stream.
-			client->stream = stream;
-			vector<shared_ptr<Post>> timelinePosts = getFollowingPosts(client, 20);
-
-			// According to testcases, these should be printed in reverse chronological order
-			for(shared_ptr<Post> post : timelinePosts) {
-				
-				Message messageToSend;
-				messageToSend.set_username(post->username);
-				messageToSend.set_msg(post->data);
-
-				// set_allocated_* takes ownership then deletes
-				Timestamp* allocatedTimestamp = new google::protobuf::Timestamp(post->timestamp);
-				messageToSend.set_allocated_timestamp(allocatedTimestamp);
-
-				stream->Write(messageToSend);
-			}
-
+		if(subscriber == NULL) {
+			// All writes to this stream go through the subscriber's writer thread.
+			subscriber = make_shared<StreamSubscriber>(context, stream, sendQueueCapacity, overflowPolicy);
+			owner = joinTimeline(message, subscriber);
 		} else {
-
-			// Empty posts are not allowed, but there is a possibility
-			// where an empty message to initialize the stream but the
-			// stream already exists. Ignore this empty message
-			if(m != "") {
-				addPostHelper(message, client);
-
-				// TODO: Propogate post to slaves
-				if(master) {
-					Request request;
-					Message* toPropogate = new Message();
-					toPropogate->CopyFrom(message); // Copy message
-
-					// Transfer ownership
-					request.set_allocated_message(toPropogate);
-					propogate(ADD_POST, &request);
-				}
+			// A post that can't be persisted ends the stream
+			status = postToTimeline(message);
+			if(!status.ok()) {
+				break;
 			}
 		}
 	}
 
+	// The stream is done. Stop its writer before gRPC releases the stream.
+	if(subscriber != NULL) {
+		leaveTimeline(owner, subscriber);
+	}
+
+	return status;
+}
+
+/*
+	Timeline stream steps shared by the sync service above and SNSCallbackService.
+	Each stream owns one subscriber; the stream is responsible for draining it.
+*/
+
+shared_ptr<Client> SNSServer::joinTimeline(const Message &message, shared_ptr<TimelineSubscriber> subscriber)
+{
+	const string &u = message.username();
+	shared_ptr<Client> client = getClient(u);
+
+	vector<PostId> timelinePosts = getTimelinePosts(client);
+
+	string entering = 
+	"Entering timeline with " + u + ". "
+	"Timeline reads from inbox: " + to_string(inboxReads) + ", "
+	"merged with pulled authors: " + to_string(mergedReads);
+	log(INFO, entering);
+
+	// Upon joining the timeline, user sends an initial empty message
+	// to indicate that this stream belongs to it. Don't write this
+	// message to the timeline, and simply set the client's subscriber.
+
+	// According to testcases, these should be printed in reverse chronological order
+	for(PostId postId : timelinePosts) {
+
+		shared_ptr<Message> messageToSend = make_shared<Message>();
+		messageToSend->set_username(users.name(all_posts[postId].author));
+		messageToSend->set_msg(string(all_posts.content(postId)));
+		*messageToSend->mutable_timestamp() = all_posts.timestamp(postId);
+
+		subscriber->enqueue(messageToSend);
+	}
+
+	// Start receiving new posts only after the history is queued
+	ShardLocks::WriteGuard lock = locks.write(client->id);
+	client->subscriber = subscriber;
+	return client;
+}
+
+Status SNSServer::postToTimeline(const Message &message)
+{
+	// Empty posts are not allowed, but there is a possibility
+	// where an empty message to initialize the stream but the
+	// stream already exists. Ignore this empty message
+	if(message.msg() == "") {
+		return Status::OK;
+	}
+
+	uint64_t lsn = 0;
+	uint64_t ticket = addPostHelper(message, getClient(message.username()), lsn);
+	Status durable = waitDurable(*postsLog, ticket);
+	if(!durable.ok()) {
+		return durable;
+	}
+
+	// TODO: Propogate post to slaves
+	if(master) {
+		Request request;
+		Message* toPropogate = new Message();
+		toPropogate->CopyFrom(message); // Copy message
+
+		// Transfer ownership
+		request.set_allocated_message(toPropogate);
+		propogate(ADD_POST, &request, lsn);
+	}
 	return Status::OK;
 }
 
+void SNSServer::leaveTimeline(shared_ptr<Client> owner, shared_ptr<TimelineSubscriber> subscriber)
+{
+	{
+		ShardLocks::WriteGuard lock = locks.write(owner->id);
+		if(owner->subscriber == subscriber) {
+			owner->subscriber = NULL;
+		}
+	}
+	subscriber->close();
+
+	log(INFO, "Leaving timeline with " + users.name(owner->id) + ". " + subscriber->stats());
+}
+
 // ---- CROSS-SERVER COMMUNICATION ----
 
-Status SNSServer::GetLog(ServerContext *context, const SiblingRequest* sb, LogReply* logReply)
+Status SNSServer::StreamSnapshot(ServerContext *context, const SiblingRequest* sb, ServerWriter<SnapshotChunk>* writer)
+{
+	unique_ptr<Snapshot> snapshot = openSnapshot(*sb);
+	if(snapshot == NULL) {
+		return Status(grpc::StatusCode::INTERNAL, "Failed to read logs");
+	}
+
+	SnapshotChunk chunk;
+	while(snapshot->next(chunk)) {
+		if(!writer->Write(chunk)) {
+			log(WARNING, "Snapshot cancelled by the receiver after " + snapshot->stats());
+			return Status::CANCELLED;
+		}
+	}
+	return finishSnapshot(*snapshot);
+}
+
+/*
+	Opens a snapshot of the logs as they are now. A requester that names
+	its last LSN is only sent what came after it, if we can tell what that is.
+*/
+unique_ptr<Snapshot> SNSServer::openSnapshot(const SiblingRequest &request)
 {
-	string userinfo;
-	string posts;
+	/*
+		A syncing server registered with the coordinator before asking for
+		the logs. Refetch replication targets so any write after this
+		snapshot is propogated to it, even before the next heartbeat.
+	*/
+	invalidateTopology();
+
+	string base = TOP_LEVEL_DIR + "/";
+	// Our files may not be replaced from here until the snapshot has them open
+	lock_guard<mutex> lock(compactMtx);
+	int64_t userinfoLength = userinfoLog->length();
+	int64_t postsLength = postsLog->length();
+	if(userinfoLength == -1 || postsLength == -1) {
+		log(ERROR, "Failed to read local logs for a snapshot");
+		return NULL;
+	}
+
+	unique_ptr<Snapshot> snapshot = make_unique<Snapshot>(base + userinfoPath, userinfoLength,
+														base + postsPath, postsLength, SNAPSHOT_CHUNK_SIZE);
 
-	filesys->read(userinfoPath, userinfo);
-	filesys->read(postsPath, posts);
+	auto nameOf = [this](UserId id) {
+		return (id >= 0 && id < users.size()) ? string_view(users.name(id)) : string_view();
+	};
+	if(request.last_lsn() != 0 && !snapshot->selectTail(request, nameOf)) {
+		log(INFO, "Our record at LSN " + to_string(request.last_lsn()) + " is missing, differs from the requester's "
+			"or was checkpointed along with LSNs it lacks. Sending a full snapshot");
+	}
 
-	logReply->set_userinfo(userinfo);
-	logReply->set_posts(posts);
+	if(snapshot->open() == -1) {
+		log(ERROR, "Failed to read local logs for a snapshot");
+		return NULL;
+	}
+	return snapshot;
+}
 
+Status SNSServer::finishSnapshot(Snapshot &snapshot)
+{
+	if(snapshot.failed()) {
+		log(ERROR, "Snapshot failed to read local logs after " + snapshot.stats());
+		return Status(grpc::StatusCode::INTERNAL, "Failed to read logs");
+	}
+
+	log(INFO, "Sent " + snapshot.stats());
 	return Status::OK;
 }
 
@@ -918,10 +1958,244 @@ Status SNSServer::AddPost(ServerContext *context, const Request* request, Reply*
 	// as the poster will be in the client_db before AddPost is called
 	shared_ptr<Client> client = getClient(message.username(), false);
 
-	addPostHelper(message, client);
+	uint64_t lsn = request->lsn();
+	uint64_t ticket = addPostHelper(message, client, lsn);
+	Status durable = waitDurable(*postsLog, ticket);
+	if(!durable.ok()) {
+		return durable;
+	}
+
+	// A master passes posts from other clusters on to its slaves,
+	// so they have every LSN it gave out
+	propogate(ADD_POST, request, lsn);
 
 	// TODO: More verbose message
 	log(INFO, "Received add_post request.");
 	return Status::OK;
 }
 
+Status SNSServer::Replicate(ServerContext *context, ServerReaderWriter<ReplicationAck, ReplicationBatch>* stream)
+{
+	/*
+		Each batch is acked once applied, and held until its forwards are
+		acked (see ReplicationAck). The callbacks that release batches must
+		not block, so acks are written by a thread of their own, which
+		sends whatever was applied, held or released since its last write.
+	*/
+	struct Acks {
+		mutex mtx;
+		condition_variable cv;
+		uint64_t appliedSeq = 0;
+		uint64_t sentSeq = 0;
+		vector<uint64_t> held;
+		vector<uint64_t> released;
+		int numHeld = 0;		// batches whose callback hasn't run
+		bool reading = true;
+	};
+	struct Held {
+		uint64_t seq = 0;
+		bool applied = false;
+		bool acked = false;
+	};
+	shared_ptr<Acks> acks = make_shared<Acks>();
+
+	thread writer([stream, acks] {
+		unique_lock<mutex> lock(acks->mtx);
+		while(true) {
+			acks->cv.wait(lock, [acks] {
+				return acks->appliedSeq > acks->sentSeq || !acks->held.empty() || !acks->released.empty() ||
+					(!acks->reading && acks->numHeld == 0);
+			});
+			if(acks->appliedSeq <= acks->sentSeq && acks->held.empty() && acks->released.empty()) {
+				return;
+			}
+
+			ReplicationAck ack;
+			ack.set_seq(acks->appliedSeq);
+			for(uint64_t seq : acks->held) {
+				ack.add_held(seq);
+			}
+			for(uint64_t seq : acks->released) {
+				ack.add_released(seq);
+			}
+			acks->sentSeq = acks->appliedSeq;
+			acks->held.clear();
+			acks->released.clear();
+
+			lock.unlock();
+			bool ok = stream->Write(ack);
+			lock.lock();
+			if(!ok) {
+				return;
+			}
+		}
+	});
+
+	ReplicationBatch batch;
+	while(stream->Read(&batch)) {
+		shared_ptr<Held> held = make_shared<Held>();
+		{
+			lock_guard<mutex> lock(acks->mtx);
+			acks->numHeld++;
+		}
+		uint64_t seq = applyBatch(batch, [acks, held] {
+			lock_guard<mutex> lock(acks->mtx);
+			acks->numHeld--;
+			held->acked = true;
+			if(held->applied) {
+				auto unsent = find(acks->held.begin(), acks->held.end(), held->seq);
+				if(unsent != acks->held.end()) {
+					acks->held.erase(unsent);
+				} else {
+					acks->released.push_back(held->seq);
+				}
+			}
+			acks->cv.notify_all();
+		});
+
+		lock_guard<mutex> lock(acks->mtx);
+		held->applied = true;
+		held->seq = seq;
+		acks->appliedSeq = max(acks->appliedSeq, seq);
+		if(!held->acked) {
+			acks->held.push_back(seq);
+		}
+		acks->cv.notify_all();
+	}
+
+	{
+		lock_guard<mutex> lock(acks->mtx);
+		acks->reading = false;
+		acks->cv.notify_all();
+	}
+	writer.join();
+	return Status::OK;
+}
+
+uint64_t SNSServer::applyBatch(const ReplicationBatch &batch, function<void()> acked)
+{
+	// A stream that was cut off may still be applying what its sender resends on a new one
+	unique_lock<mutex> lock(appliedMtx);
+	// Queue 0 is a sender without queue ids
+	uint64_t queue = batch.queue();
+	AppliedQueue unnumbered;
+	AppliedQueue &from = queue != 0 ? appliedQueues[queue] : unnumbered;
+	from.lastBatch = ++numAppliedBatches;
+
+	if(!acceptTerm(batch)) {
+		uint64_t seq = from.seq;
+		lock.unlock();
+		acked();
+		return seq;
+	}
+
+	BatchContext context;
+	currentBatch = &context;
+
+	// Same handlers as the unary requests, so both paths apply identically
+	int skipped = 0;
+	for(const Operation &op : batch.operations()) {
+		// Applied before its ack was lost, or before we restarted or caught up
+		uint64_t lsn = op.request().lsn();
+		if((queue != 0 && op.seq() <= from.seq) || (!master && lsn != 0 && heldLsns.contains(lsn))) {
+			skipped++;
+			continue;
+		}
+
+		Reply reply;
+		if(op.type() == Operation::LOGIN) {
+			Login(NULL, &op.request(), &reply);
+		} else if(op.type() == Operation::FOLLOW) {
+			Follow(NULL, &op.request(), &reply);
+		} else if(op.type() == Operation::UNFOLLOW) {
+			UnFollow(NULL, &op.request(), &reply);
+		} else if(op.type() == Operation::ADD_POST) {
+			AddPost(NULL, &op.request(), &reply);
+		}
+	}
+
+	currentBatch = NULL;
+
+	int size = batch.operations_size();
+	uint64_t seq = size > 0 ? batch.operations(size - 1).seq() : 0;
+	if(skipped > 0) {
+		log(INFO, "Skipped " + to_string(skipped) + " of " + to_string(size) + " replicated operations that were applied already");
+	}
+
+	// Posts first, so once the APPLIED record is persisted everything it covers is.
+	// The userinfo flush persists the batch's records and the APPLIED record together.
+	if(postsLog->flush() == -1) {
+		log(ERROR, "Failed to persist replicated batch to local log");
+	}
+	if(queue != 0 && seq > from.seq) {
+		from.seq = seq;
+		string record;
+		LogFormat::encodeApplied(record, queue, seq);
+		userinfoLog->append(record);
+		trimAppliedQueues();
+	}
+	if(userinfoLog->flush() == -1) {
+		log(ERROR, "Failed to persist replicated batch to local log");
+	}
+
+	/*
+		Masters forwarding each other's writes wait on each other, so a
+		batch must not hold appliedMtx, or a thread, while the servers it
+		went on to ack it: with writes from two origins going round a
+		chain in opposite directions, every master would wait on the next.
+	*/
+	lock.unlock();
+	whenAcked(context.acks, acked);
+	return seq;
+}
+
+/*
+	A slave refuses batches from a master of an earlier term, which was
+	replaced. The first batch of a later term ends the LSNs held from
+	earlier ones at the term's start: an earlier master gave those out
+	and the new one never had them, so it gives them out again. The
+	operations they stood for stay applied here. Returns false to refuse
+	the batch.
+*/
+bool SNSServer::acceptTerm(const ReplicationBatch &batch)
+{
+	if(master || batch.term() == 0 || batch.term() == heldTerm) {
+		return true;
+	}
+	if(batch.term() < heldTerm || batch.term() < term) {
+		log(WARNING, "Refused a replicated batch from the master of term " + to_string(batch.term()) + ", "
+			"which was replaced in term " + to_string(max<uint64_t>(heldTerm, term)));
+		return false;
+	}
+
+	heldTerm = batch.term();
+	long released = 0;
+	for(uint64_t lsn = max<uint64_t>(batch.term_start(), 1); lsn <= lastLsn; lsn++) {
+		if(heldLsns.contains(lsn)) {
+			heldLsns.erase(lsn);
+			released++;
+		}
+	}
+	if(released > 0) {
+		log(WARNING, "The master of term " + to_string(batch.term()) + " started at LSN " + to_string(batch.term_start()) + ", "
+			"below " + to_string(released) + " operations applied here from an earlier master that it never had. "
+			"Its own operations under those LSNs will be applied too");
+	}
+	return true;
+}
+
+// Forgets the queue that sent a batch least recently once there are too many
+void SNSServer::trimAppliedQueues()
+{
+	if(appliedQueues.size() <= (size_t)MAX_APPLIED_QUEUES) {
+		return;
+	}
+	auto oldest = appliedQueues.begin();
+	for(auto it = appliedQueues.begin(); it != appliedQueues.end(); it++) {
+		if(it->second.lastBatch < oldest->second.lastBatch) {
+			oldest = it;
+		}
+	}
+	appliedQueues.erase(oldest);
+}
+
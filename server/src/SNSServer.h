@@ -31,9 +31,17 @@
  *
  */
 
+#pragma once
+
+#include <algorithm>
+#include <atomic>
 #include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <string>
 #include <memory>
+#include <unordered_set>
 
 #include <grpc++/grpc++.h>
 #include <google/protobuf/timestamp.pb.h>
@@ -50,11 +58,28 @@
 #include <snsproto/sns.grpc.pb.h>
 #include <snsproto/coordinator.grpc.pb.h>
 
+#include "AppendOnlyVector.h"
+#include "ChannelPool.h"
+#include "LogCompactor.h"
+#include "LogLoader.h"
+#include "LsnSet.h"
+#include "Replicator.h"
+#include "ShardLocks.h"
+#include "Snapshot.h"
+#include "UserRegistry.h"
+#include "WriteAheadLog.h"
+#include "FollowSet.h"
+#include "LogFormat.h"
+#include "PostStore.h"
+#include "RingBuffer.h"
+#include "TimelineSubscriber.h"
+
 using google::protobuf::Timestamp;
 using google::protobuf::Duration;
 using grpc::Server;
 using grpc::ServerContext;
 using grpc::ServerReaderWriter;
+using grpc::ServerWriter;
 using grpc::ServerBuilder;
 using grpc::Status;
 
@@ -69,6 +94,7 @@ using SNS::Reply;
 using SNS::CoordService;
 using SNS::Path;
 using SNS::ServerInfo;
+using SNS::Keepalive;
 
 using namespace SNS;
 
@@ -83,36 +109,58 @@ Timestamp* strToAllocatedTimestamp(const std::string &timestampStr);
 
 // ---- HELPER STRUCTS ----
 
+// Number of posts a client receives when entering the timeline
+const int TIMELINE_SIZE = 20;
+
+// Upper bounds of one batch on a Replicate stream
+const int MAX_BATCH_OPS = 256;
+const int MAX_BATCH_BYTES = 256 * 1024;
+
+// A rejoining slave that lacks more LSNs than this below its highest
+// one takes a full snapshot instead of catching up
+const int MAX_MISSING_LSNS = 65536;
+
+// Replication queues a server remembers the last operation applied
+// from. The one that sent nothing for longest is forgotten first.
+const int MAX_APPLIED_QUEUES = 64;
+
+// Records per StreamSnapshot chunk, in bytes
+const int SNAPSHOT_CHUNK_SIZE = 1024 * 1024;
+
+// Bytes of records each startup replay task decodes
+const int REPLAY_CHUNK_SIZE = 1024 * 1024;
+
+// The userinfo log is checkpointed once the records after its last
+// checkpoint outgrow it, and are at least this many bytes
+const int CHECKPOINT_MIN_BYTES = 1024 * 1024;
+
+/*
+	A client's id never changes. Every other field is guarded by the
+	shard lock of the client's id (see ShardLocks), except hasPulledPosts
+	which may be read without it.
+*/
 struct Client {
-  std::string username;
+  UserId id = INVALID_USER;
   bool connected = false;
   int following_file_size = 0;
 
-  std::vector<std::shared_ptr<Client>> client_followers;
-  std::vector<std::shared_ptr<Client>> client_following;
-  std::vector<Timestamp> follow_time;
-
-  ServerReaderWriter<Message, Message>* stream = 0;
-  bool operator==(const Client& c1) const{
-	return (username == c1.username);
-  }
-  bool operator>(const Client& c1) const{
-	return (username > c1.username);
-  }
-};
-
-struct Post {
+  // Each edge keeps the time the follow was made
+  FollowSet client_followers;
+  FollowSet client_following;
 
-  std::string username;
-  std::string data;
-  Timestamp timestamp;
+  // Latest posts from followed users, filled on write by addPostHelper
+  RingBuffer<PostId, TIMELINE_SIZE> inbox;
 
-  Post(const Message &mInit) {
-	username = mInit.username();
-	data = mInit.msg();
-	timestamp = mInit.timestamp();
-  };
+  // Posts by this client that were not fanned out because it had too
+  // many followers. Followers pull these when they enter the timeline.
+  std::vector<PostId> pulled_posts;
+  std::atomic<bool> hasPulledPosts{false};
 
+  // Set while the client is in timeline mode
+  std::shared_ptr<TimelineSubscriber> subscriber;
+  bool operator==(const Client& c1) const{
+	return (id == c1.id);
+  }
 };
 
 // ---- SERVER CLASS ----
@@ -124,11 +172,45 @@ public:
 	SNSServer();
 	virtual ~SNSServer() {};
 
+	// Authors with at least this many followers have their posts pulled
+	// by followers on read instead of pushed into follower inboxes
+	void setFanoutThreshold(int threshold) { fanoutThreshold = threshold; }
+
+	// Bound and overflow policy of each timeline stream's outbound queue.
+	// The queue always has room for the initial timeline posts.
+	void setSendQueue(int capacity, TimelineSubscriber::OverflowPolicy policy) {
+		sendQueueCapacity = std::max(capacity, TIMELINE_SIZE);
+		overflowPolicy = policy;
+	}
+
+	// How far userinfo and posts records are persisted before an RPC replies
+	void setDurability(WriteAheadLog::Durability mode) { durability = mode; }
+
+	// How often to check whether the userinfo log is due a checkpoint, 0 never
+	void setCheckpointInterval(int seconds) { checkpointInterval = seconds; }
+
+	// How many replicas must acknowledge a write before it replies,
+	// for requests that don't set their own ack_policy
+	void setAckPolicy(Replicator::AckPolicy policy) { ackPolicy = policy; }
+
+	// How often a keepalive goes to the coordinator. Must be shorter than
+	// its heartbeat timeout; the upkeep still runs every heartbeatDelay.
+	void setKeepaliveInterval(int ms) { keepaliveMs = ms; }
+
+	// How long replicated operations wait to be batched with later ones
+	void setBatchDelay(int delayUs) { replicator->setBatching(delayUs, MAX_BATCH_OPS, MAX_BATCH_BYTES); }
+
+	int getSendQueueCapacity() const { return sendQueueCapacity; }
+	TimelineSubscriber::OverflowPolicy getOverflowPolicy() const { return overflowPolicy; }
+
 	// Initialization
 	int connectToCoordinator(std::string hostname, std::string port,
 						  std::string coordHostname, std::string coordPort,
 						  int clusterId, int serverId);
 
+	// Offline upgrade of this server's text logs to the binary log format
+	int convertTextLogs(int clusterId, int serverId);
+
 	// Client API
 	Status Login(ServerContext* context, const Request* request, Reply* reply);
 	Status Follow(ServerContext* context, const Request* request, Reply* reply);
@@ -136,16 +218,40 @@ public:
 	Status List(ServerContext* context, const Request* request, ListReply* list_reply);
 	Status Timeline(ServerContext* context, ServerReaderWriter<Message, Message>* stream);
 
+	// Timeline stream steps, independent of how the stream is served.
+	// joinTimeline queues the history and returns the stream's owner.
+	// postToTimeline fails if the post can't be persisted, ending the stream.
+	std::shared_ptr<Client> joinTimeline(const Message &message, std::shared_ptr<TimelineSubscriber> subscriber);
+	Status postToTimeline(const Message &message);
+	void leaveTimeline(std::shared_ptr<Client> owner, std::shared_ptr<TimelineSubscriber> subscriber);
+
 	// Cross-Server Communication
-	Status GetLog(ServerContext *context, const SiblingRequest* sb, LogReply* logReply);
+	Status StreamSnapshot(ServerContext *context, const SiblingRequest* sb, ServerWriter<SnapshotChunk>* writer);
 	Status AddPost(ServerContext *context, const Request* request, Reply* reply);
+	Status Replicate(ServerContext *context, ServerReaderWriter<ReplicationAck, ReplicationBatch>* stream);
+
+	// StreamSnapshot steps, independent of how the stream is served.
+	// openSnapshot returns NULL if the logs can't be read.
+	std::unique_ptr<Snapshot> openSnapshot(const SiblingRequest &request);
+	Status finishSnapshot(Snapshot &snapshot);
+
+	// Applies a batch from a Replicate stream in order and returns the
+	// sequence number to ack. acked is called once the servers the batch
+	// was forwarded to have acked it as its ack policy requires, possibly
+	// before this returns. Until then the batch is held (see ReplicationAck).
+	uint64_t applyBatch(const ReplicationBatch &batch, std::function<void()> acked);
 
 private:
 
 	std::unique_ptr<CoordService::Stub> coordStub_;
 	ServerInfo serverInfo;
 	Path path;
-	bool master;
+	std::atomic<bool> master{false};
+
+	// Term of our cluster's master, from the coordinator. While master,
+	// our batches carry it with termStart, the first LSN we gave out in it.
+	std::atomic<uint64_t> term{0};
+	uint64_t termStart = 0;
 
 	std::shared_ptr<FSWrapper> filesys;
 	std::string localPath;
@@ -153,37 +259,143 @@ private:
 	std::string postsPath;
 
 	int heartbeatDelay = 3;
+	int keepaliveMs = 3000;
+	int fanoutThreshold = 1000;
+	int sendQueueCapacity = 256;
+	TimelineSubscriber::OverflowPolicy overflowPolicy = TimelineSubscriber::DROP_OLDEST;
+
+	// Which path assembled each timeline read
+	std::atomic<long> inboxReads{0};
+	std::atomic<long> mergedReads{0};
 	int synchDelay = 10;
 
-	std::vector<std::shared_ptr<Client>> client_db;
-	std::vector<std::shared_ptr<Post>> all_posts;
+	/*
+		Shared by all gRPC threads. client_db is indexed by UserId and
+		all_posts by PostId; both only grow and are read without locks.
+		Mutable client state is guarded per shard by locks.
+		New clients are registered one at a time under clientsMtx, which
+		also keeps their USER records in id order.
+	*/
+	UserRegistry users;
+	AppendOnlyVector<std::shared_ptr<Client>> client_db;
+	PostStore all_posts;
+	ShardLocks locks;
+	std::mutex clientsMtx;
+
+	// Group-committed logs behind the userinfo and posts files
+	WriteAheadLog::Durability durability = WriteAheadLog::INTERVAL;
+	int logSyncInterval = 100; // ms
+	std::unique_ptr<WriteAheadLog> userinfoLog;
+	std::unique_ptr<WriteAheadLog> postsLog;
+
+	// Highest LSN in either log, the last one given out while master
+	std::atomic<uint64_t> lastLsn{0};
+
+	// Checkpoints of the userinfo log. checkpointLength is the size of
+	// the last one. compactMtx is held while a log file is replaced and
+	// while a snapshot opens them, so a snapshot never mixes the two.
+	int checkpointInterval = 60; // s
+	uint64_t checkpointLength = 0;
+	std::mutex compactMtx;
+
+	/*
+		Replication targets per destination, as last fetched from the
+		coordinator. An entry is refetched once the topology version from
+		the latest heartbeat no longer matches the one it was fetched at.
+	*/
+	struct Topology {
+		bool valid = false;
+		uint64_t version = 0;
+		ServerList servers;
+
+		// Raised by invalidateTopology, so a fetch that started before
+		// an invalidation does not store its result
+		uint64_t generation = 0;
+	};
+	std::mutex topologyMtx;
+	std::map<std::string, Topology> topology;
+	std::atomic<uint64_t> topologyVersion{0};
+
+	// Channels to the servers this one replicates to
+	ChannelPool replicas;
+	std::unique_ptr<Replicator> replicator;
+	Replicator::AckPolicy ackPolicy = Replicator::ACK_QUORUM;
+
+	/*
+		The seq of the last operation applied from each replication queue
+		that sent us any (see Replicator), so an operation that is resent
+		is skipped. Batches are applied one at a time under appliedMtx,
+		which is released before waiting for the servers they go on to.
+		Each batch appends an APPLIED record to userinfo after its own
+		records, flushed with them before it is acked, and replay restores
+		the queues from those records.
+		A slave also skips operations whose LSN it holds already, which
+		covers what it applied since and what it was sent in a snapshot.
+		heldTerm is the term of the master those LSNs agree with.
+	*/
+	struct AppliedQueue {
+		uint64_t seq = 0;
+		uint64_t lastBatch = 0;	// numAppliedBatches when it last sent one
+	};
+	std::mutex appliedMtx;
+	std::map<uint64_t, AppliedQueue> appliedQueues;
+	uint64_t numAppliedBatches = 0;
+	uint64_t heldTerm = 0;
+	LsnSet heldLsns;
 
 	// ---- COORDINATOR COMMUNICATION ----
 	void sendHeartbeat();
+	void receiveUpdates(grpc::ClientReaderWriter<Keepalive, Path> *session);
+	void applyPath(const Path &update);
 
 	// ---- CLIENT API HELPERS ----
-	std::shared_ptr<Client> getClient(const std::string &username, bool createNew = false);
-  	int indexOfFollowing(std::shared_ptr<Client> client1, std::shared_ptr<Client> client2);
-  	int indexOfFollower(std::shared_ptr<Client> client1, std::shared_ptr<Client> client2);
-	std::vector<std::shared_ptr<Post>> getFollowingPosts(std::shared_ptr<Client> c, int maxPosts);
-	void write(std::string &filename, std::string &data);
+	std::shared_ptr<Client> getClient(const std::string &username, bool createNew = false,
+									 uint64_t *lsn = NULL, uint64_t *ticket = NULL);
+	std::shared_ptr<Client> getClient(UserId id) { return client_db[id]; }
+	// Caller holds c's shard lock for writing
+	void dropFromInbox(std::shared_ptr<Client> c, UserId author);
+	std::vector<PostId> getTimelinePosts(std::shared_ptr<Client> c);
+	void openLogs();
+	void checkpointLoop();
+	int checkpoint();
+	Status waitDurable(WriteAheadLog &wal, uint64_t ticket);
+	// Called under the lock a record is appended with
+	uint64_t assignLsn(uint64_t given);
+	void raiseLsn(uint64_t lsn);
 
 	// ---- REPLICATION HELPERS ----
 	void setFilepaths(int clusterId, int serverId);
 	void initializeData(const std::string &syncAddress);
-
-	void loginHelper(std::string user);
-	void followHelper(std::string user1, std::string user2, std::string timestampStr);
-	void unfollowHelper(std::string user1, std::string user2);
-	void addPostHelper(const Message &message, std::shared_ptr<Client> client, bool writeToFile = true);
-
-	void processUserInfoFromFile(std::string filedata, bool save);
-	void updatePostsFromFile(std::string filedata, bool save);
-	void propogateHelper(std::string method, const Request &request, std::string destination);
-	void propogate(std::string method, const Request* request);
+	void openReplicationQueues();
+	void beginTerm(uint64_t newTerm);
+	// Called with appliedMtx held
+	bool acceptTerm(const ReplicationBatch &batch);
+	void trimAppliedQueues();
+
+	// lsn is the LSN the operation came with (see assignLsn)
+	UserId loginHelper(const std::string &user, bool writeToFile, uint64_t lsn);
+	void followHelper(UserId follower, UserId followee, int64_t timeNanos, bool writeToFile, uint64_t lsn);
+	void unfollowHelper(UserId follower, UserId followee, bool writeToFile, uint64_t lsn);
+	// Returns the ticket of the post in postsLog, or 0 if it wasn't written.
+	// lsn is set to the LSN the post was written under.
+	uint64_t addPostHelper(const Message &message, std::shared_ptr<Client> client, uint64_t &lsn);
+	uint64_t addPostHelper(std::shared_ptr<Client> client, int64_t timeNanos, std::string_view content,
+						bool writeToFile, const Message *message, uint64_t &lsn);
+
+	void replayLogs(LogLoader &userinfo, LogLoader &posts);
+	int processUserInfoFromFile(RecordSource &reader, bool save, std::vector<UserId> &userMap);
+	int updatePostsFromFile(RecordSource &reader, bool save, const std::vector<UserId> &userMap);
+	bool describeLogs(std::string_view userinfo, std::string_view posts, SiblingRequest &request);
+	int syncFrom(const std::string &syncAddress, const SiblingRequest &request,
+				std::unique_ptr<LogLoader> &userinfo, std::unique_ptr<LogLoader> &posts);
+	ServerList getTopology(const std::string &destination);
+	void invalidateTopology();
+	std::vector<std::string> treeChildren(const ServerList &masters, Request &request);
+	Replicator::AckPolicy ackPolicyOf(const Request &request);
+	std::shared_ptr<Replicator::Ack> propogateHelper(std::string method, Request &request, std::string destination);
+	void propogate(std::string method, const Request* request, uint64_t lsn);
 
 	// STATIC MEMBERS AND FUNCTIONS
-  	static std::string formatMessageOutput(const Message &message);
 
 	static std::string MASTER;
 	static std::string SLAVE;
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+
+#include "UserRegistry.h"
+
+/*
+	Reader-writer locks for state partitioned by UserId.
+
+	A user belongs to shard id % NUM_SHARDS. Readers of a user's state
+	take the shard shared, writers take it exclusive, so work on users
+	in different shards never contends. To avoid deadlock, hold at most
+	one shard at a time, or use writePair which locks in shard order.
+*/
+class ShardLocks {
+
+public:
+	static const int NUM_SHARDS = 64;
+
+	typedef std::shared_lock<std::shared_mutex> ReadGuard;
+	typedef std::unique_lock<std::shared_mutex> WriteGuard;
+
+	static int shardOf(UserId id) { return id % NUM_SHARDS; }
+
+	ReadGuard read(UserId id) { return ReadGuard(shards[shardOf(id)].mtx); }
+	WriteGuard write(UserId id) { return WriteGuard(shards[shardOf(id)].mtx); }
+
+	// Exclusive locks on the shards of both users
+	class PairGuard {
+	public:
+		PairGuard(ShardLocks &locks, UserId a, UserId b) {
+			int first = std::min(shardOf(a), shardOf(b));
+			int second = std::max(shardOf(a), shardOf(b));
+			lock1 = WriteGuard(locks.shards[first].mtx);
+			if(second != first) {
+				lock2 = WriteGuard(locks.shards[second].mtx);
+			}
+		}
+	private:
+		WriteGuard lock1;
+		WriteGuard lock2;
+	};
+
+	PairGuard writePair(UserId a, UserId b) { return PairGuard(*this, a, b); }
+
+private:
+	// Keep each lock on its own cache line
+	struct alignas(64) Shard {
+		std::shared_mutex mtx;
+	};
+	Shard shards[NUM_SHARDS];
+};
@@ -0,0 +1,169 @@
+#include <cstdio>
+
+#include "Snapshot.h"
+
+using namespace std;
+
+Snapshot::Snapshot(const string &userinfoPath, uint64_t userinfoLength,
+				const string &postsPath, uint64_t postsLength, size_t chunkSize)
+	: paths{userinfoPath, postsPath}, lengths{userinfoLength, postsLength}, chunkSize(chunkSize),
+	start(chrono::steady_clock::now())
+{
+
+}
+
+int Snapshot::open()
+{
+	for(int i = 0; i < 2; i++) {
+		readers[i] = make_unique<LogFileReader>(paths[i], lengths[i], chunkSize);
+		if(readers[i]->open() == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+bool Snapshot::selectTail(const SNS::SiblingRequest &request, function<string_view(UserId)> nameOf)
+{
+	after = request.last_lsn();
+	missing = unordered_set<uint64_t>(request.missing_lsns().begin(), request.missing_lsns().end());
+	referenced.clear();
+
+	// Our logs are written under our own ids
+	vector<bool> introduced;
+	bool found = false;
+	auto mark = [](vector<bool> &users, UserId id) {
+		if(id < 0) {
+			return;
+		}
+		if(id >= (int)users.size()) {
+			users.resize(id + 1);
+		}
+		users[id] = true;
+	};
+
+	for(int i = 0; i < 2; i++) {
+		LogFileReader reader(paths[i], lengths[i], chunkSize);
+		if(reader.open() == -1) {
+			return false;
+		}
+
+		string_view frame;
+		LogRecord record;
+		while(reader.next(frame) == 1) {
+			LogReader decoder(frame.data(), frame.size(), LogFormat::VERSION);
+			if(decoder.next(record) != 1) {
+				continue;
+			}
+
+			// The records a checkpoint replaced can't be sent one by one
+			if(record.type == RECORD_CHECKPOINT) {
+				if(after < record.lsn) {
+					return false;
+				}
+				for(uint64_t lsn : missing) {
+					if(lsn <= record.lsn) {
+						return false;
+					}
+				}
+			}
+
+			if(record.lsn == after && after != 0) {
+				if(LogFormat::fingerprint(record, nameOf(record.user), nameOf(record.target)) != request.last_fingerprint()) {
+					return false;
+				}
+				found = true;
+			}
+
+			if(record.lsn > after || missing.count(record.lsn) > 0) {
+				if(record.type == RECORD_USER) {
+					mark(introduced, record.user);
+				} else {
+					mark(referenced, record.user);
+					mark(referenced, record.target);
+				}
+			}
+		}
+	}
+
+	if(!found) {
+		return false;
+	}
+
+	// A user the tail introduces needs no other USER record
+	for(int id = 0; id < (int)referenced.size() && id < (int)introduced.size(); id++) {
+		if(introduced[id]) {
+			referenced[id] = false;
+		}
+	}
+	tail = true;
+	return true;
+}
+
+bool Snapshot::next(SNS::SnapshotChunk &chunk)
+{
+	chunk.Clear();
+	chunk.set_tail(tail);
+	if(done || readFailed) {
+		return false;
+	}
+
+	// A chunk never mixes the two logs
+	while(current < 2) {
+		string *out = current == 0 ? chunk.mutable_userinfo() : chunk.mutable_posts();
+		out->reserve(chunkSize);
+
+		string_view frame;
+		LogRecord record;
+		int ret = 1;
+		while(out->size() < chunkSize && (ret = readers[current]->next(frame)) == 1) {
+			if(!tail || wanted(frame, record)) {
+				out->append(frame);
+			}
+		}
+
+		if(ret == -1) {
+			readFailed = true;
+			return false;
+		}
+		if(ret == 0) {
+			current++;
+		}
+		if(!out->empty()) {
+			break;
+		}
+	}
+	done = current == 2;
+
+	// The first chunk is sent even if both logs are empty
+	if(chunk.userinfo().empty() && chunk.posts().empty() && started) {
+		return false;
+	}
+	started = true;
+
+	numChunks++;
+	numBytes += chunk.userinfo().size() + chunk.posts().size();
+	return true;
+}
+
+bool Snapshot::wanted(string_view frame, LogRecord &record)
+{
+	LogReader decoder(frame.data(), frame.size(), LogFormat::VERSION);
+	if(decoder.next(record) != 1) {
+		return false;
+	}
+	if(record.lsn > after || missing.count(record.lsn) > 0) {
+		return true;
+	}
+	return record.type == RECORD_USER && record.user >= 0 &&
+		record.user < (int)referenced.size() && referenced[record.user];
+}
+
+string Snapshot::stats()
+{
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	char rate[32];
+	snprintf(rate, sizeof(rate), "%.1f", secs > 0 ? numBytes / (1024.0 * 1024.0) / secs : 0.0);
+	return string(tail ? "tail" : "full snapshot") + " of " + to_string(numBytes) + " bytes "
+		"in " + to_string(numChunks) + " chunks, " + to_string((long)(secs * 1000)) + "ms, " + rate + " MB/s";
+}
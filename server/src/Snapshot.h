@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <snsproto/sns.grpc.pb.h>
+
+#include "LogFormat.h"
+
+/*
+	One StreamSnapshot reply, read from a server's userinfo and posts logs
+	a chunk at a time. Every chunk holds whole records of one log, up to
+	about chunkSize bytes, and all of userinfo is sent before posts so
+	users are introduced before they are used. Only the bytes of the logs
+	that existed when the snapshot was opened are sent.
+
+	A full snapshot sends every record. A tail sends the records a
+	rejoining slave lacks (see selectTail), plus the USER records of every
+	user they refer to.
+*/
+class Snapshot {
+
+public:
+	Snapshot(const std::string &userinfoPath, uint64_t userinfoLength,
+			const std::string &postsPath, uint64_t postsLength, size_t chunkSize);
+
+	// Returns -1 if either log can't be read
+	int open();
+
+	/*
+		Narrows the snapshot to the records request lacks: those after its
+		last LSN and those it lists as missing. nameOf gives the names of
+		the user ids in our logs. Returns false, leaving the snapshot full,
+		if our record at the requester's last LSN is gone or differs from
+		its own, or if our checkpoint replaced records it lacks. Reads both
+		logs once.
+	*/
+	bool selectTail(const SNS::SiblingRequest &request, std::function<std::string_view(UserId)> nameOf);
+
+	// Fills chunk with the next records. The first call always returns a
+	// chunk, so the receiver learns whether the snapshot is a tail.
+	// Returns false once everything was sent or a log failed to read.
+	bool next(SNS::SnapshotChunk &chunk);
+
+	bool isTail() const { return tail; }
+	bool failed() const { return readFailed; }
+	std::string stats();
+
+private:
+	std::string paths[2];
+	uint64_t lengths[2];
+	size_t chunkSize;
+	std::chrono::steady_clock::time_point start;
+
+	std::unique_ptr<LogFileReader> readers[2];
+	int current = 0;	// log being sent
+	bool started = false;
+	bool done = false;
+	bool readFailed = false;
+
+	// Selection for a tail
+	bool tail = false;
+	uint64_t after = 0;
+	std::unordered_set<uint64_t> missing;
+	std::vector<bool> referenced;	// by user id
+
+	long numChunks = 0;
+	uint64_t numBytes = 0;
+
+	bool wanted(std::string_view frame, LogRecord &record);
+};
@@ -0,0 +1,185 @@
+#include "TimelineSubscriber.h"
+
+using grpc::CallbackServerContext;
+using grpc::ServerBidiReactor;
+using grpc::ServerContext;
+using grpc::ServerReaderWriter;
+
+using SNS::Message;
+
+using namespace std;
+
+// ---- TIMELINE SUBSCRIBER ----
+
+bool TimelineSubscriber::parsePolicy(const string &name, OverflowPolicy &policy)
+{
+	if(name == "drop") {
+		policy = DROP_OLDEST;
+	} else if(name == "coalesce") {
+		policy = COALESCE;
+	} else if(name == "disconnect") {
+		policy = DISCONNECT;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool TimelineSubscriber::enqueue(shared_ptr<const Message> message)
+{
+	lock_guard<mutex> lock(mtx);
+	if(closed) {
+		return false;
+	}
+
+	if((int)queue.size() < capacity || handleOverflow(message)) {
+		queue.push_back(message);
+		maxDepth = max(maxDepth, (int)queue.size());
+		onQueued();
+	}
+	return !closed;
+}
+
+// Called with mtx held and a full queue.
+// Returns true if message should still be appended to the queue.
+bool TimelineSubscriber::handleOverflow(shared_ptr<const Message> &message)
+{
+	if(policy == COALESCE) {
+		shared_ptr<const Message> &newest = queue.back();
+		size_t mergedSize = newest->msg().size() + message->msg().size() + 1;
+		if(newest->username() == message->username() && mergedSize <= MAX_COALESCED_SIZE) {
+			shared_ptr<Message> merged = make_shared<Message>(*newest);
+			merged->set_msg(newest->msg() + "\n" + message->msg());
+			*merged->mutable_timestamp() = message->timestamp();
+			newest = merged;
+			numCoalesced++;
+			return false;
+		}
+		// Different author or merged post too large, drop instead
+	}
+
+	if(policy == DISCONNECT) {
+		closed = true;
+		numDropped += queue.size() + 1;
+		queue.clear();
+
+		// Cancel while holding the lock so close() cannot let the
+		// stream and its context go away first. TryCancel only
+		// schedules the teardown, it never calls back into us.
+		context->TryCancel();
+		return false;
+	}
+
+	queue.pop_front();
+	numDropped++;
+	return true;
+}
+
+void TimelineSubscriber::close()
+{
+	lock_guard<mutex> lock(mtx);
+	closed = true;
+}
+
+int TimelineSubscriber::depth()
+{
+	lock_guard<mutex> lock(mtx);
+	return (int)queue.size();
+}
+
+string TimelineSubscriber::stats()
+{
+	lock_guard<mutex> lock(mtx);
+	return "sent: " + to_string(numSent) + ", "
+		"dropped: " + to_string(numDropped) + ", "
+		"coalesced: " + to_string(numCoalesced) + ", "
+		"queued: " + to_string(queue.size()) + ", "
+		"max queue depth: " + to_string(maxDepth);
+}
+
+// ---- STREAM SUBSCRIBER ----
+
+StreamSubscriber::StreamSubscriber(ServerContext *context,
+									ServerReaderWriter<Message, Message> *stream,
+									int capacity, OverflowPolicy policy)
+	: TimelineSubscriber(context, capacity, policy), stream(stream)
+{
+	writer = thread(&StreamSubscriber::writeLoop, this);
+}
+
+StreamSubscriber::~StreamSubscriber()
+{
+	close();
+}
+
+void StreamSubscriber::writeLoop()
+{
+	while(true) {
+		shared_ptr<const Message> message;
+		{
+			unique_lock<mutex> lock(mtx);
+			cv.wait(lock, [this] { return closed || !queue.empty(); });
+			if(closed) {
+				return;
+			}
+			message = queue.front();
+			queue.pop_front();
+		}
+
+		// Only this thread writes to the stream
+		if(!stream->Write(*message)) {
+			lock_guard<mutex> lock(mtx);
+			closed = true;
+			return;
+		}
+
+		lock_guard<mutex> lock(mtx);
+		numSent++;
+	}
+}
+
+void StreamSubscriber::close()
+{
+	TimelineSubscriber::close();
+	cv.notify_one();
+
+	if(writer.joinable()) {
+		writer.join();
+	}
+}
+
+// ---- REACTOR SUBSCRIBER ----
+
+// Called with mtx held. StartWrite never runs OnWriteDone inline,
+// so it is safe to call under the lock, and close() cannot race it.
+void ReactorSubscriber::startNextWrite()
+{
+	if(writing || closed || queue.empty()) {
+		return;
+	}
+
+	writing = true;
+	inFlight = queue.front();
+	queue.pop_front();
+	reactor->StartWrite(inFlight.get());
+}
+
+void ReactorSubscriber::onQueued()
+{
+	startNextWrite();
+}
+
+void ReactorSubscriber::onWriteDone(bool ok)
+{
+	lock_guard<mutex> lock(mtx);
+	writing = false;
+	inFlight = NULL;
+
+	if(!ok) {
+		closed = true;
+		return;
+	}
+
+	numSent++;
+	startNextWrite();
+}
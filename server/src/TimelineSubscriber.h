@@ -0,0 +1,113 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <grpc++/grpc++.h>
+#include <snsproto/sns.grpc.pb.h>
+
+/*
+	Outbound side of one Timeline stream.
+
+	Posts are handed to enqueue(), which only touches an in-memory queue.
+	A subclass drains the queue into the stream, so a slow client only
+	delays its own queue, never the posting thread. The queue is bounded;
+	when it is full the overflow policy decides what happens to the new message.
+*/
+class TimelineSubscriber {
+
+public:
+	enum OverflowPolicy {
+		DROP_OLDEST,	// discard the oldest queued message
+		COALESCE,		// merge into the newest queued message from the same author
+		DISCONNECT		// cancel the stream
+	};
+
+	TimelineSubscriber(grpc::ServerContextBase *context, int capacity, OverflowPolicy policy)
+		: context(context), capacity(capacity), policy(policy) {};
+	virtual ~TimelineSubscriber() {};
+
+	// Returns false if the subscriber is closed and the message was not queued
+	bool enqueue(std::shared_ptr<const SNS::Message> message);
+
+	// Stops writing. Must be called before the stream goes away.
+	virtual void close();
+
+	int depth();
+	std::string stats();
+
+	static bool parsePolicy(const std::string &name, OverflowPolicy &policy);
+
+protected:
+	grpc::ServerContextBase *context;
+	int capacity;
+	OverflowPolicy policy;
+
+	std::mutex mtx;
+	std::deque<std::shared_ptr<const SNS::Message>> queue;
+	bool closed = false;
+
+	long numSent = 0;
+	long numDropped = 0;
+	long numCoalesced = 0;
+	int maxDepth = 0;
+
+	// Called with mtx held after a message is queued
+	virtual void onQueued() = 0;
+
+private:
+	// Upper bound on the content of a coalesced post
+	static const size_t MAX_COALESCED_SIZE = 64 * 1024;
+
+	bool handleOverflow(std::shared_ptr<const SNS::Message> &message);
+};
+
+// Drains the queue into a synchronous stream on a dedicated writer thread
+class StreamSubscriber : public TimelineSubscriber {
+
+public:
+	StreamSubscriber(grpc::ServerContext *context,
+					grpc::ServerReaderWriter<SNS::Message, SNS::Message> *stream,
+					int capacity, OverflowPolicy policy);
+	virtual ~StreamSubscriber();
+
+	virtual void close();
+
+protected:
+	virtual void onQueued() { cv.notify_one(); }
+
+private:
+	grpc::ServerReaderWriter<SNS::Message, SNS::Message> *stream;
+	std::condition_variable cv;
+	std::thread writer;
+
+	void writeLoop();
+};
+
+// Drains the queue into a callback API reactor, one write in flight at a time
+class ReactorSubscriber : public TimelineSubscriber {
+
+public:
+	ReactorSubscriber(grpc::CallbackServerContext *context,
+					grpc::ServerBidiReactor<SNS::Message, SNS::Message> *reactor,
+					int capacity, OverflowPolicy policy)
+		: TimelineSubscriber(context, capacity, policy), reactor(reactor) {};
+	virtual ~ReactorSubscriber() {};
+
+	// Called from the reactor's OnWriteDone
+	void onWriteDone(bool ok);
+
+protected:
+	virtual void onQueued();
+
+private:
+	grpc::ServerBidiReactor<SNS::Message, SNS::Message> *reactor;
+	std::shared_ptr<const SNS::Message> inFlight;
+	bool writing = false;
+
+	void startNextWrite();
+};
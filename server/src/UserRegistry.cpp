@@ -0,0 +1,31 @@
+#include "UserRegistry.h"
+
+using namespace std;
+
+UserId UserRegistry::intern(const string &username)
+{
+	Shard &shard = shardOf(username);
+	unique_lock<shared_mutex> lock(shard.mtx);
+
+	auto it = shard.ids.find(username);
+	if(it != shard.ids.end()) {
+		return it->second;
+	}
+
+	UserId id = (UserId)names.push_back(username);
+	shard.ids.emplace(username, id);
+
+	return id;
+}
+
+UserId UserRegistry::find(const string &username)
+{
+	Shard &shard = shardOf(username);
+	shared_lock<shared_mutex> lock(shard.mtx);
+
+	auto it = shard.ids.find(username);
+	if(it == shard.ids.end()) {
+		return INVALID_USER;
+	}
+	return it->second;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include "AppendOnlyVector.h"
+
+// Dense integer handle for a username. IDs are assigned in
+// registration order starting at 0, so they can index vectors directly.
+typedef int UserId;
+const UserId INVALID_USER = -1;
+
+/*
+	Interns each username exactly once and maps it to a UserId.
+	Lookups in both directions are O(1): username -> id through a
+	hash map, id -> username through a vector indexed by id.
+
+	Safe to use from many threads. The name -> id map is split into
+	shards by username hash, each behind its own reader-writer lock,
+	and id -> name reads take no lock at all.
+*/
+class UserRegistry {
+
+public:
+	UserRegistry() {};
+	virtual ~UserRegistry() {};
+
+	// Returns the id of username, registering it if it is new
+	UserId intern(const std::string &username);
+
+	// Returns the id of username, or INVALID_USER if not registered
+	UserId find(const std::string &username);
+
+	// Returns the username for a valid id
+	const std::string& name(UserId id) const { return names[id]; }
+
+	bool contains(UserId id) const { return id >= 0 && id < names.size(); }
+	int size() const { return names.size(); }
+
+private:
+	static const int NUM_SHARDS = 16;
+
+	struct Shard {
+		std::shared_mutex mtx;
+		std::unordered_map<std::string, UserId> ids;
+	};
+	Shard shards[NUM_SHARDS];
+	AppendOnlyVector<std::string> names;
+
+	Shard& shardOf(const std::string &username) {
+		return shards[std::hash<std::string>()(username) % NUM_SHARDS];
+	}
+};
@@ -0,0 +1,56 @@
+#include "WorkerPool.h"
+
+using namespace std;
+
+WorkerPool::WorkerPool(int numThreads)
+{
+	for(int i = 0; i < numThreads; i++) {
+		workers.push_back(thread(&WorkerPool::run, this));
+	}
+}
+
+// Finishes queued tasks before returning
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		stopping = true;
+	}
+	cv.notify_all();
+
+	for(thread &worker : workers) {
+		worker.join();
+	}
+}
+
+void WorkerPool::submit(function<void()> task)
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		tasks.push_back(std::move(task));
+	}
+	cv.notify_one();
+}
+
+int WorkerPool::backlog()
+{
+	lock_guard<mutex> lock(mtx);
+	return (int)tasks.size();
+}
+
+void WorkerPool::run()
+{
+	while(true) {
+		function<void()> task;
+		{
+			unique_lock<mutex> lock(mtx);
+			cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if(tasks.empty()) {
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
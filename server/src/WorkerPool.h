@@ -0,0 +1,34 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+	Fixed set of threads draining a shared task queue.
+	Used to run blocking work (file writes, replication RPCs)
+	off the gRPC callback threads, which must never block.
+*/
+class WorkerPool {
+
+public:
+	WorkerPool(int numThreads);
+	virtual ~WorkerPool();
+
+	void submit(std::function<void()> task);
+
+	// Tasks waiting for a free thread
+	int backlog();
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	void run();
+};
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+
+#include "WriteAheadLog.h"
+
+using namespace std;
+
+WriteAheadLog::WriteAheadLog(const string &path, Durability durability, int syncIntervalMs)
+	: path(path), durability(durability), syncInterval(syncIntervalMs)
+{
+
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		stopping = true;
+	}
+	pendingCv.notify_one();
+
+	if(committer.joinable()) {
+		committer.join();
+	}
+	if(fd >= 0) {
+		::close(fd);
+	}
+}
+
+bool WriteAheadLog::parseDurability(const string &name, Durability &durability)
+{
+	if(name == "none") {
+		durability = NONE;
+	} else if(name == "interval") {
+		durability = INTERVAL;
+	} else if(name == "batch") {
+		durability = BATCH;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+int WriteAheadLog::open(const string &header)
+{
+	fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if(fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == -1) {
+		return -1;
+	}
+	if(st.st_size == 0 && header != "") {
+		if(!writeBatch(header, true)) {
+			return -1;
+		}
+	}
+
+	committer = thread(&WriteAheadLog::commitLoop, this);
+	return 0;
+}
+
+uint64_t WriteAheadLog::append(const string &record)
+{
+	uint64_t ticket;
+	{
+		lock_guard<mutex> lock(mtx);
+		pending += record;
+		ticket = nextTicket++;
+		numRecords++;
+	}
+	pendingCv.notify_one();
+	return ticket;
+}
+
+int WriteAheadLog::wait(uint64_t ticket)
+{
+	unique_lock<mutex> lock(mtx);
+	committedCv.wait(lock, [this, ticket] { return committedTicket >= ticket; });
+	return failed ? -1 : 0;
+}
+
+int WriteAheadLog::flush()
+{
+	uint64_t ticket;
+	{
+		lock_guard<mutex> lock(mtx);
+		ticket = nextTicket - 1;
+	}
+	return wait(ticket);
+}
+
+int64_t WriteAheadLog::length()
+{
+	flush();
+
+	lock_guard<mutex> lock(ioMtx);
+	struct stat st;
+	if(fstat(fd, &st) == -1) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+string WriteAheadLog::stats()
+{
+	lock_guard<mutex> lock(mtx);
+	string avgBatch = numBatches > 0 ? to_string(numRecords / numBatches) : "0";
+	return "records: " + to_string(numRecords) + ", "
+		"batches: " + to_string(numBatches) + ", "
+		"avg batch: " + avgBatch + ", "
+		"max batch: " + to_string(maxBatch) + ", "
+		"syncs: " + to_string(numSyncs);
+}
+
+// Writes all of data to fd, retrying short writes
+static bool writeAll(int fd, const char *data, size_t size)
+{
+	size_t written = 0;
+	while(written < size) {
+		ssize_t n = ::write(fd, data + written, size - written);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		written += n;
+	}
+	return true;
+}
+
+int WriteAheadLog::replacePrefix(uint64_t length, const string &prefix)
+{
+	flush();
+
+	lock_guard<mutex> lock(ioMtx);
+	struct stat st;
+	if(fstat(fd, &st) == -1 || (uint64_t)st.st_size < length) {
+		return -1;
+	}
+	uint64_t size = st.st_size;
+
+	string tmpPath = path + ".compact";
+	int in = ::open(path.c_str(), O_RDONLY);
+	int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = in >= 0 && out >= 0 && writeAll(out, prefix.data(), prefix.size());
+
+	string block(1024 * 1024, '\0');
+	uint64_t offset = length;
+	while(ok && offset < size) {
+		ssize_t n = pread(in, &block[0], (size_t)min<uint64_t>(block.size(), size - offset), offset);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		ok = n > 0 && writeAll(out, block.data(), n);
+		offset += ok ? n : 0;
+	}
+	ok = ok && fdatasync(out) == 0;
+
+	if(in >= 0) {
+		::close(in);
+	}
+	if(out >= 0) {
+		::close(out);
+	}
+	if(!ok || rename(tmpPath.c_str(), path.c_str()) == -1) {
+		unlink(tmpPath.c_str());
+		return -1;
+	}
+
+	// Everything written through the old descriptor was copied
+	int newFd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+	if(newFd < 0) {
+		lock_guard<mutex> failLock(mtx);
+		failed = true;
+		return -1;
+	}
+	::close(fd);
+	fd = newFd;
+	return 0;
+}
+
+// Writes all of batch and syncs if asked
+bool WriteAheadLog::writeBatch(const string &batch, bool sync)
+{
+	lock_guard<mutex> lock(ioMtx);
+	if(!writeAll(fd, batch.data(), batch.size())) {
+		return false;
+	}
+	return !sync || fdatasync(fd) == 0;
+}
+
+bool WriteAheadLog::syncFile()
+{
+	lock_guard<mutex> lock(ioMtx);
+	return fdatasync(fd) == 0;
+}
+
+/*
+	Group commit loop. Takes everything pending as one batch, writes it
+	outside the lock so appends can keep queueing, then releases every
+	waiter in the batch at once. In INTERVAL mode written data is synced
+	at most syncInterval after it was written.
+*/
+void WriteAheadLog::commitLoop()
+{
+	bool dirty = false;
+	chrono::steady_clock::time_point nextSync;
+
+	unique_lock<mutex> lock(mtx);
+	while(true) {
+		auto ready = [this] { return stopping || !pending.empty(); };
+		if(dirty) {
+			pendingCv.wait_until(lock, nextSync, ready);
+		} else {
+			pendingCv.wait(lock, ready);
+		}
+
+		if(!pending.empty()) {
+			string batch;
+			batch.swap(pending);
+			uint64_t batchEnd = nextTicket - 1;
+			long batchRecords = (long)(batchEnd - committedTicket);
+
+			lock.unlock();
+			bool ok = writeBatch(batch, durability == BATCH);
+			lock.lock();
+
+			if(durability == BATCH) {
+				numSyncs++;
+			} else if(durability == INTERVAL && ok && !dirty) {
+				dirty = true;
+				nextSync = chrono::steady_clock::now() + syncInterval;
+			}
+
+			failed = failed || !ok;
+			committedTicket = batchEnd;
+			numBatches++;
+			maxBatch = max(maxBatch, batchRecords);
+			committedCv.notify_all();
+		}
+
+		if(dirty && (stopping || chrono::steady_clock::now() >= nextSync)) {
+			lock.unlock();
+			syncFile();
+			lock.lock();
+
+			numSyncs++;
+			dirty = false;
+		}
+
+		if(stopping && pending.empty()) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+	Append-only log file with group commit.
+
+	The file stays open for the life of the log. append() only copies the
+	record into a pending buffer and returns a ticket, so callers can
+	append while holding their own locks and records land in the file in
+	append order. Tickets count appends since the log was opened and are
+	not stored; they are unrelated to the LSNs in the records (see LogFormat). A single commit thread writes everything
+	pending with one write() and, depending on the durability mode, syncs.
+	Records appended while a batch is being written form the next batch,
+	so concurrent appenders share one write and one fsync.
+
+	wait(ticket) blocks until the record is committed to the chosen level:
+		NONE:     written to the OS, never explicitly synced
+		INTERVAL: written to the OS, synced every syncIntervalMs
+		BATCH:    written and synced before wait returns
+*/
+class WriteAheadLog {
+
+public:
+	enum Durability {
+		NONE,
+		INTERVAL,
+		BATCH
+	};
+
+	WriteAheadLog(const std::string &path, Durability durability, int syncIntervalMs);
+	virtual ~WriteAheadLog();
+
+	// Opens the file for appending, creating it if needed. header is
+	// written first if the file is empty. Returns 0 on success and -1 on failure.
+	int open(const std::string &header = "");
+
+	// Queues record and returns its ticket. Tickets start at 1.
+	uint64_t append(const std::string &record);
+
+	// Blocks until the record with ticket is committed. Returns -1 if the log failed to write.
+	int wait(uint64_t ticket);
+
+	// Blocks until every record appended so far is committed
+	int flush();
+
+	// Length of the file once everything appended so far is written, or
+	// -1 on failure. Later appends never change the bytes before it.
+	int64_t length();
+
+	/*
+		Replaces the first length bytes of the file with prefix. The rest
+		is copied after it into a new file that is synced and renamed over
+		the log, so a crash leaves either the old file or the new one.
+		Appends keep queueing meanwhile but are written once it returns.
+		Returns 0 on success and -1 on failure, leaving the file as it was.
+	*/
+	int replacePrefix(uint64_t length, const std::string &prefix);
+
+	std::string stats();
+
+	static bool parseDurability(const std::string &name, Durability &durability);
+
+private:
+	std::string path;
+	Durability durability;
+	std::chrono::milliseconds syncInterval;
+	int fd = -1;
+
+	std::mutex mtx;
+	std::condition_variable pendingCv;
+	std::condition_variable committedCv;
+	std::string pending;
+	uint64_t nextTicket = 1;
+	uint64_t committedTicket = 0;
+	bool failed = false;
+	bool stopping = false;
+
+	// Held by the commit thread while it writes or syncs fd, so reads
+	// never see a partial batch and fd is only replaced between batches
+	std::mutex ioMtx;
+
+	long numRecords = 0;
+	long numBatches = 0;
+	long numSyncs = 0;
+	long maxBatch = 0;
+
+	std::thread committer;
+
+	void commitLoop();
+	bool writeBatch(const std::string &batch, bool sync);
+	bool syncFile();
+};
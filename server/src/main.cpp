@@ -1,7 +1,10 @@
 #include <iostream>
 #include <string>
+#include <thread>
 
+#include "Benchmarks.h"
 #include "SNSServer.h"
+#include "SNSCallbackService.h"
 
 using grpc::ServerBuilder;
 
@@ -12,10 +15,20 @@ using namespace std;
 // ------------------
 void RunServer(string IP, string port, 
 				string coordIP, string coordPort,
-				int serverId, int clusterId) {
+				int serverId, int clusterId, int fanoutThreshold,
+				int sendQueueCapacity, TimelineSubscriber::OverflowPolicy overflowPolicy,
+				bool useCallbackApi, int numWorkers, WriteAheadLog::Durability durability,
+				Replicator::AckPolicy ackPolicy, int batchDelayUs, int checkpointInterval, int keepaliveMs) {
 
 	string server_address = IP + ":" + port;
 	SNSServer service;
+	service.setFanoutThreshold(fanoutThreshold);
+	service.setSendQueue(sendQueueCapacity, overflowPolicy);
+	service.setDurability(durability);
+	service.setAckPolicy(ackPolicy);
+	service.setBatchDelay(batchDelayUs);
+	service.setCheckpointInterval(checkpointInterval);
+	service.setKeepaliveInterval(keepaliveMs);
 
 	// connect to coord
 	int ret = service.connectToCoordinator(IP, port, coordIP, coordPort, clusterId, serverId);
@@ -26,10 +39,19 @@ void RunServer(string IP, string port,
 
 	ServerBuilder builder;
 	builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-	builder.RegisterService(&service);
+
+	// Both services share the same state in SNSServer
+	unique_ptr<SNSCallbackService> callbackService;
+	if(useCallbackApi) {
+		callbackService.reset(new SNSCallbackService(&service, numWorkers));
+		builder.RegisterService(callbackService.get());
+	} else {
+		builder.RegisterService(&service);
+	}
 	unique_ptr<Server> server(builder.BuildAndStart());
   
-	log(INFO, "Server listening on " + server_address);
+	log(INFO, "Server listening on " + server_address + " using the " +
+		(useCallbackApi ? "callback API with " + to_string(numWorkers) + " workers" : "sync API"));
 
 	server->Wait();
 }
@@ -42,9 +64,22 @@ int main(int argc, char** argv) {
 	string coordPort = "9000";
 	string IP = "localhost";
 	string port = "10000";
+	int fanoutThreshold = 1000;
+	int sendQueueCapacity = 256;
+	TimelineSubscriber::OverflowPolicy overflowPolicy = TimelineSubscriber::DROP_OLDEST;
+	bool useCallbackApi = true;
+	int numWorkers = max(8, 2 * (int)thread::hardware_concurrency());
+	WriteAheadLog::Durability durability = WriteAheadLog::INTERVAL;
+	Replicator::AckPolicy ackPolicy = Replicator::ACK_QUORUM;
+	int batchDelayUs = 200;
+	int checkpointInterval = 60;
+	int keepaliveMs = 3000;
+	bool convertLogs = false;
+	string benchmark;
+	int benchmarkSize = 0;
 
 	int opt = 0;
-	while ((opt = getopt(argc, argv, "c:s:h:k:i:p:")) != -1) {
+	while ((opt = getopt(argc, argv, "c:s:h:k:i:p:f:q:o:m:w:d:a:b:t:e:uB:n:")) != -1) {
 		switch(opt) {
 			case 'c':
 				clusterId = stoi(optarg); break;
@@ -58,6 +93,46 @@ int main(int argc, char** argv) {
 				IP = optarg; break;
 			case 'p':
 				port = optarg; break;
+			case 'f':
+				fanoutThreshold = stoi(optarg); break;
+			case 'q':
+				sendQueueCapacity = stoi(optarg); break;
+			case 'o':
+				if(!TimelineSubscriber::parsePolicy(optarg, overflowPolicy)) {
+					cerr << "Invalid overflow policy. Use drop, coalesce or disconnect\n";
+				}
+				break;
+			case 'm':
+				if(string(optarg) == "sync") {
+					useCallbackApi = false;
+				} else if(string(optarg) != "callback") {
+					cerr << "Invalid server mode. Use sync or callback\n";
+				}
+				break;
+			case 'w':
+				numWorkers = max(1, stoi(optarg)); break;
+			case 'd':
+				if(!WriteAheadLog::parseDurability(optarg, durability)) {
+					cerr << "Invalid durability. Use none, interval or batch\n";
+				}
+				break;
+			case 'a':
+				if(!Replicator::parseAckPolicy(optarg, ackPolicy)) {
+					cerr << "Invalid ack policy. Use none, quorum or all\n";
+				}
+				break;
+			case 'b':
+				batchDelayUs = max(0, stoi(optarg)); break;
+			case 't':
+				checkpointInterval = max(0, stoi(optarg)); break;
+			case 'e':
+				keepaliveMs = max(1, stoi(optarg)); break;
+			case 'u':
+				convertLogs = true; break;
+			case 'B':
+				benchmark = optarg; break;
+			case 'n':
+				benchmarkSize = stoi(optarg); break;
 			default:
 				cerr << "Invalid Command Line Argument\n"; break;
 		}
@@ -67,7 +142,20 @@ int main(int argc, char** argv) {
   	google::InitGoogleLogging(log_file_name.c_str());
   	log(INFO, "Logging Initialized. Server starting...");
 
-  	RunServer(IP, port, coordIP, coordPort, serverId, clusterId);
+  	// Convert this server's text logs and exit without serving
+  	if(convertLogs) {
+  		SNSServer service;
+  		return service.convertTextLogs(clusterId, serverId) == 0 ? 0 : 1;
+  	}
+
+  	// Run a benchmark and exit without serving
+  	if(!benchmark.empty()) {
+  		return runBenchmark(benchmark, benchmarkSize) == 0 ? 0 : 1;
+  	}
+
+  	RunServer(IP, port, coordIP, coordPort, serverId, clusterId, fanoutThreshold,
+  			sendQueueCapacity, overflowPolicy, useCallbackApi, numWorkers, durability, ackPolicy, batchDelayUs,
+  			checkpointInterval, keepaliveMs);
 
   	return 0;
 }
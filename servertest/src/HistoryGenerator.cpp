@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <fstream>
+
+#include "HistoryGenerator.h"
+
+using namespace std;
+
+HistoryGenerator::HistoryGenerator(int numUsers, unsigned seed)
+	: rng(seed), userinfoLog(LogFormat::header()), postsLog(LogFormat::header())
+{
+	for(UserId id = 0; id < numUsers; id++) {
+		string name = "user" + to_string(id);
+		LogFormat::encodeUser(userinfoLog, ++lsn, id, name);
+		expected.users.push_back(name);
+	}
+}
+
+void HistoryGenerator::run(long toggles, int posts)
+{
+	int numUsers = expected.users.size();
+	uniform_int_distribution<UserId> anyUser(0, numUsers - 1);
+	long remaining = toggles + posts;
+	while(remaining > 0) {
+		UserId user = anyUser(rng);
+		bool post = uniform_int_distribution<long>(1, remaining)(rng) <= posts;
+		remaining--;
+		lsn++;
+
+		if(post) {
+			posts--;
+			LogFormat::encodePost(postsLog, lsn, user, timeOf(lsn), "post " + to_string(lsn) + " by " + expected.users[user]);
+			continue;
+		}
+
+		UserId target = anyUser(rng);
+		if(target == user) {
+			target = (target + 1) % numUsers;
+		}
+		auto edge = expected.follows.find({user, target});
+		if(edge == expected.follows.end()) {
+			LogFormat::encodeFollow(userinfoLog, lsn, user, target, timeOf(lsn));
+			expected.follows[{user, target}] = timeOf(lsn);
+		} else {
+			LogFormat::encodeUnfollow(userinfoLog, lsn, user, target);
+			expected.follows.erase(edge);
+		}
+	}
+}
+
+void HistoryGenerator::applied(uint64_t queue, uint64_t seq)
+{
+	LogFormat::encodeApplied(userinfoLog, queue, seq);
+	expected.applied[queue] = seq;
+}
+
+/*
+	Users are introduced by their first USER record, a repeated follow
+	keeps its first time, and unfollows of follows that don't stand are
+	ignored, as in SNSServer::processUserInfoFromFile. A checkpoint
+	replays like any other records.
+*/
+HistoryGenerator::State HistoryGenerator::replay(const string &userinfo)
+{
+	State state;
+	vector<bool> known;
+	auto isKnown = [&known](UserId id) {
+		return id >= 0 && id < (int)known.size() && known[id];
+	};
+
+	LogReader reader(userinfo);
+	LogRecord record;
+	while(reader.next(record) == 1) {
+		if(record.type == RECORD_USER && record.user >= 0 && !isKnown(record.user)) {
+			if(record.user >= (int)known.size()) {
+				known.resize(record.user + 1);
+				state.users.resize(record.user + 1);
+			}
+			known[record.user] = true;
+			state.users[record.user] = string(record.text);
+		} else if(record.type == RECORD_FOLLOW && isKnown(record.user) && isKnown(record.target)) {
+			state.follows.emplace(make_pair(record.user, record.target), record.timeNanos);
+		} else if(record.type == RECORD_UNFOLLOW) {
+			state.follows.erase({record.user, record.target});
+		} else if(record.type == RECORD_APPLIED) {
+			uint64_t &seq = state.applied[record.queue];
+			seq = max(seq, record.seq);
+		}
+	}
+	return state;
+}
+
+int HistoryGenerator::save(const string &dir) const
+{
+	ofstream userinfo(dir + "/userinfo", ios::binary | ios::trunc);
+	ofstream posts(dir + "/posts", ios::binary | ios::trunc);
+	userinfo << userinfoLog;
+	posts << postsLog;
+	return userinfo && posts ? 0 : -1;
+}
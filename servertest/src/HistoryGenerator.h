@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "LogFormat.h"
+
+/*
+	Writes a synthetic history into a userinfo and a posts log, as a
+	cluster master would: every user logs in first, then random users
+	toggle follows of one another and post, each operation under the
+	next LSN. The same seed always gives the same logs.
+
+	It also keeps the state those logs should replay to, so a replay
+	or a checkpoint of them can be checked against it.
+*/
+class HistoryGenerator {
+
+public:
+	// The state a userinfo log replays to
+	struct State {
+		std::vector<std::string> users;	// by id
+		std::map<std::pair<UserId, UserId>, int64_t> follows;	// follow time by follower and followee
+		std::map<uint64_t, uint64_t> applied;	// last seq by replication queue
+
+		bool operator==(const State &other) const {
+			return users == other.users && follows == other.follows && applied == other.applied;
+		}
+	};
+
+	HistoryGenerator(int numUsers, unsigned seed);
+
+	// Appends toggles follows or unfollows and posts posts, interleaved at random
+	void run(long toggles, int posts);
+
+	// Appends an APPLIED record, as after a replicated batch
+	void applied(uint64_t queue, uint64_t seq);
+
+	// Both logs start with their header
+	const std::string& userinfo() const { return userinfoLog; }
+	const std::string& posts() const { return postsLog; }
+
+	uint64_t lastLsn() const { return lsn; }
+	const State& state() const { return expected; }
+
+	// Replays a userinfo log the way a server does
+	static State replay(const std::string &userinfo);
+
+	// Writes both logs to dir/userinfo and dir/posts. Returns -1 on failure.
+	int save(const std::string &dir) const;
+
+private:
+	std::mt19937_64 rng;
+	std::string userinfoLog;
+	std::string postsLog;
+	uint64_t lsn = 0;
+	State expected;
+
+	static const int64_t START_NANOS = 1700000000LL * 1000000000LL;
+
+	// Each operation is a millisecond after the one before
+	int64_t timeOf(uint64_t lsn) const { return START_NANOS + (int64_t)lsn * 1000000; }
+};
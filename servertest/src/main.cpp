@@ -0,0 +1,502 @@
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "HistoryGenerator.h"
+#include "LogCompactor.h"
+#include "LsnSet.h"
+#include "ReplicaJournal.h"
+#include "Snapshot.h"
+
+using SNS::Operation;
+using SNS::Request;
+using SNS::SiblingRequest;
+using SNS::SnapshotChunk;
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+/*
+	Checks of the server's logs, checkpoints, snapshots and replication
+	journals, built from the server sources without gRPC. Registered
+	with ctest; run with no arguments it runs every test and exits 1 if
+	any check failed.
+
+	servertest -g <dir> [-u <users>] [-n <toggles>] [-p <posts>] [-r <seed>]
+	instead writes a synthetic history to dir/userinfo and dir/posts,
+	which a server started on a copy of them replays at startup.
+*/
+
+static int numChecks = 0;
+static int numFailed = 0;
+
+#define CHECK(cond) \
+	do { \
+		numChecks++; \
+		if(!(cond)) { \
+			numFailed++; \
+			cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+		} \
+	} while(0)
+
+// A directory of its own under /tmp, removed with everything in it
+class TempDir {
+
+public:
+	TempDir() {
+		char name[] = "/tmp/servertest.XXXXXX";
+		if(mkdtemp(name) == NULL) {
+			cerr << "Could not create a temporary directory" << endl;
+			exit(1);
+		}
+		path = name;
+	}
+	virtual ~TempDir() {
+		error_code ec;
+		fs::remove_all(path, ec);
+	}
+
+	const string& name() const { return path; }
+	string file(const string &name) const { return path + "/" + name; }
+
+private:
+	string path;
+};
+
+static void writeFile(const string &path, const string &data)
+{
+	ofstream out(path, ios::binary | ios::trunc);
+	out << data;
+}
+
+// Every record of a log, header first
+static vector<LogRecord> records(const string &log)
+{
+	vector<LogRecord> out;
+	LogReader reader(log);
+	LogRecord record;
+	while(reader.next(record) == 1) {
+		out.push_back(record);
+	}
+	return out;
+}
+
+static Request request(const string &username, const string &argument)
+{
+	Request request;
+	request.set_username(username);
+	request.add_arguments(argument);
+	return request;
+}
+
+// ---- CHECKPOINTS ----
+
+/*
+	Folds the first half of a history into a checkpoint, then folds the
+	log that results again, and replays each to the state the history
+	built, replication queues included.
+*/
+static void testCheckpoint()
+{
+	TempDir dir;
+	HistoryGenerator history(200, 1);
+	history.run(10000, 250);
+	history.applied(7, 100);
+	history.applied(9, 50);
+	history.run(10000, 250);
+	history.applied(7, 180);
+	uint64_t userinfoLength = history.userinfo().size();
+	uint64_t postsLength = history.posts().size();
+	uint64_t checkpointLsn = history.lastLsn();
+	history.run(20000, 500);
+	history.applied(9, 90);
+	CHECK(history.save(dir.name()) == 0);
+
+	CHECK(HistoryGenerator::replay(history.userinfo()) == history.state());
+
+	LogCompactor first(dir.file("userinfo"), userinfoLength, dir.file("posts"), postsLength, 0);
+	CHECK(first.run() == 0);
+	CHECK(first.lsn() == checkpointLsn);
+
+	vector<LogRecord> folded = records(first.checkpoint());
+	CHECK(!folded.empty() && folded.back().type == RECORD_CHECKPOINT);
+	CHECK(!folded.empty() && LogFormat::missingLsns(folded.back()).empty());
+
+	string compacted = first.checkpoint() + history.userinfo().substr(userinfoLength);
+	CHECK(compacted.size() < history.userinfo().size());
+	CHECK(HistoryGenerator::replay(compacted) == history.state());
+
+	// A checkpoint folded again with everything after it
+	writeFile(dir.file("userinfo"), compacted);
+	HistoryGenerator::State state = history.state();
+	LogCompactor second(dir.file("userinfo"), compacted.size(), dir.file("posts"), history.posts().size(), 0);
+	CHECK(second.run() == 0);
+	CHECK(second.lsn() == history.lastLsn());
+	CHECK(HistoryGenerator::replay(second.checkpoint()) == state);
+
+	// Only the users, standing follows and the last APPLIED record of each queue are left
+	CHECK(records(second.checkpoint()).size() == state.users.size() + state.follows.size() + state.applied.size() + 1);
+}
+
+// ---- LOG FILES ----
+
+// How many records a LogFileReader reads from a log, and what next returned after them
+static pair<size_t, int> readRecords(const string &path, uint64_t length)
+{
+	LogFileReader reader(path, length, 4096);
+	if(reader.open() != 0) {
+		return {0, -1};
+	}
+
+	size_t numRecords = 0;
+	string_view frame;
+	int ret;
+	while((ret = reader.next(frame)) == 1) {
+		numRecords++;
+	}
+	return {numRecords, ret};
+}
+
+/*
+	Reads a log in blocks whole, with its last record torn, and with a
+	record's length corrupted to near 2^31. Both damaged logs end in an
+	error at the damage, without a buffer sized by the corrupt length.
+*/
+static void testLogFileReader()
+{
+	TempDir dir;
+	HistoryGenerator history(50, 3);
+	history.run(2000, 50);
+	const string &log = history.userinfo();
+
+	// Where each record starts
+	vector<size_t> offsets;
+	writeFile(dir.file("whole"), log);
+	LogFileReader whole(dir.file("whole"), log.size(), 4096);
+	CHECK(whole.open() == 0);
+	string_view frame;
+	size_t offset = LogFormat::HEADER_SIZE;
+	while(whole.next(frame) == 1) {
+		offsets.push_back(offset);
+		offset += frame.size();
+	}
+	CHECK(offset == log.size());
+	CHECK(offsets.size() > 20);
+	CHECK(readRecords(dir.file("whole"), log.size()) == make_pair(offsets.size(), 0));
+
+	writeFile(dir.file("torn"), log.substr(0, log.size() - 3));
+	CHECK(readRecords(dir.file("torn"), log.size() - 3) == make_pair(offsets.size() - 1, -1));
+
+	string corrupt = log;
+	corrupt.replace(offsets[10], 4, "\xf0\xff\xff\x7f");
+	writeFile(dir.file("corrupt"), corrupt);
+	CHECK(readRecords(dir.file("corrupt"), corrupt.size()) == make_pair((size_t)10, -1));
+}
+
+// ---- SNAPSHOTS ----
+
+// The records a Snapshot sends, from both logs
+static vector<LogRecord> sent(Snapshot &snapshot, string &buffer)
+{
+	SnapshotChunk chunk;
+	while(snapshot.next(chunk)) {
+		buffer += chunk.userinfo();
+		buffer += chunk.posts();
+	}
+
+	vector<LogRecord> out;
+	LogReader reader(buffer.data(), buffer.size(), LogFormat::VERSION);
+	LogRecord record;
+	while(reader.next(record) == 1) {
+		out.push_back(record);
+	}
+	return out;
+}
+
+/*
+	A master whose userinfo log starts with a checkpoint answers slaves
+	that have part of its history. Only one whose last LSN is past the
+	checkpoint, and who lacks nothing the checkpoint replaced, gets a tail.
+*/
+static void testSelectTail()
+{
+	TempDir dir;
+	HistoryGenerator history(50, 2);
+	history.run(4000, 200);
+	CHECK(history.save(dir.name()) == 0);
+
+	LogCompactor compactor(dir.file("userinfo"), history.userinfo().size(), dir.file("posts"), history.posts().size(), 0);
+	CHECK(compactor.run() == 0);
+	uint64_t checkpointLsn = compactor.lsn();
+
+	// The master carried on after its checkpoint
+	size_t folded = history.userinfo().size();
+	history.run(4000, 200);
+	string userinfo = compactor.checkpoint() + history.userinfo().substr(folded);
+	writeFile(dir.file("userinfo"), userinfo);
+	writeFile(dir.file("posts"), history.posts());
+
+	const vector<string> &names = history.state().users;
+	auto nameOf = [&names](UserId id) {
+		return (id >= 0 && id < (int)names.size()) ? string_view(names[id]) : string_view();
+	};
+
+	// Every record after the checkpoint, by LSN
+	map<uint64_t, LogRecord> after;
+	for(const LogRecord &record : records(userinfo)) {
+		if(record.lsn > checkpointLsn) {
+			after[record.lsn] = record;
+		}
+	}
+	for(const LogRecord &record : records(history.posts())) {
+		if(record.lsn > checkpointLsn) {
+			after[record.lsn] = record;
+		}
+	}
+	CHECK(after.size() == history.lastLsn() - checkpointLsn);
+
+	auto open = [&](unique_ptr<Snapshot> &snapshot) {
+		snapshot = make_unique<Snapshot>(dir.file("userinfo"), userinfo.size(), dir.file("posts"), history.posts().size(), 4096);
+		CHECK(snapshot->open() == 0);
+	};
+	auto ask = [&](uint64_t last, const LogRecord &record) {
+		SiblingRequest request;
+		request.set_last_lsn(last);
+		request.set_last_fingerprint(LogFormat::fingerprint(record, nameOf(record.user), nameOf(record.target)));
+		return request;
+	};
+
+	// Past the checkpoint: only the rest, and the users it refers to
+	uint64_t last = checkpointLsn + (history.lastLsn() - checkpointLsn) / 2;
+	uint64_t lacked = last - 10;
+	SiblingRequest request = ask(last, after[last]);
+	request.add_missing_lsns(lacked);
+
+	unique_ptr<Snapshot> snapshot;
+	open(snapshot);
+	CHECK(snapshot->selectTail(request, nameOf));
+	CHECK(snapshot->isTail());
+
+	string buffer;
+	set<uint64_t> lsns;
+	for(const LogRecord &record : sent(*snapshot, buffer)) {
+		if(record.type == RECORD_USER) {
+			CHECK(record.lsn <= checkpointLsn || record.lsn > last);
+			continue;
+		}
+		CHECK(record.lsn > last || record.lsn == lacked);
+		lsns.insert(record.lsn);
+	}
+	CHECK(lsns.size() == history.lastLsn() - last + 1);
+	CHECK(lsns.count(lacked) == 1);
+
+	// At the checkpoint itself: its fingerprint stands for the record
+	open(snapshot);
+	LogRecord checkpoint = records(compactor.checkpoint()).back();
+	CHECK(snapshot->selectTail(ask(checkpointLsn, checkpoint), nameOf));
+
+	// Behind the checkpoint, or lacking what it replaced: a full snapshot
+	open(snapshot);
+	CHECK(!snapshot->selectTail(ask(checkpointLsn - 1, checkpoint), nameOf));
+
+	SiblingRequest behind = ask(last, after[last]);
+	behind.add_missing_lsns(checkpointLsn - 1);
+	open(snapshot);
+	CHECK(!snapshot->selectTail(behind, nameOf));
+
+	// A record at the same LSN that differs: a full snapshot
+	SiblingRequest diverged = ask(last, after[last]);
+	diverged.set_last_fingerprint(diverged.last_fingerprint() + 1);
+	open(snapshot);
+	CHECK(!snapshot->selectTail(diverged, nameOf));
+	CHECK(!snapshot->isTail());
+
+	string full;
+	CHECK(sent(*snapshot, full).size() == records(userinfo).size() + records(history.posts()).size());
+}
+
+// ---- REPLICA JOURNAL ----
+
+/*
+	Operations left unacked survive a compaction and a reopen unchanged,
+	under the same queue id.
+*/
+static void testReplicaJournal()
+{
+	TempDir dir;
+	string path = dir.file("journal");
+
+	vector<ReplicaJournal::Entry> entries;
+	for(uint64_t seq = 1; seq <= 120; seq++) {
+		Operation::Type type = seq % 2 ? Operation::FOLLOW : Operation::UNFOLLOW;
+		shared_ptr<const Request> shared = make_shared<const Request>(request("user" + to_string(seq), "user" + to_string(seq + 1)));
+		entries.push_back({seq, (int64_t)seq * 1000, type, shared});
+	}
+
+	uint64_t queueId;
+	{
+		ReplicaJournal journal(path, WriteAheadLog::NONE, 100);
+		vector<ReplicaJournal::Entry> pending;
+		CHECK(journal.open("cluster1", pending) == 0);
+		CHECK(pending.empty());
+		CHECK(journal.id() != 0);
+		queueId = journal.id();
+
+		for(int i = 0; i < 100; i++) {
+			journal.append(entries[i], entries[i].request->SerializeAsString());
+		}
+		journal.ack(60);
+	}
+	uintmax_t beforeCompaction = fs::file_size(path);
+
+	auto check = [&](ReplicaJournal &journal, const vector<ReplicaJournal::Entry> &pending, uint64_t firstSeq, uint64_t lastSeq) {
+		CHECK(journal.id() == queueId);
+		CHECK(journal.group() == "cluster1");
+		CHECK(journal.lastSeq() == lastSeq);
+		CHECK(pending.size() == lastSeq - firstSeq + 1);
+		for(size_t i = 0; i < pending.size(); i++) {
+			const ReplicaJournal::Entry &expected = entries[firstSeq - 1 + i];
+			CHECK(pending[i].seq == expected.seq);
+			CHECK(pending[i].type == expected.type);
+			CHECK(pending[i].queuedNanos == expected.queuedNanos);
+			CHECK(pending[i].request->SerializeAsString() == expected.request->SerializeAsString());
+		}
+	};
+
+	{
+		ReplicaJournal journal(path, WriteAheadLog::NONE, 100);
+		vector<ReplicaJournal::Entry> pending;
+		CHECK(journal.open("", pending) == 0);
+		check(journal, pending, 61, 100);
+
+		for(int i = 100; i < 120; i++) {
+			journal.append(entries[i], entries[i].request->SerializeAsString());
+		}
+		journal.ack(80);
+		CHECK(journal.compact(0) == 0);
+	}
+	CHECK(fs::file_size(path) < beforeCompaction);
+
+	{
+		ReplicaJournal journal(path, WriteAheadLog::NONE, 100);
+		vector<ReplicaJournal::Entry> pending;
+		CHECK(journal.open("", pending) == 0);
+		check(journal, pending, 81, 120);
+
+		// Everything acked leaves the seqs to go on from
+		journal.ack(120);
+		CHECK(journal.compact(0) == 0);
+	}
+
+	{
+		ReplicaJournal journal(path, WriteAheadLog::NONE, 100);
+		vector<ReplicaJournal::Entry> pending;
+		CHECK(journal.open("", pending) == 0);
+		check(journal, pending, 121, 120);
+		journal.remove();
+	}
+	CHECK(!fs::exists(path));
+}
+
+// ---- LSN SET ----
+
+static void testLsnSet()
+{
+	LsnSet lsns;
+	CHECK(!lsns.contains(1));
+	CHECK(!lsns.contains(1000000));
+
+	lsns.add(63);
+	lsns.add(64);
+	CHECK(lsns.contains(63) && lsns.contains(64));
+	CHECK(!lsns.contains(62) && !lsns.contains(65));
+
+	lsns.add(1000000);
+	CHECK(lsns.contains(1000000));
+	CHECK(!lsns.contains(999999) && !lsns.contains(1000001));
+
+	lsns.addThrough(130);
+	for(uint64_t lsn = 1; lsn <= 130; lsn++) {
+		CHECK(lsns.contains(lsn));
+	}
+	CHECK(!lsns.contains(131));
+	CHECK(lsns.contains(1000000));
+
+	lsns.erase(128);
+	CHECK(!lsns.contains(128));
+	CHECK(lsns.contains(127) && lsns.contains(129));
+
+	// Past the end, nothing to erase
+	lsns.erase(1ULL << 40);
+	CHECK(!lsns.contains(1ULL << 40));
+}
+
+// ------------
+// --- MAIN ---
+// ------------
+
+int main(int argc, char** argv) {
+
+	string dir;
+	int users = 300;
+	long toggles = 1000000;
+	int posts = 10000;
+	unsigned seed = 1;
+
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "g:u:n:p:r:")) != -1) {
+		switch(opt) {
+			case 'g':
+				dir = optarg; break;
+			case 'u':
+				users = max(2, atoi(optarg)); break;
+			case 'n':
+				toggles = atol(optarg); break;
+			case 'p':
+				posts = atoi(optarg); break;
+			case 'r':
+				seed = atoi(optarg); break;
+			default:
+				cerr << "Invalid Command Line Argument\n";
+				return 1;
+		}
+	}
+
+	if(dir != "") {
+		HistoryGenerator history(users, seed);
+		history.run(toggles, posts);
+		if(history.save(dir) == -1) {
+			cerr << "Could not write to " << dir << endl;
+			return 1;
+		}
+		cout << "Wrote " << history.userinfo().size() << " bytes of userinfo and " << history.posts().size() << " of posts "
+			"through LSN " << history.lastLsn() << ", " << history.state().follows.size() << " follows standing" << endl;
+		return 0;
+	}
+
+	struct Test {
+		string name;
+		void (*run)();
+	};
+	Test tests[] = {
+		{"checkpoint", testCheckpoint},
+		{"LogFileReader", testLogFileReader},
+		{"selectTail", testSelectTail},
+		{"ReplicaJournal", testReplicaJournal},
+		{"LsnSet", testLsnSet}
+	};
+
+	for(const Test &test : tests) {
+		int failedBefore = numFailed;
+		test.run();
+		cout << (numFailed == failedBefore ? "ok      " : "FAILED  ") << test.name << endl;
+	}
+	cout << numChecks - numFailed << " of " << numChecks << " checks passed" << endl;
+	return numFailed == 0 ? 0 : 1;
+}
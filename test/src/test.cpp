@@ -1,9 +1,13 @@
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <sstream>
 #include <limits.h>
 
 #include "FSWrapper/FSWrapper.h"
+#include "FSWrapper/FSLocal.h"
 #include "FSWrapper/FSMemory.h"
 
 using namespace std;
@@ -22,7 +26,8 @@ string help =
 	"rm <path>: delete file\n"
 	"write <path> <data> (data in double quotes): appends data to file (creates if doesnt exist)\n"
 	"createdirs <true or false>: create dirs if they dont exist (default false)\n"
-	"save <folder path>: saves the filesystem to the specified folder\n";
+	"save <folder path>: saves the filesystem to the specified folder\n"
+	"bench <local path>: compares the ways FSLocal reads a file from disk\n";
 
 bool getLineQuotes(stringstream &ss, string &s, char delim = ' ') {
 	
@@ -56,6 +61,85 @@ bool getLineQuotes(stringstream &ss, string &s, char delim = ' ') {
 	return true;
 }
 
+/*
+	Reads a local file through each FSLocal read path and prints how fast
+	each went. The old line-by-line read is kept here to compare against.
+	Every pass after the first finds the file in the page cache.
+*/
+void benchRead(const string &path) {
+
+	FSLocal local("");
+	double mb = 0;
+	unsigned long sum = 0;
+
+	auto report = [&](const string &name, function<int()> pass) {
+		auto start = chrono::steady_clock::now();
+		if(pass() == -1) {
+			cout << name << ": failed\n";
+			return;
+		}
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << name << ": " << (long)(secs * 1000) << "ms, " << (long)(mb / secs) << " MB/s\n";
+	};
+
+	shared_ptr<FileView> view;
+	if(local.readView(path, view) == -1) {
+		cout << "Reading failed\n";
+		return;
+	}
+	mb = view->size() / (1024.0 * 1024.0);
+	view.reset();
+	cout << path << ": " << mb << " MB\n";
+
+	report("getline", [&]() {
+		ifstream infile(path);
+		string line;
+		string data;
+		while(getline(infile, line)) {
+			data += line + "\n";
+		}
+		sum += data.size();
+		return infile.bad() ? -1 : 0;
+	});
+
+	report("read", [&]() {
+		string data;
+		int ret = local.read(path, data);
+		sum += data.size();
+		return ret;
+	});
+
+	// Pages of a view are only read when touched, so touch one byte in each
+	report("readView", [&]() {
+		shared_ptr<FileView> view;
+		int ret = local.readView(path, view);
+		if(ret == 0) {
+			for(size_t i = 0; i < view->size(); i += 4096) {
+				sum += (unsigned char)view->data()[i];
+			}
+		}
+		return ret;
+	});
+
+	report("readRange 1MB", [&]() {
+		string data;
+		uint64_t offset = 0;
+		do {
+			if(local.readRange(path, data, offset, 1024 * 1024) == -1) {
+				return -1;
+			}
+			offset += data.size();
+			sum += data.size();
+		} while(!data.empty());
+		return 0;
+	});
+
+	// Keeps the passes from being optimized away
+	if(sum == 0) {
+		cout << "File is empty\n";
+	}
+}
+
 vector<string> split(string input) {
     
     stringstream ss(input);
@@ -151,6 +235,10 @@ void processCommand() {
 			FSMemory* temp = &fsm;
 			success = temp->saveToDisk(arg1);
 
+		} else if(command == "bench") {
+
+			benchRead(arg1);
+
 		} else {
 			valid = false;
 		}